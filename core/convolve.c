@@ -29,255 +29,1521 @@ extern void yeti_convolve_z(double dst[], const double src[], int stride,
                             int n, int nafter, const double ker[], int w,
                             int scale, int border, double ws[]);
 
+/* Border conditions BORDER of the above functions: 0 to 4 as for the
+   BORDER keyword of yeti_convolve, YETI_CONVOLVE_MIRROR (mirror without
+   repeating the first/last elements), YETI_CONVOLVE_HALF_MIRROR
+   (half-sample mirror) and any other value for the normalized mode. */
+#define YETI_CONVOLVE_MIRROR      1000
+#define YETI_CONVOLVE_HALF_MIRROR 1001
+
+/* Multi-threaded versions: the lines to convolve are distributed among
+   NTHREADS workers, each worker uses its own part of the workspace WS which
+   must have at least 2*N*NTHREADS elements.  The result does not depend on
+   the number of threads. */
+extern void yeti_convolve_mt_f(float dst[], const float src[], int stride,
+                               int n, int nafter, const float ker[], int w,
+                               int scale, int border, float ws[],
+                               int nthreads);
+extern void yeti_convolve_mt_d(double dst[], const double src[], int stride,
+                               int n, int nafter, const double ker[], int w,
+                               int scale, int border, double ws[],
+                               int nthreads);
+extern void yeti_convolve_mt_c(float dst[], const float src[], int stride,
+                               int n, int nafter, const float ker[], int w,
+                               int scale, int border, float ws[],
+                               int nthreads);
+extern void yeti_convolve_mt_z(double dst[], const double src[], int stride,
+                               int n, int nafter, const double ker[], int w,
+                               int scale, int border, double ws[],
+                               int nthreads);
+
+/* Same as yeti_convolve_mt_* but with a given METHOD:
+   YETI_CONVOLVE_AUTO to choose the fastest method according to the length
+   of the lines and of the kernel, YETI_CONVOLVE_DIRECT for the direct
+   convolution, or YETI_CONVOLVE_FFT to use fast Fourier transforms by the
+   overlap-save method.  The workspace requirements are the same as for
+   yeti_convolve_mt_*, the FFT method allocates its own buffers (and falls
+   back to the direct method if memory cannot be allocated). */
+#define YETI_CONVOLVE_AUTO   0
+#define YETI_CONVOLVE_DIRECT 1
+#define YETI_CONVOLVE_FFT    2
+extern void yeti_convolve_method_f(float dst[], const float src[], int stride,
+                                   int n, int nafter, const float ker[],
+                                   int w, int scale, int border, float ws[],
+                                   int nthreads, int method);
+extern void yeti_convolve_method_d(double dst[], const double src[],
+                                   int stride, int n, int nafter,
+                                   const double ker[], int w, int scale,
+                                   int border, double ws[], int nthreads,
+                                   int method);
+extern void yeti_convolve_method_z(double dst[], const double src[],
+                                   int stride, int n, int nafter,
+                                   const double ker[], int w, int scale,
+                                   int border, double ws[], int nthreads,
+                                   int method);
+
+/* Recursive Gaussian filtering of the lines of SRC with standard deviation
+   SIGMA (in number of elements) and border conditions BORDER (same values
+   as for the convolution).  The workspace WS must have at least
+   yeti_gaussian_workspace(N, SIGMA, NTHREADS) elements.  If SIGMA <= 0, SRC
+   is copied into DST. */
+extern long yeti_gaussian_workspace(int n, double sigma, int nthreads);
+extern void yeti_gaussian_mt_f(float dst[], const float src[], int stride,
+                               int n, int nafter, double sigma, int border,
+                               float ws[], int nthreads);
+extern void yeti_gaussian_mt_d(double dst[], const double src[], int stride,
+                               int n, int nafter, double sigma, int border,
+                               double ws[], int nthreads);
+extern void yeti_gaussian_mt_z(double dst[], const double src[], int stride,
+                               int n, int nafter, double sigma, int border,
+                               double ws[], int nthreads);
+
 #define HAVE_MEMCPY 1 /* use memcpy instead of loops? */
 
+/* Cost model to choose between the direct and the FFT convolution: the
+   cost per output element is 2*W + 1 for the direct convolution and
+   CONVOLVE_FFT_FACTOR*N*log2(N)/(N - K + 1) + CONVOLVE_FFT_OFFSET for the
+   FFT method with transforms of size N and a (dilated) kernel of length K.
+   These constants have been calibrated on a x86_64 processor. */
+#define CONVOLVE_FFT_FACTOR   3.5
+#define CONVOLVE_FFT_OFFSET  12.0
+#define CONVOLVE_FFT_MAX_SIZE (1L << 26)
+
+/* The recursive Gaussian filter is applied to lines padded on both sides by
+   GAUSSIAN_TRUNCATION*SIGMA elements according to the border conditions. */
+#define GAUSSIAN_TRUNCATION 4.0
+
 #if HAVE_MEMCPY
 # include <string.h>
 #endif
+#include <stdlib.h>
+#include <math.h>
+
+/* When convolving along a dimension which is not the first one, up to
+   CONVOLVE_MAX_BLOCK adjacent lines are gathered together in a panel of
+   contiguous lines so that memory is accessed by chunks of contiguous
+   elements.  The number of lines per panel is chosen so that the panels fit
+   in CONVOLVE_CACHE_SIZE bytes (but is at least CONVOLVE_MIN_BLOCK). */
+#define CONVOLVE_MIN_BLOCK     8
+#define CONVOLVE_MAX_BLOCK    64
+#define CONVOLVE_CACHE_SIZE   (256*1024)
+
+/* The interior of the lines (where no border conditions apply) is
+   processed by branch-free kernels.  With GCC on x86 processors, several
+   versions of the generic kernel are compiled and the one best suited to
+   the processor (AVX2 or SSE2) is selected at runtime. */
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 6) && \
+  (defined(__x86_64__) || defined(__i386__)) && defined(__linux__) && \
+  !defined(YETI_NO_TARGET_CLONES)
+# define CONVOLVE_SIMD __attribute__((target_clones("avx2","default")))
+#else
+# define CONVOLVE_SIMD
+#endif
+
+#include "yeti-threads.h"
+
+/* Arguments shared by the workers.  FILTER is the function which filters a
+   single contiguous line of N elements, its last argument is a private
+   workspace of NWS elements. */
+typedef struct _convolve_context convolve_context_t;
+typedef void convolve_filter_t(void* dst, const void* src,
+                               const convolve_context_t* ctx, void* tmp);
+struct _convolve_context {
+  convolve_filter_t* filter;
+  void* dst;
+  const void* src;
+  const void* ker; /* address of central element of the kernel */
+  const void* wgt; /* normalization weights for the recursive filter */
+  void* ws;
+  long nws;        /* size of private workspace for FILTER */
+  const double* spec; /* spectrum of the kernel for the FFT method */
+  const double* twiddle; /* twiddle factors for the FFT method */
+  const long* idx; /* indices of the padding elements */
+  long nfft;       /* size of the FFT */
+  double b[4];     /* coefficients of the recursive filter */
+  int stride, n, w, scale, border;
+  int m;           /* number of padding elements */
+};
+
+/* Border conditions for which missing values are not extrapolated but the
+   result is normalized by the sum of the kernel weights taken into
+   account. */
+#define CONVOLVE_NORMALIZED(border) \
+  ((border) < 0 || ((border) > 4 && (border) != YETI_CONVOLVE_MIRROR && \
+                    (border) != YETI_CONVOLVE_HALF_MIRROR))
+
+/* Yield the index of the element of a line of N elements which is used for
+   the element at index K (which may be out of bounds) according to the
+   border conditions, or -1 if the value is assumed to be zero (or missing
+   for the normalized mode). */
+static long convolve_index(long k, long n, int border)
+{
+  long p;
+  if (k >= 0 && k < n) return k;
+  switch (border) {
+  case 0: /* nearest */
+    return (k < 0 ? 0 : n - 1);
+  case 1: /* zero on the left, nearest on the right */
+    return (k < 0 ? -1 : n - 1);
+  case 2: /* nearest on the left, zero on the right */
+    return (k < 0 ? 0 : -1);
+  case 4: /* periodic */
+    k %= n;
+    return (k < 0 ? k + n : k);
+  case YETI_CONVOLVE_MIRROR: /* edge not repeated */
+    if (n == 1) return 0;
+    p = 2*(n - 1);
+    if ((k %= p) < 0) k += p;
+    return (k < n ? k : p - k);
+  case YETI_CONVOLVE_HALF_MIRROR: /* edge repeated */
+    p = 2*n;
+    if ((k %= p) < 0) k += p;
+    return (k < n ? k : p - 1 - k);
+  default: /* zero or missing */
+    return -1;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* RECURSIVE GAUSSIAN FILTER */
+
+/* Variance of the recursive Gaussian filter (causal and anti-causal
+   passes) whose poles are the powers 1/Q of the reference poles (see
+   gaussian_coefficients).  This is the sum of 2*d/(d - 1)^2 over all the
+   poles d. */
+static double gaussian_variance(double q, const double d[3])
+{
+  double r = pow(d[0], 1.0/q), t = d[1]/q;
+  double a = r*cos(t), b = r*sin(t), u, v, e;
+  u = (a - 1.0)*(a - 1.0) - b*b;
+  v = 2.0*(a - 1.0)*b;
+  r = pow(d[2], 1.0/q);
+  e = r - 1.0;
+  return 4.0*(a*u + b*v)/(u*u + v*v) + 2.0*r/(e*e);
+}
+
+/* Coefficients of the recursive Gaussian filter of Young, van Vliet & van
+   Ginkel ("Recursive Gabor filtering", IEEE Trans. on Signal Processing,
+   vol. 50, pp. 2798-2805, 2002).  The causal pass is:
+     w[i] = B[0]*x[i] + B[1]*w[i-1] + B[2]*w[i-2] + B[3]*w[i-3]
+   and the anti-causal pass is the same in reverse order.  The poles are
+   obtained by scaling the poles of the optimal filter for SIGMA = 2 so that
+   the variance of the filter is exactly SIGMA^2.  The filter has a unit
+   gain. */
+static void gaussian_coefficients(double sigma, double b[4])
+{
+  /* Reference poles in polar form: modulus and argument of the complex
+     pair, then the real pole. */
+  static const double d[3] = {1.7226347640, 0.6210336323, 1.85132};
+  double qa, qb, q, rho, phi, s, var = sigma*sigma;
+  int k;
+
+  /* Find the scaling by bisection (the variance is an increasing function
+     of Q). */
+  qa = 0.0;
+  qb = 1.0;
+  while (gaussian_variance(qb, d) < var) {
+    qa = qb;
+    qb *= 2.0;
+  }
+  for (k = 0; k < 60; ++k) {
+    q = 0.5*(qa + qb);
+    if (gaussian_variance(q, d) < var) {
+      qa = q;
+    } else {
+      qb = q;
+    }
+  }
+  q = 0.5*(qa + qb);
+
+  /* Inverse poles are RHO*exp(+/-i*PHI) and S. */
+  rho = pow(d[0], -1.0/q);
+  phi = d[1]/q;
+  s = pow(d[2], -1.0/q);
+  b[1] = 2.0*rho*cos(phi) + s;
+  b[2] = -(rho*rho + 2.0*rho*s*cos(phi));
+  b[3] = rho*rho*s;
+  b[0] = 1.0 - (b[1] + b[2] + b[3]);
+}
+
+/* Number of elements added on both sides of a line to implement the border
+   conditions of the recursive filter. */
+static int gaussian_margin(double sigma)
+{
+  return (sigma > 0.0 ? (int)ceil(GAUSSIAN_TRUNCATION*sigma) + 3 : 0);
+}
+
+long yeti_gaussian_workspace(int n, double sigma, int nthreads)
+{
+  if (nthreads < 1) nthreads = 1;
+  return n + (3*(long)n + 2*(long)gaussian_margin(sigma))*nthreads;
+}
+/*---------------------------------------------------------------------------*/
+/* FAST FOURIER TRANSFORM */
+
+/* Compute the twiddle factors for a FFT of size N: TW[2*k] = cos(2*pi*k/N)
+   and TW[2*k+1] = sin(2*pi*k/N) for 0 <= k < N/2. */
+static void fft_twiddles(double tw[], long n)
+{
+  const double a = 6.28318530717958647692528676656/n;
+  long k;
+  for (k = 0; k < n/2; ++k) {
+    tw[2*k] = cos(a*k);
+    tw[2*k+1] = sin(a*k);
+  }
+}
+
+/* In-place radix-2 FFT of the N complex values Z (stored as pairs of real
+   and imaginary parts), N must be a power of 2.  The direct transform
+   (SIGN = -1) computes sum_j Z[j]*exp(-2*i*pi*j*k/N), the inverse one (SIGN
+   = +1) is not normalized. */
+static void fft_radix2(double z[], long n, const double tw[], int sign)
+{
+  long i, j, k, m, len, half, step;
+  double re, im, c, s;
+
+  /* Bit reversal permutation. */
+  for (i = 0, j = 0; i < n; ++i) {
+    if (i < j) {
+      re = z[2*i];   z[2*i]   = z[2*j];   z[2*j]   = re;
+      im = z[2*i+1]; z[2*i+1] = z[2*j+1]; z[2*j+1] = im;
+    }
+    for (m = n >> 1; m >= 1 && (j & m); m >>= 1) j ^= m;
+    j |= m;
+  }
+
+  /* Butterflies. */
+  for (len = 2; len <= n; len <<= 1) {
+    half = len >> 1;
+    step = n/len;
+    for (i = 0; i < n; i += len) {
+      for (k = 0; k < half; ++k) {
+        double* a = z + 2*(i + k);
+        double* b = a + 2*half;
+        c = tw[2*k*step];
+        s = sign*tw[2*k*step + 1];
+        re = c*b[0] - s*b[1];
+        im = c*b[1] + s*b[0];
+        b[0] = a[0] - re;
+        b[1] = a[1] - im;
+        a[0] += re;
+        a[1] += im;
+      }
+    }
+  }
+}
+
+/* Choose the size of the FFT to convolve lines of length N by a kernel of
+   2*W + 1 coefficients dilated by SCALE.  Unless FORCE is true, 0 is
+   returned if the direct convolution is expected to be faster.  0 is also
+   returned if the FFT would be too large. */
+static long convolve_fft_size(long n, long w, long scale, int force)
+{
+  long k = 2*w*scale + 1, len = n + k - 1, nfft, best = 0;
+  double cost, bestcost = (force ? HUGE_VAL : (double)(2*w + 1));
+  int lg;
+  for (nfft = 2, lg = 1; nfft < k; nfft *= 2) ++lg;
+  for ( ; nfft <= CONVOLVE_FFT_MAX_SIZE; nfft *= 2, ++lg) {
+    cost = (CONVOLVE_FFT_FACTOR*nfft*lg/(double)(nfft - k + 1) +
+            CONVOLVE_FFT_OFFSET);
+    if (cost < bestcost) {
+      bestcost = cost;
+      best = nfft;
+    }
+    if (nfft - k + 1 >= len) break;
+  }
+  return best;
+}
+
 /*---------------------------------------------------------------------------*/
 /* OPERATIONS FOR COMPLEX DATA TYPE */
 
+/* A complex array of lines with a given STRIDE is the same as a real array
+   of lines with stride 2*STRIDE in which the real and imaginary parts of
+   the same complex line are adjacent real lines.  Both parts are therefore
+   convolved in a single pass over the interleaved data (adjacent lines are
+   processed together). */
 #define ENCODE(name, op, real_t)                                           \
 void name(real_t dst[], const real_t src[], int stride, int n, int nafter, \
           const real_t ker[], int w, int scale, int border, real_t ws[])   \
 {								           \
-  op(dst,   src,   2*stride, n, nafter, ker, w, scale, border, ws);	   \
-  op(dst+1, src+1, 2*stride, n, nafter, ker, w, scale, border, ws);        \
+  op(dst, src, 2*stride, n, nafter, ker, w, scale, border, ws);	           \
 }
 ENCODE(yeti_convolve_c, yeti_convolve_f, float)
 ENCODE(yeti_convolve_z, yeti_convolve_d, double)
 #undef ENCODE
 
+#define ENCODE(name, op, real_t)                                           \
+void name(real_t dst[], const real_t src[], int stride, int n, int nafter, \
+          const real_t ker[], int w, int scale, int border, real_t ws[],   \
+          int nthreads)                                                    \
+{								           \
+  op(dst, src, 2*stride, n, nafter, ker, w, scale, border, ws, nthreads);  \
+}
+ENCODE(yeti_convolve_mt_c, yeti_convolve_mt_f, float)
+ENCODE(yeti_convolve_mt_z, yeti_convolve_mt_d, double)
+#undef ENCODE
+
+void yeti_convolve_method_z(double dst[], const double src[], int stride,
+                            int n, int nafter, const double ker[], int w,
+                            int scale, int border, double ws[],
+                            int nthreads, int method)
+{
+  yeti_convolve_method_d(dst, src, 2*stride, n, nafter, ker, w, scale,
+                         border, ws, nthreads, method);
+}
+
+void yeti_gaussian_mt_z(double dst[], const double src[], int stride,
+                        int n, int nafter, double sigma, int border,
+                        double ws[], int nthreads)
+{
+  yeti_gaussian_mt_d(dst, src, 2*stride, n, nafter, sigma, border, ws,
+                     nthreads);
+}
+
 /*---------------------------------------------------------------------------*/
 /* OPERATIONS FOR FLOATING POINT DATA TYPE */
 #define real_t           float
 #define ZERO             0.0f
 #define CONVOLVE         yeti_convolve_f
+#define CONVOLVE_MT      yeti_convolve_mt_f
+#define CONVOLVE_LINES   convolve_lines_f
+#define CONVOLVE_TASK    convolve_task_f
 #define CONVOLVE_1       convolve_f
+#define CONVOLVE_IN      convolve_interior_f
+#define CONVOLVE_IN_W    convolve_interior_w_f
+#define CONVOLVE_RUN     convolve_run_f
+#define CONVOLVE_FIR     convolve_fir_f
+#define GAUSSIAN_1       gaussian_f
+#define GAUSSIAN_MT      yeti_gaussian_mt_f
+#define CONVOLVE_FFT     convolve_fft_f
+#define CONVOLVE_METHOD  yeti_convolve_method_f
 #include __FILE__
 
 #define real_t           double
 #define ZERO             0.0
 #define CONVOLVE         yeti_convolve_d
+#define CONVOLVE_MT      yeti_convolve_mt_d
+#define CONVOLVE_LINES   convolve_lines_d
+#define CONVOLVE_TASK    convolve_task_d
 #define CONVOLVE_1       convolve_d
+#define CONVOLVE_IN      convolve_interior_d
+#define CONVOLVE_IN_W    convolve_interior_w_d
+#define CONVOLVE_RUN     convolve_run_d
+#define CONVOLVE_FIR     convolve_fir_d
+#define GAUSSIAN_1       gaussian_d
+#define GAUSSIAN_MT      yeti_gaussian_mt_d
+#define CONVOLVE_FFT     convolve_fft_d
+#define CONVOLVE_METHOD  yeti_convolve_method_d
 #include __FILE__
 
+/*---------------------------------------------------------------------------*/
+/* YORICK INTERFACE */
+
+#include <yapi.h>
+
+extern void Y_yeti_convolve(int argc);
+extern void Y___yeti_wavelet(int argc);
+extern void Y_yeti_wavelet_step(int argc);
+extern void Y_yeti_gaussian(int argc);
+
+/* Options common to the convolution builtins. */
+typedef struct _convolve_options convolve_options_t;
+struct _convolve_options {
+  long which[Y_DIMSIZE - 1]; /* 0-based indices of dimensions of interest */
+  long nwhich;               /* number of dimensions of interest */
+  const void* ker;           /* convolution kernel */
+  int w;                     /* half-width of kernel */
+  int border;                /* border conditions */
+  int nthreads;              /* maximum number of threads */
+  int method;                /* method for the convolution */
+};
+
+static void* push_array(int type, long dims[]);
+
+/* Get the array to filter in-place at position IARG of the stack.  On
+   return, *TYPE is the type of the elements of the array (Y_FLOAT, Y_DOUBLE
+   or Y_COMPLEX) and *PUSHED is set to true if a private copy of the array
+   has been pushed on top of the stack.  No copy is made if the argument is
+   a temporary array or if it has been converted to floating-point. */
+static void* get_array(int iarg, int* type, int* pushed,
+                       long* ntot, long dims[])
+{
+  void* src;
+  void* dst;
+  size_t size;
+  int scratch = yarg_scratch(iarg);
+
+  *pushed = 0;
+  switch (yarg_typeid(iarg)) {
+  case Y_CHAR:
+  case Y_SHORT:
+  case Y_INT:
+  case Y_LONG:
+    /* Conversion yields a new temporary array. */
+    *type = Y_FLOAT;
+    return ygeta_f(iarg, ntot, dims);
+  case Y_FLOAT:
+    *type = Y_FLOAT;
+    src = ygeta_f(iarg, ntot, dims);
+    size = sizeof(float);
+    break;
+  case Y_DOUBLE:
+    *type = Y_DOUBLE;
+    src = ygeta_d(iarg, ntot, dims);
+    size = sizeof(double);
+    break;
+  case Y_COMPLEX:
+    *type = Y_COMPLEX;
+    src = ygeta_z(iarg, ntot, dims);
+    size = 2*sizeof(double);
+    break;
+  default:
+    y_error("bad data type");
+    return NULL;
+  }
+  if (scratch) {
+    return src;
+  }
+  dst = push_array(*type, dims);
+  memcpy(dst, src, (*ntot)*size);
+  *pushed = 1;
+  return dst;
+}
+
+/* Push a new array of type TYPE (Y_FLOAT, Y_DOUBLE or Y_COMPLEX) on top of
+   the stack. */
+static void* push_array(int type, long dims[])
+{
+  switch (type) {
+  case Y_FLOAT:   return ypush_f(dims);
+  case Y_DOUBLE:  return ypush_d(dims);
+  default:        return ypush_z(dims);
+  }
+}
+
+/* Push a workspace suitable for the convolution of array of type TYPE and
+   dimensions DIMS by the options OPT on top of the stack.  The number of
+   threads may be reduced according to the size of the problem. */
+static void* push_workspace(int type, const long dims[], long ntot,
+                            convolve_options_t* opt)
+{
+  long j, n, maxlen = 0;
+  size_t size = (type == Y_FLOAT ? sizeof(float) : sizeof(double));
+  for (j = 0; j < opt->nwhich; ++j) {
+    n = dims[opt->which[j] + 1];
+    if (n > maxlen) maxlen = n;
+  }
+  opt->nthreads = yeti_effective_threads(opt->nthreads,
+                                         ntot/(maxlen > 0 ? maxlen : 1));
+  return ypush_scratch(2*maxlen*opt->nthreads*size + 1, NULL);
+}
+
+/* Convolve array SRC of type TYPE along the dimension of interest and store
+   the result in DST (can be the same as SRC). */
+static void convolve_along(void* dst, const void* src, int type,
+                           long stride, long n, long nafter, int scale,
+                           const convolve_options_t* opt, void* ws)
+{
+  if (type == Y_FLOAT) {
+    yeti_convolve_method_f((float*)dst, (const float*)src, stride, n,
+                           nafter, (const float*)opt->ker, opt->w, scale,
+                           opt->border, (float*)ws, opt->nthreads,
+                           opt->method);
+  } else if (type == Y_DOUBLE) {
+    yeti_convolve_method_d((double*)dst, (const double*)src, stride, n,
+                           nafter, (const double*)opt->ker, opt->w, scale,
+                           opt->border, (double*)ws, opt->nthreads,
+                           opt->method);
+  } else {
+    /* Complex array: real and imaginary parts are convolved together. */
+    yeti_convolve_method_z((double*)dst, (const double*)src, stride, n,
+                           nafter, (const double*)opt->ker, opt->w, scale,
+                           opt->border, (double*)ws, opt->nthreads,
+                           opt->method);
+  }
+}
+
+/* Convolve array SRC along all dimensions of interest and store the result
+   in DST (can be the same as SRC).  The first pass is done out-of-place,
+   the others are done in-place. */
+static void smooth(void* dst, const void* src, int type, const long dims[],
+                   long ntot, int scale, const convolve_options_t* opt,
+                   void* ws)
+{
+  long j, k, stride;
+  if (ntot <= 0) return;
+  if (opt->nwhich < 1) {
+    if (dst != src) {
+      memcpy(dst, src, ntot*(type == Y_FLOAT ? sizeof(float) :
+                             type == Y_DOUBLE ? sizeof(double) :
+                             2*sizeof(double)));
+    }
+    return;
+  }
+  for (j = 0; j < opt->nwhich; ++j) {
+    k = opt->which[j];
+    for (stride = 1; --k >= 0; ) stride *= dims[k+1];
+    k = opt->which[j];
+    convolve_along(dst, (j == 0 ? src : dst), type, stride, dims[k+1],
+                   ntot/(stride*dims[k+1]), scale, opt, ws);
+  }
+}
+
+/* Get the optional integer value of keyword argument IARG. */
+static long get_optional_long(int iarg, long def)
+{
+  return (iarg < 0 || yarg_nil(iarg) ? def : ygets_l(iarg));
+}
+
+/* Get the options common to all builtins given the positions of the
+   keywords on the stack (-1 if unspecified), the type of the array to
+   filter and its number of dimensions.  A non-zero MIRROR keyword selects
+   the mirror conditions instead of BORDER. */
+static void get_options(convolve_options_t* opt, int type, long rank,
+                        int iarg_which, int iarg_kernel, int iarg_border,
+                        int iarg_mirror, int iarg_nthreads)
+{
+  long j, k, nker, mirror;
+  long* lptr;
+
+  opt->method = YETI_CONVOLVE_AUTO;
+  opt->border = get_optional_long(iarg_border, 0);
+  mirror = get_optional_long(iarg_mirror, 0);
+  if (mirror != 0) {
+    if (iarg_border >= 0 && ! yarg_nil(iarg_border)) {
+      y_error("keywords BORDER and MIRROR are exclusive");
+    }
+    if (mirror == 1) {
+      opt->border = YETI_CONVOLVE_MIRROR;
+    } else if (mirror == 2) {
+      opt->border = YETI_CONVOLVE_HALF_MIRROR;
+    } else {
+      y_error("bad value for keyword MIRROR");
+    }
+  }
+  opt->nthreads = get_optional_long(iarg_nthreads, 1);
+  if (opt->nthreads <= 0) y_error("bad value for keyword NTHREADS");
+
+  /* Get the list of dimensions of interest. */
+  if (iarg_which < 0 || yarg_nil(iarg_which)) {
+    opt->nwhich = rank;
+    for (j = 0; j < rank; ++j) opt->which[j] = j;
+  } else {
+    if (yarg_number(iarg_which) != 1 || yarg_rank(iarg_which) > 1) {
+      y_error("WHICH must be an integer scalar or vector");
+    }
+    lptr = ygeta_l(iarg_which, &opt->nwhich, NULL);
+    if (opt->nwhich > Y_DIMSIZE - 1) y_error("too many dimensions in WHICH");
+    for (j = 0; j < opt->nwhich; ++j) {
+      k = lptr[j];
+      if (k <= 0) k += rank;
+      if (k < 1 || k > rank) {
+        y_error("dimension index out of range in WHICH");
+      }
+      opt->which[j] = k - 1;
+    }
+  }
+
+  /* Get the convolution kernel. */
+  if (iarg_kernel < 0 || yarg_nil(iarg_kernel)) {
+    static const float  kf[] = {0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f};
+    static const double kd[] = {0.0625,  0.25,  0.375,  0.25,  0.0625};
+    opt->ker = (type == Y_FLOAT ? (void*)kf : (void*)kd);
+    nker = 5;
+  } else {
+    int id = yarg_number(iarg_kernel);
+    if (id != 1 && id != 2) y_error("KERNEL must be real");
+    if (type == Y_FLOAT) {
+      opt->ker = ygeta_f(iarg_kernel, &nker, NULL);
+    } else {
+      opt->ker = ygeta_d(iarg_kernel, &nker, NULL);
+    }
+    if (nker%2 != 1) y_error("KERNEL must have an odd number of elements");
+  }
+  opt->w = (nker - 1)/2;
+}
+
+static char* convolve_knames[] = {
+  "border", "count", "fft", "kernel", "mirror", "nthreads", "scale", "which",
+  NULL
+};
+static long convolve_kglobs[9];
+
+void Y_yeti_convolve(int argc)
+{
+  convolve_options_t opt;
+  int kiargs[8];
+  long dims[Y_DIMSIZE];
+  long ntot, j, pass, count;
+  void* arr;
+  void* ws;
+  int iarg, iarg_a = -1, type, pushed, scale;
+
+  /* Parse arguments. */
+  yarg_kw_init(convolve_knames, convolve_kglobs, kiargs);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    iarg = yarg_kw(iarg, convolve_kglobs, kiargs);
+    if (iarg < 0) break;
+    if (iarg_a >= 0) y_error("yeti_convolve takes exactly one argument");
+    iarg_a = iarg;
+  }
+  if (iarg_a < 0) y_error("yeti_convolve takes exactly one argument");
+  count = get_optional_long(kiargs[1], 1);
+  scale = get_optional_long(kiargs[6], 1);
+  if (scale <= 0) y_error("bad value for keyword SCALE");
+
+  /* Get the array to filter (from now on, the stack may have one more
+     element). */
+  arr = get_array(iarg_a, &type, &pushed, &ntot, dims);
+  if (pushed) {
+    iarg_a = 0;
+    for (j = 0; j < 8; ++j) {
+      if (kiargs[j] >= 0) ++kiargs[j];
+    }
+  }
+  get_options(&opt, type, dims[0], kiargs[7], kiargs[3], kiargs[0],
+              kiargs[4], kiargs[5]);
+  if (kiargs[2] >= 0 && ! yarg_nil(kiargs[2])) {
+    opt.method = (yarg_true(kiargs[2]) ? YETI_CONVOLVE_FFT :
+                  YETI_CONVOLVE_DIRECT);
+  }
+
+  /* Allocate a single workspace for all passes and apply the operator
+     along every dimensions of interest. */
+  ws = push_workspace(type, dims, ntot, &opt);
+  ++iarg_a;
+  for (pass = 0; pass < count; ++pass) {
+    smooth(arr, arr, type, dims, ntot, scale, &opt, ws);
+  }
+
+  /* Leave the result on top of the stack. */
+  yarg_swap(0, iarg_a);
+}
+
+static char* gaussian_knames[] = {
+  "border", "mirror", "nthreads", "which", NULL
+};
+static long gaussian_kglobs[5];
+
+void Y_yeti_gaussian(int argc)
+{
+  /* Factor to convert the FWHM into the standard deviation. */
+  const double fwhm2sigma = 0.42466090014400952136; /* 1/sqrt(8*log(2)) */
+  convolve_options_t opt;
+  int kiargs[4];
+  long dims[Y_DIMSIZE];
+  long ntot, nfwhm, j, k, n, stride, size, nws;
+  double sigma[Y_DIMSIZE - 1];
+  double* fwhm;
+  void* arr;
+  void* ws;
+  int iarg, nargs = 0, iarg_a = -1, iarg_fwhm = -1, type, pushed;
+
+  /* Parse arguments. */
+  yarg_kw_init(gaussian_knames, gaussian_kglobs, kiargs);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    iarg = yarg_kw(iarg, gaussian_kglobs, kiargs);
+    if (iarg < 0) break;
+    if (++nargs == 1) {
+      iarg_a = iarg;
+    } else if (nargs == 2) {
+      iarg_fwhm = iarg;
+    } else {
+      y_error("yeti_gaussian takes exactly two arguments");
+    }
+  }
+  if (nargs != 2) y_error("yeti_gaussian takes exactly two arguments");
+
+  /* Get the array to filter (from now on, the stack may have one more
+     element). */
+  arr = get_array(iarg_a, &type, &pushed, &ntot, dims);
+  if (pushed) {
+    iarg_a = 0;
+    ++iarg_fwhm;
+    for (j = 0; j < 4; ++j) {
+      if (kiargs[j] >= 0) ++kiargs[j];
+    }
+  }
+  get_options(&opt, type, dims[0], kiargs[3], -1, kiargs[0], kiargs[1],
+              kiargs[2]);
+  k = yarg_number(iarg_fwhm);
+  if ((k != 1 && k != 2) || yarg_rank(iarg_fwhm) > 1) {
+    y_error("FWHM must be a real scalar or vector");
+  }
+  fwhm = ygeta_d(iarg_fwhm, &nfwhm, NULL);
+  if (nfwhm != 1 && nfwhm != opt.nwhich) {
+    y_error("FWHM must have one value per dimension of interest");
+  }
+  for (j = 0; j < opt.nwhich; ++j) {
+    sigma[j] = fwhm2sigma*fwhm[nfwhm > 1 ? j : 0];
+    if (sigma[j] < 0.0) y_error("FWHM must be nonnegative");
+  }
+
+  /* Allocate a single workspace for all dimensions and apply the
+     recursive filter along every dimensions of interest. */
+  nws = 0;
+  for (j = 0; j < opt.nwhich; ++j) {
+    n = dims[opt.which[j] + 1];
+    if (n > nws) nws = n;
+  }
+  opt.nthreads = yeti_effective_threads(opt.nthreads,
+                                        ntot/(nws > 0 ? nws : 1));
+  nws = 0;
+  for (j = 0; j < opt.nwhich; ++j) {
+    n = yeti_gaussian_workspace(dims[opt.which[j] + 1], sigma[j],
+                                opt.nthreads);
+    if (n > nws) nws = n;
+  }
+  size = (type == Y_FLOAT ? sizeof(float) : sizeof(double));
+  ws = ypush_scratch(nws*size + 1, NULL);
+  ++iarg_a;
+  for (j = 0; j < opt.nwhich && ntot > 0; ++j) {
+    k = opt.which[j];
+    for (stride = 1; --k >= 0; ) stride *= dims[k+1];
+    n = dims[opt.which[j] + 1];
+    if (type == Y_FLOAT) {
+      yeti_gaussian_mt_f((float*)arr, (const float*)arr, stride, n,
+                         ntot/(stride*n), sigma[j], opt.border,
+                         (float*)ws, opt.nthreads);
+    } else if (type == Y_DOUBLE) {
+      yeti_gaussian_mt_d((double*)arr, (const double*)arr, stride, n,
+                         ntot/(stride*n), sigma[j], opt.border,
+                         (double*)ws, opt.nthreads);
+    } else {
+      yeti_gaussian_mt_z((double*)arr, (const double*)arr, stride, n,
+                         ntot/(stride*n), sigma[j], opt.border,
+                         (double*)ws, opt.nthreads);
+    }
+  }
+
+  /* Leave the result on top of the stack. */
+  yarg_swap(0, iarg_a);
+}
+
+/* Subtract the N elements of array B from those of array A. */
+#define SUBTRACT(T, a, b, n) do {               \
+    T* __a = (T*)(a);                           \
+    const T* __b = (const T*)(b);               \
+    long __i, __n = (n);                        \
+    for (__i = 0; __i < __n; ++__i) {           \
+      __a[__i] -= __b[__i];                     \
+    }                                           \
+  } while (0)
+
+/* Store B in A and A - B in B for the N elements of arrays A and B. */
+#define EXCHANGE(T, a, b, n) do {               \
+    T* __a = (T*)(a);                           \
+    T* __b = (T*)(b);                           \
+    long __i, __n = (n);                        \
+    for (__i = 0; __i < __n; ++__i) {           \
+      T __t = __a[__i];                         \
+      __a[__i] = __b[__i];                      \
+      __b[__i] = __t - __b[__i];                \
+    }                                           \
+  } while (0)
+
+/* Copy N elements of array SRC of type ID into array DST of type TYPE. */
+static void convert(void* dst, int type, const void* src, int id, long n)
+{
+  long i;
+  if (type == Y_FLOAT) {
+    float* f = (float*)dst;
+#define COPY(T) for (i = 0; i < n; ++i) f[i] = ((const T*)src)[i]; break
+    switch (id) {
+    case Y_CHAR:  COPY(unsigned char);
+    case Y_SHORT: COPY(short);
+    case Y_INT:   COPY(int);
+    case Y_LONG:  COPY(long);
+    default:      COPY(float);
+    }
+#undef COPY
+  } else {
+    memcpy(dst, src, n*(type == Y_DOUBLE ? 1 : 2)*sizeof(double));
+  }
+}
+
+static char* wavelet_knames[] = {
+  "border", "kernel", "mirror", "nthreads", "which", NULL
+};
+static long wavelet_kglobs[6];
+
+void Y___yeti_wavelet(int argc)
+{
+  convolve_options_t opt;
+  int kiargs[5];
+  long dims[Y_DIMSIZE];
+  long ntot, i, order, nreals;
+  void* cube;
+  void* src;
+  void* ws;
+  size_t size;
+  int iarg, nargs = 0, iarg_a = -1, iarg_order = -1, id, type, scale;
+
+  /* Parse arguments. */
+  yarg_kw_init(wavelet_knames, wavelet_kglobs, kiargs);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    iarg = yarg_kw(iarg, wavelet_kglobs, kiargs);
+    if (iarg < 0) break;
+    if (++nargs == 1) {
+      iarg_a = iarg;
+    } else if (nargs == 2) {
+      iarg_order = iarg;
+    } else {
+      y_error("yeti_wavelet takes exactly two arguments");
+    }
+  }
+  if (nargs != 2) y_error("yeti_wavelet takes exactly two arguments");
+  if (yarg_number(iarg_order) != 1 || yarg_rank(iarg_order) != 0 ||
+      (order = ygets_l(iarg_order)) < 0) {
+    y_error("ORDER must be a non-negative integer");
+  }
+  src = NULL;
+  id = yarg_typeid(iarg_a);
+  switch (id) {
+  case Y_CHAR:
+  case Y_SHORT:
+  case Y_INT:
+  case Y_LONG:
+  case Y_FLOAT:
+    type = Y_FLOAT;
+    break;
+  case Y_DOUBLE:
+  case Y_COMPLEX:
+    type = id;
+    break;
+  default:
+    y_error("bad data type");
+    return;
+  }
+  switch (id) {
+  case Y_CHAR:    src = ygeta_c(iarg_a, &ntot, dims); break;
+  case Y_SHORT:   src = ygeta_s(iarg_a, &ntot, dims); break;
+  case Y_INT:     src = ygeta_i(iarg_a, &ntot, dims); break;
+  case Y_LONG:    src = ygeta_l(iarg_a, &ntot, dims); break;
+  case Y_FLOAT:   src = ygeta_f(iarg_a, &ntot, dims); break;
+  case Y_DOUBLE:  src = ygeta_d(iarg_a, &ntot, dims); break;
+  case Y_COMPLEX: src = ygeta_z(iarg_a, &ntot, dims); break;
+  }
+  if (dims[0] >= Y_DIMSIZE - 1) y_error("too many dimensions");
+  get_options(&opt, type, dims[0], kiargs[4], kiargs[1], kiargs[0],
+              kiargs[2], kiargs[3]);
+
+  /* Create the output cube and the workspace.  The first plane is a copy
+     of the input array, every other plane is computed from the previous
+     one. */
+  dims[++dims[0]] = order + 1;
+  cube = push_array(type, dims);
+  --dims[0];
+  ws = push_workspace(type, dims, ntot, &opt);
+  nreals = (type == Y_COMPLEX ? 2*ntot : ntot);
+  size = (type == Y_FLOAT ? sizeof(float) : sizeof(double));
+  convert(cube, type, src, id, ntot);
+  for (scale = 1, i = 0; i < order; ++i, scale *= 2) {
+    void* s = (char*)cube + i*nreals*size;
+    void* t = (char*)s + nreals*size;
+    smooth(t, s, type, dims, ntot, scale, &opt, ws);
+    if (type == Y_FLOAT) {
+      SUBTRACT(float, s, t, nreals);
+    } else {
+      SUBTRACT(double, s, t, nreals);
+    }
+  }
+  yarg_drop(1); /* left cube on top of stack */
+}
+
+static char* step_knames[] = {
+  "border", "kernel", "mirror", "nthreads", "which", NULL
+};
+static long step_kglobs[6];
+
+void Y_yeti_wavelet_step(int argc)
+{
+  convolve_options_t opt;
+  int kiargs[5];
+  long dims[Y_DIMSIZE];
+  long ntot, nreals;
+  void* s;
+  void* d;
+  void* ws;
+  int iarg, nargs = 0, iarg_s = -1, iarg_scale = -1, type, scale;
+
+  /* Parse arguments. */
+  yarg_kw_init(step_knames, step_kglobs, kiargs);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    iarg = yarg_kw(iarg, step_kglobs, kiargs);
+    if (iarg < 0) break;
+    if (++nargs == 1) {
+      iarg_s = iarg;
+    } else if (nargs == 2) {
+      iarg_scale = iarg;
+    } else {
+      y_error("yeti_wavelet_step takes exactly two arguments");
+    }
+  }
+  if (nargs != 2) y_error("yeti_wavelet_step takes exactly two arguments");
+  scale = ygets_l(iarg_scale);
+  if (scale <= 0) y_error("bad value for SCALE");
+  type = yarg_typeid(iarg_s);
+  switch (type) {
+  case Y_FLOAT:   s = ygeta_f(iarg_s, &ntot, dims); break;
+  case Y_DOUBLE:  s = ygeta_d(iarg_s, &ntot, dims); break;
+  case Y_COMPLEX: s = ygeta_z(iarg_s, &ntot, dims); break;
+  default:
+    y_error("S must be an array of float, double or complex values");
+    return;
+  }
+  get_options(&opt, type, dims[0], kiargs[4], kiargs[1], kiargs[0],
+              kiargs[2], kiargs[3]);
+
+  /* Smooth S into D, then store D in S and S - D in D. */
+  d = push_array(type, dims);
+  ws = push_workspace(type, dims, ntot, &opt);
+  smooth(d, s, type, dims, ntot, scale, &opt, ws);
+  nreals = (type == Y_COMPLEX ? 2*ntot : ntot);
+  if (type == Y_FLOAT) {
+    EXCHANGE(float, s, d, nreals);
+  } else {
+    EXCHANGE(double, s, d, nreals);
+  }
+  yarg_drop(1); /* left D on top of stack */
+}
+
+#undef SUBTRACT
+#undef EXCHANGE
+
 #else /* _YETI_CONVOLVE_C defined. ------------------------------------------*/
 
 /* Private routines, data and definitions used in this file. */
 
 #ifdef CONVOLVE_1
 static void CONVOLVE_1(real_t dst[], const real_t src[], int n,
-                       const real_t ker[], int w, int scale, int border);
+                       const real_t ker[], int w, int scale, int border,
+                       real_t buf[], const long idx[], const real_t wgt[]);
+static void CONVOLVE_IN(real_t* restrict dst, const real_t* restrict src,
+                        long i0, long i1, const real_t ker[], int w,
+                        int scale);
 #endif
 
 #ifdef CONVOLVE
-void CONVOLVE(real_t* dst, const real_t* src, int stride, int n,
-              int nafter, const real_t* ker, int w, int scale,
-              int border, real_t* ws)
+/* Filter the lines of indices FIRST to LAST - 1 (a line index is K +
+   STRIDE*L with 0 <= K < STRIDE the index before the dimension of interest
+   and 0 <= L < NAFTER the index after the dimension of interest).  The
+   workspace WS has 2*N + CTX->NWS elements. */
+static void CONVOLVE_LINES(const convolve_context_t* ctx, real_t ws[],
+                           long first, long last)
 {
-  int i, j, k, l;
+  convolve_filter_t* filter = ctx->filter;
+  real_t* dst = (real_t*)ctx->dst;
+  const real_t* src = (const real_t*)ctx->src;
+  real_t* tmp = ws + 2*(long)ctx->n;
+  long i, j, k, line, n = ctx->n, stride = ctx->stride;
 
-  ker += w;
   if (stride == 1) {
     if (dst == src) {
-      for (k=l=0; l<nafter; ++l, k+=n) {
+      for (line = first, k = first*n; line < last; ++line, k += n) {
 #if HAVE_MEMCPY
         memcpy(ws, src+k, n*sizeof(real_t));
 #else
         for (j=0, i=k; j<n; ++j, ++i) ws[j] = src[i];
 #endif
-        CONVOLVE_1(dst+k, ws, n, ker, w, scale, border);
+        filter(dst+k, ws, ctx, tmp);
       }
     } else {
-      for (k=l=0; l<nafter; ++l, k+=n) {
-        CONVOLVE_1(dst+k, src+k, n, ker, w, scale, border);
+      for (line = first, k = first*n; line < last; ++line, k += n) {
+        filter(dst+k, src+k, ctx, tmp);
       }
     }
   } else {
-    real_t* wp = ws+n;
-    for (l=0; l<nafter ; ++l) {
-      for (k=0; k<stride; ++k) {
-        for (j=0, i=k+stride*n*l; j<n; ++j, i+=stride) ws[j] = src[i];
-        CONVOLVE_1(wp, ws, n, ker, w, scale, border);
-        for (j=0, i=k+stride*n*l; j<n; ++j, i+=stride) dst[i] = wp[j];
+    /* Number of lines per panel. */
+    long nb = CONVOLVE_CACHE_SIZE/(2*n*sizeof(real_t));
+    real_t* panel = NULL;
+    if (nb < CONVOLVE_MIN_BLOCK) nb = CONVOLVE_MIN_BLOCK;
+    if (nb > CONVOLVE_MAX_BLOCK) nb = CONVOLVE_MAX_BLOCK;
+    if (nb > stride) nb = stride;
+    if (nb > 1) panel = (real_t*)malloc(2*nb*n*sizeof(real_t));
+    if (panel != NULL) {
+      /* Process panels of adjacent lines (with the same L index). */
+      real_t* wp = panel + nb*n;
+      long c, m;
+      for (line = first; line < last; line += m) {
+        k = (line%stride);
+        m = stride - k;
+        if (m > nb) m = nb;
+        if (m > last - line) m = last - line;
+        k += (line/stride)*(stride*n);
+        for (j=0, i=k; j<n; ++j, i+=stride) {
+          for (c=0; c<m; ++c) panel[c*n + j] = src[i + c];
+        }
+        for (c=0; c<m; ++c) {
+          filter(wp + c*n, panel + c*n, ctx, tmp);
+        }
+        for (j=0, i=k; j<n; ++j, i+=stride) {
+          for (c=0; c<m; ++c) dst[i + c] = wp[c*n + j];
+        }
+      }
+      free(panel);
+    } else {
+      /* Process lines one by one. */
+      real_t* wp = ws+n;
+      for (line = first; line < last; ++line) {
+        k = (line%stride) + (line/stride)*(stride*n);
+        for (j=0, i=k; j<n; ++j, i+=stride) ws[j] = src[i];
+        filter(wp, ws, ctx, tmp);
+        for (j=0, i=k; j<n; ++j, i+=stride) dst[i] = wp[j];
       }
     }
   }
 }
-#endif /* CONVOLVE */
 
-#ifdef CONVOLVE_1
-static void CONVOLVE_1(real_t dst[], const real_t src[], int n,
-                       const real_t ker[], int w, int scale, int border)
-{
-  int i, j, k;
-  real_t sum, xl, xr;
-
-  if (scale>1) {
-    /*************************
-     *                       *
-     *  WAVELET CONVOLUTION  *
-     *                       *
-     *************************/
-    int ws = w*scale;
-    switch (border) {
-    case 0:
-      /* Extrapolate missing left values by the leftmost one
-         and missing right values by the rightmost one. */
-      xl = src[0];
-      xr = src[n-1];
-      for (i=0 ; i<n ; ++i) {
-        for (sum=ZERO, j=-w, k=i-ws ; j<=w ; ++j, k+=scale) {
-          sum += ker[j] * (k>=0 ? (k<n ? src[k] : xl): xr);
-        }
-        dst[i] = sum;
-      }
-      break;
-    case 1:
-      /* Extrapolate missing left values by zero and
-         missing right values by the rightmost one. */
-      xr = src[n-1];
-      for (i=0 ; i<n ; ++i) {
-        for (sum=ZERO, j=-w, k=i-ws ; j<=w ; ++j, k+=scale) {
-          if      (k>=n) sum += ker[j] * xr;
-          else if (k>=0) sum += ker[j] * src[k];
-        }
-        dst[i] = sum;
-      }
-      break;
-    case 2:
-      /* Extrapolate missing left values by the leftmost one
-         and missing right values by zero. */
-      xl = src[0];
-      for (i=0 ; i<n ; ++i) {
-        for (sum=ZERO, j=-w, k=i-ws ; j<=w ; ++j, k+=scale) {
-          if      (k<0) sum += ker[j] * xl;
-          else if (k<n) sum += ker[j] * src[k];
-          else break;
-        }
-        dst[i] = sum;
+static void CONVOLVE_TASK(void* data, long first, long last, int rank)
+{
+  const convolve_context_t* ctx = (const convolve_context_t*)data;
+  CONVOLVE_LINES(ctx, (real_t*)ctx->ws + (2*ctx->n + ctx->nws)*rank,
+                 first, last);
+}
+
+/* Filter all the lines with at most NTHREADS threads. */
+static void CONVOLVE_RUN(convolve_context_t* ctx, int nafter, int nthreads)
+{
+  long number = (long)ctx->stride*nafter;
+  if (yeti_effective_threads(nthreads, number) <= 1) {
+    CONVOLVE_LINES(ctx, (real_t*)ctx->ws, 0, number);
+  } else {
+    yeti_run_tasks(CONVOLVE_TASK, ctx, number, nthreads);
+  }
+}
+
+static void CONVOLVE_FIR(void* dst, const void* src,
+                         const convolve_context_t* ctx, void* tmp)
+{
+  CONVOLVE_1((real_t*)dst, (const real_t*)src, ctx->n,
+             (const real_t*)ctx->ker, ctx->w, ctx->scale, ctx->border,
+             (ctx->nws > 0 ? (real_t*)tmp : NULL), ctx->idx,
+             (const real_t*)ctx->wgt);
+}
+
+/* Convolve the line SRC by the overlap-save method.  The line is padded by
+   M = W*SCALE elements on both sides according to the border conditions.
+   Pairs of consecutive blocks are transformed together as the real and
+   imaginary parts of the same complex FFT.  TMP has N + 2*M + 2*NFFT
+   doubles. */
+static void CONVOLVE_FFT(void* dst, const void* src,
+                         const convolve_context_t* ctx, void* tmp)
+{
+  const real_t* x = (const real_t*)src;
+  real_t* y = (real_t*)dst;
+  const real_t* wgt = (const real_t*)ctx->wgt;
+  const double* h = ctx->spec;
+  long i, j, k, n = ctx->n, m = ctx->m, len = n + 2*m;
+  long nfft = ctx->nfft, blk = nfft - 2*m, off = 2*m;
+  double* p = (double*)tmp;
+  double* z = p + len;
+  double re, im;
+  int border = ctx->border;
+
+  /* Build the padded line. */
+  for (i = 0; i < m; ++i) {
+    j = convolve_index(i - m, n, border);
+    p[i] = (j >= 0 ? x[j] : 0.0);
+    j = convolve_index(n + i, n, border);
+    p[m+n+i] = (j >= 0 ? x[j] : 0.0);
+  }
+  for (i = 0; i < n; ++i) p[m+i] = x[i];
+
+  /* Output Y[I] for S <= I < S + BLK is obtained from the circular
+     convolution of P[S:S+NFFT-1] (the first OFF elements of the result are
+     wrong and discarded). */
+  for (k = 0; k < n; k += 2*blk) {
+    for (i = 0; i < nfft; ++i) {
+      z[2*i]   = (k + i < len ? p[k + i] : 0.0);
+      z[2*i+1] = (k + blk + i < len ? p[k + blk + i] : 0.0);
+    }
+    fft_radix2(z, nfft, ctx->twiddle, -1);
+    for (i = 0; i < nfft; ++i) {
+      re = z[2*i]*h[2*i] - z[2*i+1]*h[2*i+1];
+      im = z[2*i]*h[2*i+1] + z[2*i+1]*h[2*i];
+      z[2*i] = re;
+      z[2*i+1] = im;
+    }
+    fft_radix2(z, nfft, ctx->twiddle, +1);
+    for (i = 0; i < blk && k + i < n; ++i) {
+      y[k + i] = (real_t)z[2*(off + i)];
+    }
+    for (i = 0; i < blk && k + blk + i < n; ++i) {
+      y[k + blk + i] = (real_t)z[2*(off + i) + 1];
+    }
+  }
+
+  if (wgt != NULL) {
+    for (i = 0; i < n; ++i) y[i] = (wgt[i] ? y[i]/wgt[i] : ZERO);
+  }
+}
+
+void CONVOLVE_METHOD(real_t* dst, const real_t* src, int stride, int n,
+                     int nafter, const real_t* ker, int w, int scale,
+                     int border, real_t* ws, int nthreads, int method)
+{
+  convolve_context_t ctx;
+  void* buf = NULL;
+  long nfft = 0;
+
+  ctx.filter = CONVOLVE_FIR;
+  ctx.dst = dst;
+  ctx.src = src;
+  ctx.ker = ker + w;
+  ctx.wgt = NULL;
+  ctx.ws = ws;
+  ctx.nws = 0;
+  ctx.spec = NULL;
+  ctx.twiddle = NULL;
+  ctx.idx = NULL;
+  ctx.nfft = 0;
+  ctx.stride = stride;
+  ctx.n = n;
+  ctx.w = w;
+  ctx.scale = scale;
+  ctx.border = border;
+  ctx.m = 0;
+
+  if ((method == YETI_CONVOLVE_AUTO || method == YETI_CONVOLVE_FFT) &&
+      n > 0 && w > 0) {
+    nfft = convolve_fft_size(n, w, scale, method == YETI_CONVOLVE_FFT);
+  }
+  if (nfft > 0) {
+    /* Allocate the private workspaces of the threads (2*N elements of type
+       real_t for the lines followed by the buffers of the filter), the
+       spectrum of the kernel, the twiddle factors and the normalization
+       weights. */
+    long i, j, k, m = (long)w*scale, nth, nws, nw;
+    double *h, *tw;
+    nth = yeti_effective_threads(nthreads, (long)stride*nafter);
+    nws = (n + 2*m + 2*nfft)*(sizeof(double)/sizeof(real_t));
+    nw = nth*(2*(long)n + nws);
+    buf = malloc(nw*sizeof(real_t) + 3*nfft*sizeof(double) +
+                 2*(long)n*sizeof(real_t));
+    if (buf != NULL) {
+      h = (double*)((real_t*)buf + nw);
+      tw = h + 2*nfft;
+      fft_twiddles(tw, nfft);
+      for (i = 0; i < 2*nfft; ++i) h[i] = 0.0;
+      for (j = -w; j <= w; ++j) {
+        /* Correlation by KER is convolution by the reversed kernel. */
+        k = m - j*scale;
+        h[2*k] = ker[w + j]/nfft;
       }
-      break;
-    case 3:
-      /* Extrapolate missing values by zero. */
-      for (i=0 ; i<n ; ++i) {
-        for (sum=ZERO, j=-w, k=i-ws ; j<=w && k<n ; ++j, k+=scale) {
-          if (k>=0) sum += ker[j] * src[k];
-        }
-        dst[i] = sum;
+      fft_radix2(h, nfft, tw, -1);
+      if (CONVOLVE_NORMALIZED(border)) {
+        /* Normalize by the sum of the kernel weights which are inside the
+           line. */
+        real_t* wgt = (real_t*)(tw + nfft);
+        real_t* one = wgt + n;
+        for (i = 0; i < n; ++i) one[i] = (real_t)1;
+        CONVOLVE_1(wgt, one, n, ker + w, w, scale, 3, NULL, NULL, NULL);
+        ctx.wgt = wgt;
       }
-      break;
-    case 4:
-      /* Periodic conditions. */
-      for (i=0 ; i<n ; ++i) {
-        if ((k= i-(ws%n)) < 0) k += n;
-        for (sum=ZERO, j=-w ; j<=w ; ++j, k+=scale) {
-          sum += ker[j] * src[k%n];
-        }
-        dst[i] = sum;
+      ctx.filter = CONVOLVE_FFT;
+      ctx.ws = buf;
+      ctx.nws = nws;
+      ctx.spec = h;
+      ctx.twiddle = tw;
+      ctx.nfft = nfft;
+      ctx.m = m;
+      nthreads = nth;
+    }
+  }
+  if (buf == NULL && n > 0 && w > 0) {
+    /* Allocate the private workspaces of the threads for the direct
+       method (2*N elements for the lines followed by the buffers to compute
+       the edges of the lines) and the table of the indices of the padding
+       elements.  If this fails, the slower code without buffers is used. */
+    long i, m = (long)w*scale, nth, nws, nw;
+    long* idx;
+    nth = yeti_effective_threads(nthreads, (long)stride*nafter);
+    nws = n + 2*m;
+    nw = nth*(2*(long)n + nws) + 2*(long)n;
+    nw += (nw & 1); /* for alignment of IDX */
+    buf = malloc(nw*sizeof(real_t) + 2*m*sizeof(long));
+    if (buf != NULL) {
+      idx = (long*)((real_t*)buf + nw);
+      for (i = 0; i < m; ++i) {
+        idx[i] = convolve_index(i - m, n, border);
+        idx[m + i] = convolve_index(n + i, n, border);
       }
-      break;
-    default:
-      /* Do not extrapolate missing values but normalize convolution
-         product by sum of kernel weights taken into account (assuming
-         they are all positive). */
-      for (i=0 ; i<n ; ++i) {
-        for (xl=sum=ZERO, j=-w, k=i-ws ; j<=w && k<n ; ++j, k+=scale) {
-          if (k>=0) {
-            sum += (xr= ker[j]) * src[k];
-            xl += xr;
-          }
-        }
-        dst[i] = xl ? sum/xl : ZERO;
+      if (CONVOLVE_NORMALIZED(border)) {
+        /* The sums of the kernel weights which are inside the line are the
+           same for all lines. */
+        real_t* wgt = (real_t*)buf + nth*(2*(long)n + nws);
+        real_t* one = wgt + n;
+        for (i = 0; i < n; ++i) one[i] = (real_t)1;
+        CONVOLVE_1(wgt, one, n, ker + w, w, scale, 3, NULL, NULL, NULL);
+        ctx.wgt = wgt;
       }
+      ctx.ws = buf;
+      ctx.nws = nws;
+      ctx.idx = idx;
+      nthreads = nth;
     }
+  }
+  CONVOLVE_RUN(&ctx, nafter, nthreads);
+  if (buf != NULL) free(buf);
+}
+
+void CONVOLVE_MT(real_t* dst, const real_t* src, int stride, int n,
+                 int nafter, const real_t* ker, int w, int scale,
+                 int border, real_t* ws, int nthreads)
+{
+  CONVOLVE_METHOD(dst, src, stride, n, nafter, ker, w, scale, border, ws,
+                  nthreads, YETI_CONVOLVE_AUTO);
+}
 
+void CONVOLVE(real_t* dst, const real_t* src, int stride, int n,
+              int nafter, const real_t* ker, int w, int scale,
+              int border, real_t* ws)
+{
+  CONVOLVE_MT(dst, src, stride, n, nafter, ker, w, scale, border, ws, 1);
+}
+
+/* Apply the recursive Gaussian filter to the line SRC padded according to
+   the border conditions, TMP must have N + 2*M elements. */
+static void GAUSSIAN_1(void* dst, const void* src,
+                       const convolve_context_t* ctx, void* tmp)
+{
+  const real_t* x = (const real_t*)src;
+  real_t* y = (real_t*)dst;
+  real_t* p = (real_t*)tmp;
+  const real_t* wgt = (const real_t*)ctx->wgt;
+  real_t b0 = ctx->b[0], b1 = ctx->b[1], b2 = ctx->b[2], b3 = ctx->b[3];
+  real_t w1, w2, w3;
+  long i, j, n = ctx->n, m = ctx->m, len = n + 2*m;
+  int border = ctx->border;
+
+  /* Build the padded line. */
+  for (i = 0; i < m; ++i) {
+    j = convolve_index(i - m, n, border);
+    p[i] = (j >= 0 ? x[j] : ZERO);
+    j = convolve_index(n + i, n, border);
+    p[m+n+i] = (j >= 0 ? x[j] : ZERO);
+  }
+  for (i = 0; i < n; ++i) p[m+i] = x[i];
+
+  /* Causal and anti-causal passes (initialized by the steady state of a
+     constant input). */
+  w1 = w2 = w3 = p[0];
+  for (i = 0; i < len; ++i) {
+    p[i] = b0*p[i] + b1*w1 + b2*w2 + b3*w3;
+    w3 = w2;
+    w2 = w1;
+    w1 = p[i];
+  }
+  w1 = w2 = w3 = p[len-1];
+  for (i = len - 1; i >= 0; --i) {
+    p[i] = b0*p[i] + b1*w1 + b2*w2 + b3*w3;
+    w3 = w2;
+    w2 = w1;
+    w1 = p[i];
+  }
+
+  if (wgt != NULL) {
+    for (i = 0; i < n; ++i) y[i] = p[m+i]/wgt[i];
   } else {
-    /************************
-     *                      *
-     *  NORMAL CONVOLUTION  *
-     *                      *
-     ************************/
-    int jl, jr, wp1=w+1;
-
-    switch (border) {
-    case 0:
-      /* Extrapolate missing left values by the leftmost one
-         and missing right values by the rightmost one. */
-      xl = src[0];
-      xr = src[n-1];
-      for (i=0 ; i<n ; ++i) {
-        sum = ZERO;
-        jl = i<=w ? -i : -w;            /* limit of left border */
-        if ((jr = n-i) > wp1) jr = wp1; /* limit of right border */
-        for (j=-w        ; j<jl ; ++j)      sum += ker[j] * xl;
-        for (j=jl, k=i+j ; j<jr ; ++j, ++k) sum += ker[j] * src[k];
-        for (j=jr        ; j<=w ; ++j)      sum += ker[j] * xr;
-        dst[i] = sum;
-      }
-      break;
-    case 1:
-      /* Extrapolate missing left values by zero and
-         missing right values by the rightmost one. */
-      xr = src[n-1];
-      for (i=0 ; i<n ; ++i) {
-        sum = ZERO;
-        jl = i<=w ? -i : -w;            /* limit of left border */
-        if ((jr = n-i) > wp1) jr = wp1; /* limit of right border */
-        for (j=jl, k=i+j ; j<jr ; ++j, ++k) sum += ker[j] * src[k];
-        for (j=jr        ; j<=w ; ++j)      sum += ker[j] * xr;
-        dst[i] = sum;
+    for (i = 0; i < n; ++i) y[i] = p[m+i];
+  }
+}
+
+void GAUSSIAN_MT(real_t* dst, const real_t* src, int stride, int n,
+                 int nafter, double sigma, int border, real_t* ws,
+                 int nthreads)
+{
+  convolve_context_t ctx;
+  long i;
+
+  if (sigma <= 0.0 || n <= 1) {
+    if (dst != src) {
+      long ntot = (long)stride*n*nafter;
+#if HAVE_MEMCPY
+      memcpy(dst, src, ntot*sizeof(real_t));
+#else
+      for (i = 0; i < ntot; ++i) dst[i] = src[i];
+#endif
+    }
+    return;
+  }
+  gaussian_coefficients(sigma, ctx.b);
+  ctx.filter = GAUSSIAN_1;
+  ctx.dst = dst;
+  ctx.src = src;
+  ctx.ker = NULL;
+  ctx.spec = NULL;
+  ctx.twiddle = NULL;
+  ctx.idx = NULL;
+  ctx.nfft = 0;
+  ctx.stride = stride;
+  ctx.n = n;
+  ctx.w = 0;
+  ctx.scale = 1;
+  ctx.border = border;
+  ctx.m = gaussian_margin(sigma);
+  ctx.nws = n + 2*(long)ctx.m;
+  ctx.ws = ws + n;
+  if (CONVOLVE_NORMALIZED(border)) {
+    /* Missing values are not extrapolated, the result is normalized by the
+       filtered indicator of the line which is the same for all lines. */
+    real_t* wgt = ws;
+    real_t* one = ws + n;
+    ctx.border = 3;
+    ctx.wgt = NULL;
+    for (i = 0; i < n; ++i) one[i] = (real_t)1;
+    GAUSSIAN_1(wgt, one, &ctx, one + n);
+    ctx.wgt = wgt;
+  } else {
+    ctx.wgt = NULL;
+  }
+  CONVOLVE_RUN(&ctx, nafter, nthreads);
+}
+#endif /* CONVOLVE */
+
+#ifdef CONVOLVE_1
+/* Generic interior kernel: DST[i] = sum_j KER[j]*SRC[i + j*SCALE] for I0 <=
+   i < I1 and -W <= j <= W.  The loops are ordered so that the innermost one
+   runs over contiguous output elements and can be vectorized; the terms
+   are summed in the same order as in the border code. */
+static CONVOLVE_SIMD void
+CONVOLVE_IN_W(real_t* restrict dst, const real_t* restrict src,
+              long i0, long i1, const real_t ker[], int w, int scale)
+{
+  long i, j, k;
+  real_t c;
+
+  c = ker[-w];
+  k = -(long)w*scale;
+  for (i=i0 ; i<i1 ; ++i) dst[i] = c*src[i+k];
+  for (j=1-w ; j<=w ; ++j) {
+    c = ker[j];
+    k = (long)j*scale;
+    for (i=i0 ; i<i1 ; ++i) dst[i] += c*src[i+k];
+  }
+}
+
+/* Interior kernel with specialized versions for the most common kernel
+   widths. */
+static void CONVOLVE_IN(real_t* restrict dst, const real_t* restrict src,
+                        long i0, long i1, const real_t ker[], int w,
+                        int scale)
+{
+  long i, s1, s2, s3;
+  real_t k0, km1, kp1, km2, kp2, km3, kp3;
+
+  switch (w) {
+  case 0:
+    k0 = ker[0];
+    for (i=i0 ; i<i1 ; ++i) dst[i] = k0*src[i];
+    break;
+  case 1:
+    km1 = ker[-1]; k0 = ker[0]; kp1 = ker[1];
+    s1 = scale;
+    for (i=i0 ; i<i1 ; ++i) {
+      dst[i] = km1*src[i-s1] + k0*src[i] + kp1*src[i+s1];
+    }
+    break;
+  case 2:
+    km2 = ker[-2]; km1 = ker[-1]; k0 = ker[0]; kp1 = ker[1]; kp2 = ker[2];
+    s1 = scale;
+    s2 = 2*s1;
+    for (i=i0 ; i<i1 ; ++i) {
+      dst[i] = (km2*src[i-s2] + km1*src[i-s1] + k0*src[i] +
+                kp1*src[i+s1] + kp2*src[i+s2]);
+    }
+    break;
+  case 3:
+    km3 = ker[-3]; km2 = ker[-2]; km1 = ker[-1]; k0 = ker[0];
+    kp1 = ker[1]; kp2 = ker[2]; kp3 = ker[3];
+    s1 = scale;
+    s2 = 2*s1;
+    s3 = 3*s1;
+    for (i=i0 ; i<i1 ; ++i) {
+      dst[i] = (km3*src[i-s3] + km2*src[i-s2] + km1*src[i-s1] + k0*src[i] +
+                kp1*src[i+s1] + kp2*src[i+s2] + kp3*src[i+s3]);
+    }
+    break;
+  default:
+    CONVOLVE_IN_W(dst, src, i0, i1, ker, w, scale);
+  }
+}
+
+/* Convolve a line of N elements.  The interior of the line, where no
+   border conditions apply, is computed without any tests.  The two edges
+   are computed by the same code applied to a copy of the edge padded
+   according to the border conditions; BUF must have N + 2*E elements for
+   that (with E = W*SCALE) and IDX gives the indices of the E elements
+   before and the E elements after the line (see convolve_index).  For the
+   normalized mode, WGT gives the sums of the kernel weights inside the
+   line for every output element.  If BUF or IDX (or WGT for the normalized
+   mode) is NULL, the edges are computed element by element (this is
+   slower). */
+static void CONVOLVE_1(real_t dst[], const real_t src[], int n,
+                       const real_t ker[], int w, int scale, int border,
+                       real_t buf[], const long idx[], const real_t wgt[])
+{
+  long i, j, k, i0, i1, ilo, ihi, e, len, side;
+  real_t sum, s;
+  int normalized = CONVOLVE_NORMALIZED(border);
+
+  /* Compute the interior part of the line, that is ILO <= i < IHI. */
+  e = (long)w*scale;
+  ilo = e;
+  ihi = n - e;
+  if (ilo >= ihi) {
+    ilo = ihi = n;
+  } else {
+    CONVOLVE_IN(dst, src, ilo, ihi, ker, w, scale);
+    if (normalized) {
+      /* Normalize by the sum of the kernel weights. */
+      for (s=ZERO, j=-w ; j<=w ; ++j) s += ker[j];
+      if (s) {
+        for (i=ilo ; i<ihi ; ++i) dst[i] /= s;
+      } else {
+        for (i=ilo ; i<ihi ; ++i) dst[i] = ZERO;
       }
-      break;
-    case 2:
-      /* Extrapolate missing left values by the leftmost one
-         and missing right values by zero. */
-      xl = src[0];
-      for (i=0 ; i<n ; ++i) {
-        sum = ZERO;
-        jl = i<=w ? -i : -w;            /* limit of left border */
-        if ((jr = n-i) > wp1) jr = wp1; /* limit of right border */
-        for (j=-w        ; j<jl ; ++j)      sum += ker[j] * xl;
-        for (j=jl, k=i+j ; j<jr ; ++j, ++k) sum += ker[j] * src[k];
-        dst[i] = sum;
+    }
+  }
+
+  /* Compute the left edge 0 <= i < ILO, then the right edge IHI <= i < N. */
+  for (side = 0; side < 2; ++side) {
+    i0 = (side == 0 ? 0 : ihi);
+    i1 = (side == 0 ? ilo : n);
+    if (i0 >= i1) continue;
+    if (buf != NULL && idx != NULL && (wgt != NULL || ! normalized)) {
+      /* Pad the edge in BUF[0:LEN-1] which corresponds to indices I0 - E
+         to I1 + E - 1 of the line and convolve it. */
+      len = i1 - i0 + 2*e;
+      for (j = 0, k = i0 - e; k < 0; ++j, ++k) {
+        i = idx[k + e];
+        buf[j] = (i >= 0 ? src[i] : ZERO);
       }
-      break;
-    case 3:
-      /* Extrapolate missing values by zero. */
-      for (i=0 ; i<n ; ++i) {
-        sum = ZERO;
-        jl = i<=w ? -i : -w;            /* limit of left border */
-        if ((jr = n-i) > wp1) jr = wp1; /* limit of right border */
-        for (j=jl, k=i+j ; j<jr ; ++j, ++k) sum += ker[j] * src[k];
-        dst[i] = sum;
+      for ( ; j < len && k < n; ++j, ++k) buf[j] = src[k];
+      for ( ; j < len; ++j, ++k) {
+        i = idx[k - n + e];
+        buf[j] = (i >= 0 ? src[i] : ZERO);
       }
-      break;
-    case 4:
-      /* Periodic conditions. */
-      for (i=0 ; i<n ; ++i) {
-        sum = ZERO;
-        if ((k= i-(w%n)) < 0) k += n;
-        for (j=-w ; j<=w ; ++j, ++k) {
-          if (k>=n) k = 0;
-          sum += ker[j] * src[k];
+      CONVOLVE_IN(dst + i0, buf + e, 0, i1 - i0, ker, w, scale);
+      if (normalized) {
+        for (i = i0; i < i1; ++i) {
+          s = wgt[i];
+          dst[i] = (s ? dst[i]/s : ZERO);
         }
-        dst[i] = sum;
       }
-      break;
-    default:
-      /* Do not extrapolate missing values but normalize convolution
-         product by sum of kernel weights taken into account (assuming
-         they are all positive). */
-      for (i=0 ; i<n ; ++i) {
-        for (xl=sum=ZERO, j=-w, k=i-w ; j<=w && k<n ; ++j, ++k) {
+    } else {
+      for (i = i0; i < i1; ++i) {
+        sum = s = ZERO;
+        for (j = -w; j <= w; ++j) {
+          k = convolve_index(i + j*scale, n, border);
           if (k >= 0) {
-            xr = ker[j];
-            sum += xr* src[k];
-            xl  += xr;
+            sum += ker[j]*src[k];
+            s += ker[j];
           }
         }
-        dst[i] = xl ? sum/xl : ZERO;
+        dst[i] = (normalized ? (s ? sum/s : ZERO) : sum);
       }
     }
   }
@@ -287,5 +1553,16 @@ static void CONVOLVE_1(real_t dst[], const real_t src[], int n,
 #undef real_t
 #undef ZERO
 #undef CONVOLVE
+#undef CONVOLVE_MT
+#undef CONVOLVE_LINES
+#undef CONVOLVE_TASK
 #undef CONVOLVE_1
+#undef CONVOLVE_IN
+#undef CONVOLVE_IN_W
+#undef CONVOLVE_RUN
+#undef CONVOLVE_FIR
+#undef GAUSSIAN_1
+#undef GAUSSIAN_MT
+#undef CONVOLVE_FFT
+#undef CONVOLVE_METHOD
 #endif /* _YETI_CONVOLVE_C */
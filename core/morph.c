@@ -18,43 +18,263 @@
 
 #include "config.h"
 #include "yeti.h"
+#include "yeti-threads.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+
+/* Maximum number of dimensions of a Yorick array. */
+#define MORPH_MAX_RANK 10
+
+/* Union-find in the array of parents of the connected region labeling. */
+static long label_find(long lab[], long i);
+static void label_union(long lab[], long i, long j);
+
+/* VOXEL_MIN and VOXEL_MAX are the neutral elements of the dilation and of
+   the erosion, they are used to pad the lines in the van Herk/Gil-Werman
+   algorithm.  result_t is the type of the difference of two voxels in
+   Yorick.  VOXEL_PRED(x) is the largest value less than x (or x if there is
+   none). */
 
 #define voxel_t            unsigned char
+#define result_t           int
+#define VOXEL_MIN          0
+#define VOXEL_MAX          UCHAR_MAX
 #define MORPH_DILATION     dilation_c
 #define MORPH_EROSION      erosion_c
+#define MORPH_LINE_MAX     line_max_c
+#define MORPH_LINE_MIN     line_min_c
+#define MORPH_VHGW_MAX     vhgw_max_c
+#define MORPH_VHGW_MIN     vhgw_min_c
+#define MORPH_BALL_MAX     ball_max_c
+#define MORPH_BALL_MIN     ball_min_c
+#define MORPH_MINMAX       minmax_c
+#define MORPH_BALL_MINMAX  ball_minmax_c
+#define MORPH_DIFF         diff_c
+#define MORPH_TOGGLE       toggle_c
+#define MORPH_LABEL        label_c
+#define MORPH_RECON_MAX    recon_max_c
+#define MORPH_RECON_MIN    recon_min_c
+#define MORPH_MARKER       marker_c
+#define MORPH_REGMAX       regmax_c
+#define MORPH_EDT_INIT     edt_init_c
+#define VOXEL_PRED(x)      ((x) > VOXEL_MIN ? (x) - 1 : (x))
 #include __FILE__
 
 #define voxel_t            short
+#define result_t           int
+#define VOXEL_MIN          SHRT_MIN
+#define VOXEL_MAX          SHRT_MAX
 #define MORPH_DILATION     dilation_s
 #define MORPH_EROSION      erosion_s
+#define MORPH_LINE_MAX     line_max_s
+#define MORPH_LINE_MIN     line_min_s
+#define MORPH_VHGW_MAX     vhgw_max_s
+#define MORPH_VHGW_MIN     vhgw_min_s
+#define MORPH_BALL_MAX     ball_max_s
+#define MORPH_BALL_MIN     ball_min_s
+#define MORPH_MINMAX       minmax_s
+#define MORPH_BALL_MINMAX  ball_minmax_s
+#define MORPH_DIFF         diff_s
+#define MORPH_TOGGLE       toggle_s
+#define MORPH_LABEL        label_s
+#define MORPH_RECON_MAX    recon_max_s
+#define MORPH_RECON_MIN    recon_min_s
+#define MORPH_MARKER       marker_s
+#define MORPH_REGMAX       regmax_s
+#define MORPH_EDT_INIT     edt_init_s
+#define VOXEL_PRED(x)      ((x) > VOXEL_MIN ? (x) - 1 : (x))
 #include __FILE__
 
 #define voxel_t            int
+#define result_t           int
+#define VOXEL_MIN          INT_MIN
+#define VOXEL_MAX          INT_MAX
 #define MORPH_DILATION     dilation_i
 #define MORPH_EROSION      erosion_i
+#define MORPH_LINE_MAX     line_max_i
+#define MORPH_LINE_MIN     line_min_i
+#define MORPH_VHGW_MAX     vhgw_max_i
+#define MORPH_VHGW_MIN     vhgw_min_i
+#define MORPH_BALL_MAX     ball_max_i
+#define MORPH_BALL_MIN     ball_min_i
+#define MORPH_MINMAX       minmax_i
+#define MORPH_BALL_MINMAX  ball_minmax_i
+#define MORPH_DIFF         diff_i
+#define MORPH_TOGGLE       toggle_i
+#define MORPH_LABEL        label_i
+#define MORPH_RECON_MAX    recon_max_i
+#define MORPH_RECON_MIN    recon_min_i
+#define MORPH_MARKER       marker_i
+#define MORPH_REGMAX       regmax_i
+#define MORPH_EDT_INIT     edt_init_i
+#define VOXEL_PRED(x)      ((x) > VOXEL_MIN ? (x) - 1 : (x))
 #include __FILE__
 
 #define voxel_t            long
+#define result_t           long
+#define VOXEL_MIN          LONG_MIN
+#define VOXEL_MAX          LONG_MAX
 #define MORPH_DILATION     dilation_l
 #define MORPH_EROSION      erosion_l
+#define MORPH_LINE_MAX     line_max_l
+#define MORPH_LINE_MIN     line_min_l
+#define MORPH_VHGW_MAX     vhgw_max_l
+#define MORPH_VHGW_MIN     vhgw_min_l
+#define MORPH_BALL_MAX     ball_max_l
+#define MORPH_BALL_MIN     ball_min_l
+#define MORPH_MINMAX       minmax_l
+#define MORPH_BALL_MINMAX  ball_minmax_l
+#define MORPH_DIFF         diff_l
+#define MORPH_TOGGLE       toggle_l
+#define MORPH_LABEL        label_l
+#define MORPH_RECON_MAX    recon_max_l
+#define MORPH_RECON_MIN    recon_min_l
+#define MORPH_MARKER       marker_l
+#define MORPH_REGMAX       regmax_l
+#define MORPH_EDT_INIT     edt_init_l
+#define VOXEL_PRED(x)      ((x) > VOXEL_MIN ? (x) - 1 : (x))
 #include __FILE__
 
 #define voxel_t            float
+#define result_t           float
+#define VOXEL_MIN          (-HUGE_VALF)
+#define VOXEL_MAX          HUGE_VALF
 #define MORPH_DILATION     dilation_f
 #define MORPH_EROSION      erosion_f
+#define MORPH_LINE_MAX     line_max_f
+#define MORPH_LINE_MIN     line_min_f
+#define MORPH_VHGW_MAX     vhgw_max_f
+#define MORPH_VHGW_MIN     vhgw_min_f
+#define MORPH_BALL_MAX     ball_max_f
+#define MORPH_BALL_MIN     ball_min_f
+#define MORPH_MINMAX       minmax_f
+#define MORPH_BALL_MINMAX  ball_minmax_f
+#define MORPH_DIFF         diff_f
+#define MORPH_TOGGLE       toggle_f
+#define MORPH_LABEL        label_f
+#define MORPH_RECON_MAX    recon_max_f
+#define MORPH_RECON_MIN    recon_min_f
+#define MORPH_MARKER       marker_f
+#define MORPH_REGMAX       regmax_f
+#define MORPH_EDT_INIT     edt_init_f
+#define VOXEL_PRED(x)      nextafterf((x), VOXEL_MIN)
 #include __FILE__
 
 #define voxel_t            double
+#define result_t           double
+#define VOXEL_MIN          (-HUGE_VAL)
+#define VOXEL_MAX          HUGE_VAL
 #define MORPH_DILATION     dilation_d
 #define MORPH_EROSION      erosion_d
+#define MORPH_LINE_MAX     line_max_d
+#define MORPH_LINE_MIN     line_min_d
+#define MORPH_VHGW_MAX     vhgw_max_d
+#define MORPH_VHGW_MIN     vhgw_min_d
+#define MORPH_BALL_MAX     ball_max_d
+#define MORPH_BALL_MIN     ball_min_d
+#define MORPH_MINMAX       minmax_d
+#define MORPH_BALL_MINMAX  ball_minmax_d
+#define MORPH_DIFF         diff_d
+#define MORPH_TOGGLE       toggle_d
+#define MORPH_LABEL        label_d
+#define MORPH_RECON_MAX    recon_max_d
+#define MORPH_RECON_MIN    recon_min_d
+#define MORPH_MARKER       marker_d
+#define MORPH_REGMAX       regmax_d
+#define MORPH_EDT_INIT     edt_init_d
+#define VOXEL_PRED(x)      nextafter((x), VOXEL_MIN)
 #include __FILE__
 
+/* Kinds of structuring elements. */
+#define MORPH_BRUTE 0 /* arbitrary offsets */
+#define MORPH_BOX   1 /* box applied by separable passes */
+#define MORPH_LINE  2 /* line segment */
+#define MORPH_BALL  3 /* ball decomposed in chords */
+
+/* Structuring element prepared for a given array. */
+typedef struct _morph_element morph_element_t;
+struct _morph_element {
+  int kind;            /* one of MORPH_BRUTE, MORPH_BOX, ... */
+  int rank;            /* effective rank (after folding the dimensions) */
+  long dim[MORPH_MAX_RANK]; /* effective dimensions (trailing ones are 1) */
+  long nrows;          /* number of rows, the product of DIM[1..RANK-1] */
+  long lo[MORPH_MAX_RANK], hi[MORPH_MAX_RANK]; /* bounds of the box (of the
+                                                  line in LO[0],HI[0]) */
+  long u[3];           /* direction of the line segment */
+  const long* d[MORPH_MAX_RANK]; /* offsets along every dimension for the
+                                    brute force algorithm (at least 3) */
+  const long* off;     /* linear offsets */
+  long number;         /* number of offsets */
+  long inner[2*MORPH_MAX_RANK]; /* interior region where all offsets are in
+                                   bounds */
+  const long* chord;   /* chords of the ball */
+  long nchords;        /* number of chords */
+};
+
+/* Word of a bit-packed binary array. */
+typedef uint64_t morph_bits_t;
+
+/* Arguments of the morpho-math operations run by yeti_run_tasks. */
+typedef struct _morph_task morph_task_t;
+struct _morph_task {
+  const morph_element_t* elem; /* structuring element */
+  int type;            /* type of the voxels */
+  int mop;             /* 0 for an erosion, 1 for a dilation, 2 for both */
+  void* dst;           /* output array (local minimum if MOP = 2) */
+  void* dst2;          /* local maximum if MOP = 2 */
+  const void* src;     /* input array */
+  const long* dim;     /* dimensions of the current line pass */
+  const long* u;       /* direction of the current line pass */
+  long lo, hi;         /* bounds of the current line pass */
+  int xsplit;          /* split the line pass along X rather than rows */
+  char* ws;            /* workspaces of the threads */
+  size_t wsize;        /* size of the workspace of each thread (bytes) */
+};
+
+static int morph_args(int argc, int nmin, int nmax, Symbol* iarg[],
+                      Symbol** box, long* nthreads, const char* usage);
+static void morph_array(Symbol* s, Operand* op);
+static void morph_element(morph_element_t* e, const Operand* op,
+                          Symbol* r, Symbol* box);
+static size_t morph_workspace(const morph_element_t* e, int mop,
+                              size_t size);
+static void morph_apply(const morph_element_t* e, int type, size_t size,
+                        int mop, void* dst, void* dst2, const void* src,
+                        int nthreads, char* ws, size_t wsize);
 static void morph_op(int argc, int mop);
+static void top_hat(int argc, int white);
 static long* get_offset(Symbol* s, Dimension** dims);
+static int morph_box(const long* off[], long number, int rank,
+                     long lo[], long hi[], unsigned char mark[]);
+static int morph_line(const long* off[], long number, int rank,
+                      long u[], long* klo, long* khi, unsigned char mark[]);
+static void brute_task(void* data, long first, long last, int rank);
+static void line_task(void* data, long first, long last, int rank);
+static void ball_task(void* data, long first, long last, int rank);
+static int bin_check(const unsigned char a[], long n);
+static int bin_apply(const morph_element_t* e, int mop, unsigned char* dst,
+                     unsigned char* dst2, const unsigned char* src,
+                     int nthreads);
+static void bin_task(void* data, long first, long last, int rank);
+static int morph_dims(const Operand* op, long dim[]);
+static int morph_neighbors(long nbr[], int ndims, const long dim[],
+                           long connectivity);
+static void label_task(void* data, long first, long last, int rank);
+static void reconstruct(int argc, int mode);
+static void edt_task(void* data, long first, long last, int rank);
+static void label_apply(int type, long lab[], const void* img,
+                        const long dim[], const long nbr[], int nnbr,
+                        long first, long last, long rmin, long rmax,
+                        int init);
 
-extern BuiltIn Y_morph_erosion, Y_morph_dilation;
+extern BuiltIn Y_morph_erosion, Y_morph_dilation, Y_morph_minmax;
+extern BuiltIn Y_morph_toggle, Y_morph_white_top_hat, Y_morph_black_top_hat;
+extern BuiltIn Y_morph_segmentation, Y_morph_reconstruct, Y_morph_hmax;
+extern BuiltIn Y_morph_regional_max, Y_morph_fill_holes, Y_morph_distance;
 
 void Y_morph_erosion(int argc)
 {
@@ -66,133 +286,721 @@ void Y_morph_dilation(int argc)
   morph_op(argc, 1);
 }
 
+void Y_morph_minmax(int argc)
+{
+  morph_op(argc, 2);
+}
+
+void Y_morph_white_top_hat(int argc)
+{
+  top_hat(argc, 1);
+}
+
+void Y_morph_black_top_hat(int argc)
+{
+  top_hat(argc, 0);
+}
+
+/* Erosion (MOP = 0), dilation (MOP = 1) or both (MOP = 2). */
 static void morph_op(int argc, int mop)
 {
-  if (argc != 2) {
-    yor_error((mop ?
-               "morph_dilation() takes exactly 2 arguments" :
-               "morph_erosion() takes exactly 2 arguments"));
+  Symbol* iarg[2];
+  Symbol* box;
+  long nthreads;
+  morph_args(argc, 1, 2, iarg, &box, &nthreads,
+             (mop == 0 ? "usage: morph_erosion(a, r)" :
+              (mop == 1 ? "usage: morph_dilation(a, r)" :
+               "usage: morph_minmax(a, r)")));
+  CheckStack(8);
+
+  /* Get input array and structuring element. */
+  Operand op;
+  morph_array(iarg[0], &op);
+  morph_element_t e;
+  morph_element(&e, &op, iarg[1], box);
+
+  /* Allocate the workspaces and the output array and apply the operation.
+     The local minimum and maximum are stored along an extra last
+     dimension. */
+  int type = op.ops->typeID;
+  size_t size = op.type.base->size;
+  int threads = yeti_effective_threads(nthreads, e.nrows);
+  size_t wsize = morph_workspace(&e, mop, size);
+  char* ws = (wsize > 0 ? yor_push_workspace(threads*wsize) : NULL);
+  Array* ap;
+  if (mop == 2) {
+    long number[MORPH_MAX_RANK];
+    long ndims = yor_get_dims(op.type.dims, number, NULL, MORPH_MAX_RANK);
+    if (ndims >= MORPH_MAX_RANK) {
+      yor_error("too many dimensions for input array");
+    }
+    number[ndims] = 2;
+    ap = (Array*)PushDataBlock(NewArray(op.type.base,
+                                        yor_make_dims(number, NULL,
+                                                      ndims + 1)));
+  } else {
+    ap = (Array*)PushDataBlock(NewArray(op.type.base, op.type.dims));
   }
+  morph_apply(&e, type, size, mop, ap->value.c,
+              ap->value.c + op.type.number*size, op.value,
+              threads, ws, wsize);
+}
 
-  /* Get input array. */
-  Symbol* s = sp - 1;
-  if (s->ops == NULL) yor_unexpected_keyword_argument();
+void Y_morph_toggle(int argc)
+{
+  Symbol* iarg[2];
+  Symbol* box;
+  long nthreads;
+  morph_args(argc, 1, 2, iarg, &box, &nthreads, "usage: morph_toggle(a, r)");
+  CheckStack(8);
   Operand op;
-  Dimension* dims = s->ops->FormOperand(s, &op)->type.dims;
-  long ndims = 0;
-  long width = 0;
-  long height = 0;
-  long depth = 0;
-  while (dims != NULL) {
-    if (++ndims > 3) yor_error("too many dimensions for input array");
-    depth = height;
-    height = width;
-    width = dims->number;
-    dims = dims->next;
-  }
-
-  /* Get radius or offset array. */
-  long* off = get_offset(sp, &dims);
-  long* dx;
-  long* dy;
-  long* dz;
-  long number;
-  if (dims == NULL) {
-    /* Only one extra scalar argument: the structuring element is a
-       sphere. */
-    long r = off[0];
-    if (r < 0) {
-      yor_error("radius of structuring element must be non-negative");
-    }
-    Drop(1); /* to be able to push temporary workspace */
-    long n = 2*r + 1;
-    long lim0 = r*(r + 1);
-    number = 0;
-    if (depth > 1) {
-      long mx = n*n*n; /* maximum number of offsets per dimension */
-      dx = yor_push_workspace(3*sizeof(long)*mx);
-      dy = dx + mx;
-      dz = dy + mx;
-      for (long z = -r; z <= r; ++z) {
-        long lim1 = lim0 - z*z;
-        for (long y = -r; y <= r; ++y) {
-          long lim2 = lim1 - y*y;
-          for (long x = -r; x <= r; ++x) {
-            /* To be inside the structuring element, we must have
-             *   sqrt(x*x + y*y + z*z) < r + 1/2
-             * which is the same as:
-             *   x*x + y*y + z*z <= r*(r + 1)
-             * because X, Y, Z and R are integers.
-             */
-            if (x*x <= lim2) {
-              dx[number] = x;
-              dy[number] = y;
-              dz[number] = z;
-              ++number;
+  morph_array(iarg[0], &op);
+  morph_element_t e;
+  morph_element(&e, &op, iarg[1], box);
+  int type = op.ops->typeID;
+  size_t size = op.type.base->size;
+  long ntot = op.type.number;
+  int threads = yeti_effective_threads(nthreads, e.nrows);
+  size_t wsize = morph_workspace(&e, 2, size);
+  char* ws = (wsize > 0 ? yor_push_workspace(threads*wsize) : NULL);
+  char* tmp = yor_push_workspace(2*ntot*size);
+  Array* ap = (Array*)PushDataBlock(NewArray(op.type.base, op.type.dims));
+  morph_apply(&e, type, size, 2, tmp, tmp + ntot*size, op.value,
+              threads, ws, wsize);
+  switch (type) {
+#undef _
+#define _(T, id) toggle_##id((T*)ap->value.c, (const T*)op.value,        \
+                              (const T*)tmp, (const T*)(tmp + ntot*size), \
+                              ntot); break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
+#undef _
+  }
+}
+
+/* White (WHITE = 1) or black (WHITE = 0) top-hat filter.  The opening and
+   closing are computed in workspaces and the difference is directly
+   written in the result whose type is the same as in Yorick arithmetic
+   (int for char or short input). */
+static void top_hat(int argc, int white)
+{
+  Symbol* iarg[3];
+  Symbol* box;
+  long nthreads;
+  morph_args(argc, 1, 3, iarg, &box, &nthreads,
+             (white ? "usage: morph_white_top_hat(a, r, s)" :
+              "usage: morph_black_top_hat(a, r, s)"));
+  CheckStack(16);
+  Operand op;
+  morph_array(iarg[0], &op);
+  morph_element_t er, es;
+  morph_element(&er, &op, iarg[1], box);
+  int smooth = (iarg[2] != NULL && YNotNil(iarg[2]));
+  if (smooth) morph_element(&es, &op, iarg[2], NULL);
+  int type = op.ops->typeID;
+  size_t size = op.type.base->size;
+  long ntot = op.type.number;
+  int threads = yeti_effective_threads(nthreads, er.nrows);
+  size_t wsize = morph_workspace(&er, 0, size);
+  if (smooth) {
+    size_t tmp = morph_workspace(&es, 0, size);
+    if (tmp > wsize) wsize = tmp;
+  }
+  char* ws = (wsize > 0 ? yor_push_workspace(threads*wsize) : NULL);
+  char* t1 = yor_push_workspace((smooth ? 3 : 2)*ntot*size);
+  char* t2 = t1 + ntot*size;
+  const char* a = op.value;
+  if (smooth) {
+    /* Pre-filter A by a closing (white top-hat) or an opening (black
+       top-hat) by S. */
+    char* t3 = t2 + ntot*size;
+    morph_apply(&es, type, size, white, t1, NULL, a, threads, ws, wsize);
+    morph_apply(&es, type, size, !white, t3, NULL, t1, threads, ws, wsize);
+    a = t3;
+  }
+  morph_apply(&er, type, size, !white, t1, NULL, a, threads, ws, wsize);
+  morph_apply(&er, type, size, white, t2, NULL, t1, threads, ws, wsize);
+  const char* x = (white ? a : t2);
+  const char* y = (white ? t2 : a);
+  StructDef* base = (type <= YOR_SHORT ? &intStruct : op.type.base);
+  Array* ap = (Array*)PushDataBlock(NewArray(base, op.type.dims));
+  switch (type) {
+#undef _
+#define _(T, id) diff_##id((void*)ap->value.c, (const T*)x, (const T*)y, \
+                            ntot); break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
+#undef _
+  }
+}
+
+/* Parse the arguments of a morpho-math builtin: at least NMIN and at most
+   NMAX positional arguments (missing ones are set to NULL) and keywords
+   BOX and NTHREADS.  Return the number of positional arguments. */
+static int morph_args(int argc, int nmin, int nmax, Symbol* iarg[],
+                      Symbol** box, long* nthreads, const char* usage)
+{
+  int nparsed = 0;
+  *box = NULL;
+  *nthreads = 1;
+  for (Symbol* stack = sp - argc + 1; stack <= sp; ++stack) {
+    if (stack->ops != NULL) {
+      /* Positional argument. */
+      if (nparsed >= nmax) yor_error(usage);
+      iarg[nparsed++] = stack;
+    } else {
+      /* Keyword argument. */
+      const char* keyword = globalTable.names[stack->index];
+      ++stack;
+      if (keyword[0] == 'b' && strcmp(keyword, "box") == 0) {
+        if (YNotNil(stack)) *box = stack;
+      } else if (keyword[0] == 'n' && strcmp(keyword, "nthreads") == 0) {
+        if (YNotNil(stack)) *nthreads = yor_get_integer(stack);
+      } else {
+        yor_error("unknown keyword");
+      }
+    }
+  }
+  if (nparsed < nmin) yor_error(usage);
+  for (int i = nparsed; i < nmax; ++i) iarg[i] = NULL;
+  return nparsed;
+}
+
+/* Get the input array of a morpho-math operation. */
+static void morph_array(Symbol* s, Operand* op)
+{
+  s->ops->FormOperand(s, op);
+  int type = op->ops->typeID;
+  if (type < YOR_CHAR || type > YOR_DOUBLE) {
+    yor_error("bad data type");
+  }
+}
+
+/* Prepare the structuring element given by R or BOX for the array OP.
+   Temporary workspaces may be pushed on top of the stack.  The consecutive
+   dimensions along which the structuring element has no extent are folded
+   together (like in RGL_ROUGHNESS) so that the operation is applied to the
+   whole array with as few dimensions as possible. */
+static void morph_element(morph_element_t* e, const Operand* op,
+                          Symbol* sr, Symbol* box)
+{
+  if (sr != NULL && ! YNotNil(sr)) sr = NULL;
+  if (box != NULL && sr != NULL) {
+    yor_error("structuring element must be given by R or BOX, not both");
+  }
+  if (box == NULL && sr == NULL) {
+    yor_error("missing structuring element");
+  }
+  long adim[MORPH_MAX_RANK];
+  long ndims = yor_get_dims(op->type.dims, adim, NULL, MORPH_MAX_RANK);
+
+  /* Effective rank of the operation.  As in the brute force algorithm,
+     trailing dimensions of length 1 are ignored. */
+  int rank = (ndims > 0 ? ndims : 1);
+  if (ndims < 1) adim[0] = 1;
+  while (rank > 1 && adim[rank - 1] == 1) --rank;
+  memset(e, 0, sizeof(*e));
+  e->kind = MORPH_BRUTE;
+
+  /* Get the structuring element along the RANK first dimensions: a box
+     given by keyword (the sizes or the bounds of the offsets along every
+     dimension), a ball of radius R or an array of offsets. */
+  Dimension* dims;
+  long lo[MORPH_MAX_RANK], hi[MORPH_MAX_RANK];
+  const long* d[MORPH_MAX_RANK];
+  long number = 0;
+  long r = -1;
+  if (box != NULL) {
+    long* bnd = get_offset(box, &dims);
+    long nbnd = 1;
+    long first = 1; /* length of the first dimension (last in the list) */
+    for (Dimension* tmp = dims; tmp != NULL; tmp = tmp->next) {
+      nbnd *= tmp->number;
+      first = tmp->number;
+    }
+    if (dims == NULL || nbnd == ndims) {
+      for (long j = 0; j < ndims; ++j) {
+        long w = bnd[dims == NULL ? 0 : j];
+        if (w < 1) yor_error("box size must be at least 1");
+        lo[j] = -(w/2);
+        hi[j] = (w - 1)/2;
+      }
+    } else if (first == 2 && nbnd == 2*ndims) {
+      for (long j = 0; j < ndims; ++j) {
+        if (bnd[2*j] > bnd[2*j + 1]) yor_error("bad box bounds");
+        lo[j] = bnd[2*j];
+        hi[j] = bnd[2*j + 1];
+      }
+    } else {
+      yor_error("BOX must have one size or a pair of bounds per dimension");
+    }
+    if (ndims < 1) lo[0] = hi[0] = 0;
+    e->kind = MORPH_BOX;
+  } else {
+    long* off = get_offset(sr, &dims);
+    if (dims == NULL) {
+      /* Only one extra scalar argument: the structuring element is a
+         sphere. */
+      r = off[0];
+      if (r < 0) {
+        yor_error("radius of structuring element must be non-negative");
+      }
+      if (rank >= 4 || rank == 1 || r < 2) {
+        /* Offsets X of the ball.  To be inside the structuring element, we
+         * must have:
+         *   sqrt(X[0]^2 + X[1]^2 + ...) < r + 1/2
+         * which is the same as:
+         *   X[0]^2 + X[1]^2 + ... <= r*(r + 1)
+         * because the X[j] and R are integers.  The offsets are counted in
+         * a first pass and stored in a second one.
+         */
+        long x[MORPH_MAX_RANK];
+        long* w = NULL;
+        for (int pass = 0; pass < 2; ++pass) {
+          long k = 0;
+          if (pass == 1) w = yor_push_workspace(rank*number*sizeof(long));
+          for (int j = 0; j < rank; ++j) x[j] = -r;
+          for (;;) {
+            long s = 0;
+            for (int j = 0; j < rank; ++j) s += x[j]*x[j];
+            if (s <= r*(r + 1)) {
+              if (pass == 1) {
+                for (int j = 0; j < rank; ++j) w[j*number + k] = x[j];
+              }
+              ++k;
             }
+            int j = 0;
+            while (j < rank && x[j] == r) x[j++] = -r;
+            if (j == rank) break;
+            ++x[j];
           }
+          number = k;
         }
+        for (int j = 0; j < rank; ++j) d[j] = w + j*number;
+        r = -1;
       }
-    } else if (height > 1) {
-      long mx = n*n; /* maximum number of offsets per dimension */
-      dx = yor_push_workspace(2*sizeof(long)*mx);
-      dy = dx + mx;
-      dz = NULL;
-      for (long y = -r; y <= r; ++y) {
-        long lim1 = lim0 - y*y;
-        for (long x = -r; x <= r; ++x) {
-          if (x*x <= lim1) {
-            dx[number] = x;
-            dy[number] = y;
-            ++number;
-          }
+    } else {
+      if (ndims > 1) {
+        if (dims->number != ndims) {
+          yor_error("last dimension of OFF not equal to number of dimensions of A");
         }
+        dims = dims->next;
       }
-    } else {
-      long mx = n;
-      dx = yor_push_workspace(sizeof(long)*mx);
-      dy = NULL;
-      dz = NULL;
-      for (long x = -r; x <= r; ++x) {
-        dx[number] = x;
-        ++number;
+      number = 1;
+      while (dims != NULL) {
+        number *= dims->number;
+        dims = dims->next;
       }
+      for (int j = 0; j < rank; ++j) d[j] = off + j*number;
     }
-  } else {
-    if (ndims > 1) {
-      if (dims->number != ndims) {
-        yor_error("last dimension of OFF not equal to number of dimensions of A");
+  }
+
+  /* Fold the dimensions.  JDIM[J] is the first dimension of A folded in
+     the J-th effective dimension. */
+  int ext[MORPH_MAX_RANK]; /* structuring element has extent? */
+  for (int j = 0; j < rank; ++j) {
+    if (e->kind == MORPH_BOX) {
+      ext[j] = (lo[j] != 0 || hi[j] != 0);
+    } else if (r >= 0) {
+      ext[j] = 1;
+    } else {
+      ext[j] = 0;
+      for (long i = 0; i < number && ! ext[j]; ++i) ext[j] = (d[j][i] != 0);
+    }
+  }
+  int jdim[MORPH_MAX_RANK];
+  int nc = 0;
+  for (int j = 0; j < rank; ++j) {
+    if (nc > 0 && ! ext[j] && ! ext[jdim[nc - 1]]) {
+      e->dim[nc - 1] *= adim[j];
+    } else {
+      e->dim[nc] = adim[j];
+      jdim[nc++] = j;
+    }
+  }
+  for (int j = nc; j < MORPH_MAX_RANK; ++j) e->dim[j] = 1;
+  rank = e->rank = nc;
+  e->nrows = 1;
+  for (int j = 1; j < rank; ++j) e->nrows *= e->dim[j];
+
+  if (e->kind == MORPH_BOX) {
+    for (int j = 0; j < rank; ++j) {
+      e->lo[j] = lo[jdim[j]];
+      e->hi[j] = hi[jdim[j]];
+    }
+    return;
+  }
+
+  if (r >= 0) {
+    /* Decompose the ball in chords along the first dimension, the central
+       chord comes first. */
+    long n = 2*r + 1;
+    long lim0 = r*(r + 1);
+    long mx = (rank >= 3 ? n*n : n); /* maximum number of chords */
+    long* chord = yor_push_workspace(3*sizeof(long)*mx);
+    chord[0] = 0;
+    chord[1] = 0;
+    chord[2] = r;
+    long nchords = 1;
+    long zmax = (rank >= 3 ? r : 0);
+    for (long z = -zmax; z <= zmax; ++z) {
+      for (long y = -r; y <= r; ++y) {
+        long lim1 = lim0 - y*y - z*z;
+        if (lim1 < 0 || (y == 0 && z == 0)) continue;
+        long h = (long)sqrt((double)lim1);
+        while (h*h > lim1) --h;
+        while ((h + 1)*(h + 1) <= lim1) ++h;
+        chord[3*nchords] = y;
+        chord[3*nchords + 1] = z;
+        chord[3*nchords + 2] = h;
+        ++nchords;
       }
-      dims = dims->next;
     }
-    number = 1;
-    while (dims != NULL) {
-      number *= dims->number;
-      dims = dims->next;
+    e->kind = MORPH_BALL;
+    e->chord = chord;
+    e->nchords = nchords;
+    return;
+  }
+
+  /* Offsets along the effective dimensions (at least 3, missing ones are
+     zero), linear offsets and interior region for the brute force
+     algorithm. */
+  int nd = (rank > 3 ? rank : 3);
+  long* w = yor_push_workspace((nd + 1)*number*sizeof(long));
+  long* lin = w + nd*number;
+  memset(lin, 0, number*sizeof(long));
+  long stride = 1;
+  for (int j = 0; j < nd; ++j) {
+    long* o = w + j*number;
+    long vmin = 0, vmax = 0;
+    for (long i = 0; i < number; ++i) {
+      long v = (j < rank && ext[jdim[j]] ? d[jdim[j]][i] : 0);
+      o[i] = v;
+      lin[i] += v*stride;
+      if (i == 0 || v < vmin) vmin = v;
+      if (i == 0 || v > vmax) vmax = v;
     }
-    dx = off;
-    dy = (ndims >= 2 ? dx + number : NULL);
-    dz = (ndims >= 3 ? dy + number : NULL);
+    e->d[j] = o;
+    e->inner[2*j] = (vmin < 0 ? -vmin : 0);
+    e->inner[2*j + 1] = (vmax > 0 ? e->dim[j] - vmax : e->dim[j]);
+    stride *= e->dim[j];
   }
+  e->off = lin;
+  e->number = number;
 
-  /* Allocate output array and apply the operation. */
-  Array* ap = ((Array*)PushDataBlock(NewArray(op.type.base, op.type.dims)));
-  switch (op.ops->typeID) {
+  /* Check whether the structuring element is a box or a line. */
+  unsigned char* mark = yor_push_workspace(number);
+  long klo, khi;
+  if (morph_box(e->d, number, rank, e->lo, e->hi, mark)) {
+    e->kind = MORPH_BOX;
+    return;
+  }
+  if (rank <= 3 && morph_line(e->d, number, rank, e->u, &klo, &khi, mark)) {
+    e->kind = MORPH_LINE;
+    e->lo[0] = klo;
+    e->hi[0] = khi;
+  }
+}
+
+/* Size of the workspace of each thread (in bytes) for the operation MOP by
+   the structuring element E on voxels of SIZE bytes: a padded line is at
+   most 3 times longer than the longest line, the chords of a ball need a
+   second line buffer to compute the minimum and the maximum together and
+   the brute force algorithm needs a flag per offset. */
+static size_t morph_workspace(const morph_element_t* e, int mop,
+                              size_t size)
+{
+  long maxlen = e->dim[0];
+  if (e->kind == MORPH_BALL) {
+    return (mop == 2 ? 9 : 6)*maxlen*size;
+  }
+  if (e->kind == MORPH_BOX || e->kind == MORPH_LINE) {
+    for (int j = 1; j < e->rank; ++j) {
+      if (e->dim[j] > maxlen) maxlen = e->dim[j];
+    }
+    return 6*maxlen*size;
+  }
+  return e->number;
+}
+
+/* Apply the erosion (MOP = 0), the dilation (MOP = 1) or both (MOP = 2) by
+   the structuring element E to the array SRC of type TYPE and store the
+   result in DST (the local minimum in DST and the local maximum in DST2 if
+   MOP = 2).  DST and DST2 must not overlap SRC.  WS provides WSIZE bytes
+   per thread.  Binary char arrays are processed by the bit-packed algorithm
+   (the stack is left unchanged so that the caller's result remains on
+   top). */
+static void morph_apply(const morph_element_t* e, int type, size_t size,
+                        int mop, void* dst, void* dst2, const void* src,
+                        int nthreads, char* ws, size_t wsize)
+{
+  if (type == YOR_CHAR && e->rank <= 3 && bin_check(src, e->dim[0]*e->nrows)
+      && bin_apply(e, mop, dst, dst2, src, nthreads)) {
+    return;
+  }
+  morph_task_t task;
+  task.elem = e;
+  task.type = type;
+  task.mop = mop;
+  task.dst = dst;
+  task.dst2 = dst2;
+  task.src = src;
+  task.dim = e->dim;
+  task.u = e->u;
+  task.lo = e->lo[0];
+  task.hi = e->hi[0];
+  task.xsplit = 0;
+  task.ws = ws;
+  task.wsize = wsize;
+  long nrows = e->nrows;
+  if (e->kind == MORPH_BALL) {
+    yeti_run_tasks(ball_task, &task, nrows, nthreads);
+  } else if (e->kind == MORPH_BOX || e->kind == MORPH_LINE) {
+    /* Separable passes of the van Herk/Gil-Werman algorithm on a copy of the
+       input array. */
+    long ntot = e->dim[0]*nrows;
+    memcpy(dst, src, ntot*size);
+    if (mop == 2) memcpy(dst2, src, ntot*size);
+    if (e->kind == MORPH_BOX) {
+      /* The pass along the J-th dimension views the array as a 3-D one
+         whose second dimension is the J-th one (or the first one if J =
+         0), so that the lines are along the second dimension. */
+      long u[3], dim[3];
+      task.dim = dim;
+      task.u = u;
+      for (int j = 0; j < e->rank; ++j) {
+        if (e->lo[j] != 0 || e->hi[j] != 0) {
+          if (j == 0) {
+            dim[0] = e->dim[0];
+            dim[1] = nrows;
+            dim[2] = 1;
+          } else {
+            dim[0] = dim[2] = 1;
+            for (int k = 0; k < j; ++k) dim[0] *= e->dim[k];
+            dim[1] = e->dim[j];
+            for (int k = j + 1; k < e->rank; ++k) dim[2] *= e->dim[k];
+          }
+          u[0] = (j == 0);
+          u[1] = (j != 0);
+          u[2] = 0;
+          task.lo = e->lo[j];
+          task.hi = e->hi[j];
+          /* For J > 0, the lines only start in the DIM[2] rows with Y = 0,
+             split the pass along X if there are more lines per row. */
+          task.xsplit = (j > 0 && dim[0] > dim[2]);
+          yeti_run_tasks(line_task, &task,
+                         (task.xsplit ? dim[0] : dim[1]*dim[2]), nthreads);
+        }
+      }
+    } else {
+      yeti_run_tasks(line_task, &task, nrows, nthreads);
+    }
+  } else {
+    /* Split a single row in chunks. */
+    yeti_run_tasks(brute_task, &task, (nrows > 1 ? nrows : e->dim[0]),
+                   nthreads);
+  }
+}
+
+/* Apply the brute force algorithm to the rows [FIRST,LAST), or to the
+   voxels [FIRST,LAST) if there is a single row. */
+static void brute_task(void* data, long first, long last, int rank)
+{
+  const morph_task_t* t = data;
+  const morph_element_t* e = t->elem;
+  unsigned char* ok = (unsigned char*)(t->ws + rank*t->wsize);
+  long xbeg = 0, xend = e->dim[0];
+  if (e->nrows == 1) {
+    xbeg = first;
+    xend = last;
+    first = 0;
+    last = 1;
+  }
+  switch (t->type) {
 #undef _
-#define _(T) (mop ? dilation_##T : erosion_##T)((void*)ap->value.T, \
-              op.value, width, height, depth, dx, dy, dz, number); break
-  case YOR_CHAR:   _(c);
-  case YOR_SHORT:  _(s);
-  case YOR_INT:    _(i);
-  case YOR_LONG:   _(l);
-  case YOR_FLOAT:  _(f);
-  case YOR_DOUBLE: _(d);
+#define _(T, id)                                                        \
+  if (t->mop == 2) {                                                    \
+    minmax_##id((T*)t->dst, (T*)t->dst2, (const T*)t->src, e->rank,     \
+                e->dim, e->d, e->off, e->number, e->inner,              \
+                first, last, xbeg, xend, ok);                           \
+  } else {                                                              \
+    (t->mop ? dilation_##id : erosion_##id)((T*)t->dst,                 \
+        (const T*)t->src, e->rank, e->dim, e->d, e->off,                \
+        e->number, e->inner, first, last, xbeg, xend, ok);              \
+  }                                                                     \
+  break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
 #undef _
-  default:
-    yor_error("bad data type");
   }
 }
 
+/* Apply the dilation and/or the erosion by a line segment along the lines
+   starting in the rows [FIRST,LAST), or at the abscissae [FIRST,LAST) of
+   all rows if the pass is split along X, in-place in the output
+   array(s). */
+static void line_task(void* data, long first, long last, int rank)
+{
+  const morph_task_t* t = data;
+  const long* dim = t->dim;
+  void* ws = t->ws + rank*t->wsize;
+  long xbeg = 0, xend = dim[0];
+  if (t->xsplit) {
+    xbeg = first;
+    xend = last;
+    first = 0;
+    last = dim[1]*dim[2];
+  }
+  switch (t->type) {
+#undef _
+#define _(T, id)                                                        \
+  if (t->mop != 1) {                                                    \
+    line_min_##id((T*)t->dst, dim, t->u, t->lo, t->hi, first, last,     \
+                  xbeg, xend, (T*)ws);                                  \
+  }                                                                     \
+  if (t->mop != 0) {                                                    \
+    line_max_##id((T*)(t->mop == 2 ? t->dst2 : t->dst), dim, t->u,      \
+                  t->lo, t->hi, first, last, xbeg, xend, (T*)ws);       \
+  }                                                                     \
+  break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
+#undef _
+  }
+}
+
+/* Apply the dilation and/or the erosion by a ball decomposed in chords to
+   the rows [FIRST,LAST). */
+static void ball_task(void* data, long first, long last, int rank)
+{
+  const morph_task_t* t = data;
+  const morph_element_t* e = t->elem;
+  void* ws = t->ws + rank*t->wsize;
+  switch (t->type) {
+#undef _
+#define _(T, id)                                                        \
+  if (t->mop == 2) {                                                    \
+    ball_minmax_##id((T*)t->dst, (T*)t->dst2, (const T*)t->src, e->dim, \
+                     e->chord, e->nchords, first, last, (T*)ws);        \
+  } else {                                                              \
+    (t->mop ? ball_max_##id : ball_min_##id)((T*)t->dst,                \
+        (const T*)t->src, e->dim, e->chord, e->nchords, first, last,    \
+        (T*)ws);                                                        \
+  }                                                                     \
+  break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
+#undef _
+  }
+}
+
+/* Check whether the NUMBER offsets OFF[0..RANK-1] form a box, that is all
+   the distinct offsets within some bounds (stored in LO and HI).  MARK is
+   a workspace of NUMBER bytes. */
+static int morph_box(const long* off[], long number, int rank,
+                     long lo[], long hi[], unsigned char mark[])
+{
+  long volume = 1;
+  for (int j = 0; j < rank; ++j) {
+    long vmin = off[j][0], vmax = off[j][0];
+    for (long i = 1; i < number; ++i) {
+      long v = off[j][i];
+      if (v < vmin) vmin = v;
+      if (v > vmax) vmax = v;
+    }
+    lo[j] = vmin;
+    hi[j] = vmax;
+    volume *= vmax - vmin + 1;
+    if (volume > number) return 0;
+  }
+  if (volume != number) return 0;
+  memset(mark, 0, number);
+  for (long i = 0; i < number; ++i) {
+    long k = 0;
+    for (int j = rank - 1; j >= 0; --j) {
+      k = k*(hi[j] - lo[j] + 1) + (off[j][i] - lo[j]);
+    }
+    if (mark[k]) return 0;
+    mark[k] = 1;
+  }
+  return 1;
+}
+
+/* Check whether the NUMBER offsets OFF[0..RANK-1] form a line segment, that
+   is K*U for all K in [KLO,KHI] with the components of the direction U in
+   {-1,0,1}.  MARK is a workspace of NUMBER bytes. */
+static int morph_line(const long* off[], long number, int rank,
+                      long u[], long* klo, long* khi, unsigned char mark[])
+{
+  long kmin = 0, kmax = 0;
+  long k[3];
+  int found = 0;
+  for (long i = 0; i < number; ++i) {
+    /* Find K and the direction (with positive first non-zero component) of
+       the I-th offset. */
+    long m = 0;
+    for (int j = 0; j < rank; ++j) {
+      long v = off[j][i];
+      if (v < 0) v = -v;
+      if (v > m) m = v;
+    }
+    long s = 0;
+    for (int j = 0; j < rank; ++j) {
+      long v = off[j][i];
+      if (v != 0 && v != m && v != -m) return 0;
+      if (s == 0 && v != 0) s = (v > 0 ? 1 : -1);
+      k[j] = (v == 0 ? 0 : (v > 0 ? 1 : -1)*s);
+    }
+    if (m != 0) {
+      if (! found) {
+        for (int j = 0; j < rank; ++j) u[j] = k[j];
+        found = 1;
+      } else {
+        for (int j = 0; j < rank; ++j) if (k[j] != u[j]) return 0;
+      }
+      m *= s;
+    }
+    if (i == 0 || m < kmin) kmin = m;
+    if (i == 0 || m > kmax) kmax = m;
+  }
+  if (! found || kmax - kmin + 1 != number) return 0;
+
+  /* Check that the offsets are all distinct. */
+  memset(mark, 0, number);
+  for (long i = 0; i < number; ++i) {
+    long m = 0;
+    for (int j = 0; j < rank && m == 0; ++j) {
+      if (u[j] != 0) m = off[j][i]*u[j];
+    }
+    if (mark[m - kmin]) return 0;
+    mark[m - kmin] = 1;
+  }
+  for (int j = rank; j < 3; ++j) u[j] = 0;
+  *klo = kmin;
+  *khi = kmax;
+  return 1;
+}
+
 /* almost the same as YGet_L */
 static long* get_offset(Symbol* s, Dimension** dims)
 {
@@ -215,182 +1023,985 @@ static long* get_offset(Symbol* s, Dimension** dims)
   return 0L;
 }
 
-#else /* _YETI_MORPH_C ------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/* BIT-PACKED BINARY MORPHOLOGY */
+
+/* Phases of the binary morphology. */
+#define BIN_PACK   0 /* pack the rows of the source */
+#define BIN_WINDOW 1 /* combine the bits in a window along the rows */
+#define BIN_OR     2 /* combine the shifted rows in the result */
+#define BIN_UNPACK 3 /* unpack the rows of the result */
 
-#ifdef MORPH_SEGMENTATION
+/* Arguments of the binary morphology run by yeti_run_tasks.  The rows of N
+   voxels are packed in NW words of 64 bits, the bits beyond the end of a row
+   are always zero. */
+typedef struct _bin_task bin_task_t;
+struct _bin_task {
+  int phase;           /* one of BIN_PACK, BIN_WINDOW, ... */
+  int invert;          /* complement the voxels when packing/unpacking? */
+  long nx, ny, nz;     /* dimensions of the array */
+  long nw;             /* number of words per row */
+  morph_bits_t* w;     /* packed source */
+  morph_bits_t* t;     /* packed source combined in a window */
+  morph_bits_t* r;     /* packed result */
+  morph_bits_t* ws;    /* a row per thread */
+  unsigned char* dst;  /* output array */
+  const unsigned char* src; /* input array */
+  long lo, hi;         /* bounds of the window along the rows */
+  const long* run;     /* runs of the current group (LO,HI,DY,DZ) */
+  long nruns;          /* number of runs in the current group */
+};
+
+/* Compare runs (LO,HI,DY,DZ) or offsets (DZ,DY,DX) in lexicographic
+   order. */
+static int bin_compare(const void* a, const void* b)
+{
+  const long* p = a;
+  const long* q = b;
+  for (int j = 0; j < 3; ++j) {
+    if (p[j] != q[j]) return (p[j] < q[j] ? -1 : 1);
+  }
+  return 0;
+}
 
-long MORPH_SEGMENTATION(long region[],
-                        search_t search[],
-                        long index[], long nb[],
-                        unsigned short x0[], unsigned short x1[],
-                        unsigned short y0[], unsigned short y1[],
-                        const voxel_t img[], long width, long height)
+/* Check whether the char array A of N voxels only has 0 and 1 values. */
+static int bin_check(const unsigned char a[], long n)
 {
-#define LEFT   ((search_t)1)
-#define RIGHT  ((search_t)2)
-#define DOWN   ((search_t)4)
-#define UP     ((search_t)8)
-#define ALL    ((search_t)(LEFT|RIGHT|DOWN|UP))
+  unsigned char c = 0;
+  for (long i = 0; i < n; ++i) {
+    c |= a[i];
+  }
+  return (c <= 1);
+}
 
-  long mark = 1;
-  long number = width*height;
-  for (long i = 0; i < number; ++i) {
-    if (region[i] != 0) continue; /* pixel already marked */
-    long count = 0;         /* start a new region with zero pixels */
-    voxel_t level = img[i]; /* pixel value within current region */
-    region[i] = mark;       /* mark current pixel */
-    search[i] = ALL;        /* will check all neighbors of current pixel */
-    index[count++] = i;     /* current pixel belongs to current region */
-    for (long j = 0; j < count; ++j) {
-      long k = index[j];
-      long x = k%width;
-      long y = k/width;
-      search_t s = search[k];
-
-#define CHECK_PIXEL(DIRECTION, BOUND_CHECK, POSITION)	\
-      do {                                              \
-        if ((s & DIRECTION) && (BOUND_CHECK)) {         \
-          long l = (POSITION);                          \
-          if (img[l] == level) {                        \
-            if (region[l] == mark) {			\
-              search[l] &= (ALL & (~(DIRECTION)));	\
-            } else {					\
-              region[l] = mark;				\
-              search[l] = (ALL & (~(DIRECTION)));       \
-              index[count++] = l;                       \
-            }						\
-          }						\
-        }                                               \
-      } while (0)
-      CHECK_PIXEL(LEFT,  x > 0,            k - 1);
-      CHECK_PIXEL(RIGHT, x < (width - 1),  k + 1);
-      CHECK_PIXEL(DOWN,  y > 0,            k - width);
-      CHECK_PIXEL(UP,    y < (height - 1), k + width);
-#undef CHECK_PIXEL
-    }
-
-    if (nb != NULL) {
-      nb[mark - 1] = count;
-    }
-    if (x0 != NULL || x1 != NULL) {
-      long xmin, xmax;
-      xmin = xmax = index[0]%width;
-      for (long j = 1; j < count; ++j) {
-        x = index[j]%width;
-        if (x < xmin) xmin = x;
-        if (x > xmax) xmax = x;
-      }
-      if (x0 != NULL) x0[mark - 1] = xmin;
-      if (x1 != NULL) x1[mark - 1] = xmax;
-    }
-    if (y0 != NULL || y1 != NULL) {
-      long ymin, ymax;
-      ymin = ymax = index[0]/width;
-      for (long j = 1; j < count; ++j) {
-        long y = index[j]/width;
-        if (y < ymin) ymin = y;
-        if (y > ymax) ymax = y;
-      }
-      if (y0 != NULL) y0[mark - 1] = ymin;
-      if (y1 != NULL) y1[mark - 1] = ymax;
-    }
-
-    ++mark;
-  }
-#undef LEFT
-#undef RIGHT
-#undef DOWN
-#undef UP
-#undef ALL
-
-  return mark;
-}
-#endif /* MORPH_SEGMENTATION */
+/* Decompose the structuring element E in runs (LO,HI,DY,DZ) of consecutive
+   offsets along the rows sorted by LO and HI.  RUN must have room for 4
+   values per offset (see bin_size).  Return the number of runs. */
+static long bin_runs(const morph_element_t* e, long run[])
+{
+  long nruns = 0;
+  if (e->kind == MORPH_BOX) {
+    for (long dz = e->lo[2]; dz <= e->hi[2]; ++dz) {
+      for (long dy = e->lo[1]; dy <= e->hi[1]; ++dy) {
+        long* r = run + 4*nruns++;
+        r[0] = e->lo[0];
+        r[1] = e->hi[0];
+        r[2] = dy;
+        r[3] = dz;
+      }
+    }
+  } else if (e->kind == MORPH_BALL) {
+    for (long j = 0; j < e->nchords; ++j) {
+      long* r = run + 4*nruns++;
+      r[0] = -e->chord[3*j + 2];
+      r[1] = e->chord[3*j + 2];
+      r[2] = e->chord[3*j];
+      r[3] = e->chord[3*j + 1];
+    }
+  } else {
+    /* Sort the offsets (DZ,DY,DX) and merge the consecutive ones. */
+    long number = (e->kind == MORPH_LINE ? e->hi[0] - e->lo[0] + 1 :
+                   e->number);
+    long* off = run + number; /* the runs never overwrite the next offsets */
+    for (long i = 0; i < number; ++i) {
+      long* o = off + 3*i;
+      if (e->kind == MORPH_LINE) {
+        long k = e->lo[0] + i;
+        o[0] = k*e->u[2];
+        o[1] = k*e->u[1];
+        o[2] = k*e->u[0];
+      } else {
+        o[0] = e->d[2][i];
+        o[1] = e->d[1][i];
+        o[2] = e->d[0][i];
+      }
+    }
+    qsort(off, number, 3*sizeof(long), bin_compare);
+    for (long i = 0; i < number; ++i) {
+      long dz = off[3*i], dy = off[3*i + 1], dx = off[3*i + 2];
+      long* r = run + 4*(nruns - 1);
+      if (nruns > 0 && r[3] == dz && r[2] == dy && r[1] + 1 >= dx) {
+        r[1] = dx;
+      } else {
+        r = run + 4*nruns++;
+        r[0] = r[1] = dx;
+        r[2] = dy;
+        r[3] = dz;
+      }
+    }
+  }
+  qsort(run, nruns, 4*sizeof(long), bin_compare);
+  return nruns;
+}
+
+/* Maximum number of values of the runs of the structuring element E (see
+   bin_runs). */
+static long bin_size(const morph_element_t* e)
+{
+  if (e->kind == MORPH_BOX) {
+    return 4*(e->hi[1] - e->lo[1] + 1)*(e->hi[2] - e->lo[2] + 1);
+  } else if (e->kind == MORPH_BALL) {
+    return 4*e->nchords;
+  } else if (e->kind == MORPH_LINE) {
+    return 4*(e->hi[0] - e->lo[0] + 1);
+  } else {
+    return 4*e->number;
+  }
+}
+
+/* Apply the erosion (MOP = 0), the dilation (MOP = 1) or both (MOP = 2) by
+   the structuring element E to the char array SRC whose values are 0 or 1.
+   Each row is packed in words of 64 bits, the dilation is the bitwise OR of
+   the packed rows shifted by the runs of the structuring element and the
+   erosion is the complement of the dilation of the complement.  Return
+   false (and do nothing) if this is not possible, that is if there are
+   voxels with no neighbors for the erosion.  The workspace pushed on the
+   stack is dropped before returning. */
+static int bin_apply(const morph_element_t* e, int mop, unsigned char* dst,
+                     unsigned char* dst2, const unsigned char* src,
+                     int nthreads)
+{
+  long nx = e->dim[0], ny = e->dim[1], nz = e->dim[2];
+  long nrows = ny*nz;
+  long nw = (nx + 63)/64;
+  int threads = yeti_effective_threads(nthreads, nrows);
+  long* run = yor_push_workspace(bin_size(e)*sizeof(long) +
+                                 (3*nrows + threads)*nw*sizeof(morph_bits_t));
+  long nruns = bin_runs(e, run);
+  if (mop != 1) {
+    /* For the erosion, all voxels must have at least a neighbor. */
+    int origin = 0;
+    for (long j = 0; j < nruns && ! origin; ++j) {
+      const long* r = run + 4*j;
+      origin = (r[0] <= 0 && r[1] >= 0 && r[2] == 0 && r[3] == 0);
+    }
+    if (! origin) {
+      Drop(1);
+      return 0;
+    }
+  }
+  bin_task_t t;
+  t.nx = nx;
+  t.ny = ny;
+  t.nz = nz;
+  t.nw = nw;
+  t.w = (morph_bits_t*)(run + bin_size(e));
+  t.t = t.w + nw*nrows;
+  t.r = t.t + nw*nrows;
+  t.ws = t.r + nw*nrows;
+  t.src = src;
+  for (int k = (mop == 1 ? 1 : 0); k <= (mop == 0 ? 0 : 1); ++k) {
+    t.invert = (k == 0);
+    t.dst = (k == 0 || mop == 1 ? dst : dst2);
+    t.phase = BIN_PACK;
+    yeti_run_tasks(bin_task, &t, nrows, threads);
+    for (long j = 0; j < nruns; ) {
+      /* Process the group of runs with the same bounds. */
+      long n = 1;
+      while (j + n < nruns && run[4*(j + n)] == run[4*j] &&
+             run[4*(j + n) + 1] == run[4*j + 1]) ++n;
+      t.lo = run[4*j];
+      t.hi = run[4*j + 1];
+      t.run = run + 4*j;
+      t.nruns = n;
+      t.phase = BIN_WINDOW;
+      yeti_run_tasks(bin_task, &t, nrows, threads);
+      t.phase = BIN_OR;
+      yeti_run_tasks(bin_task, &t, nrows, threads);
+      j += n;
+    }
+    t.phase = BIN_UNPACK;
+    yeti_run_tasks(bin_task, &t, nrows, threads);
+  }
+  Drop(1);
+  return 1;
+}
+
+/* Shift the row SRC of NW words by S bits (bit X of the result is bit X + S
+   of SRC, bits out of the row are zero) and store the result in DST or
+   combine it by a bitwise OR in DST if ACC is true.  DST and SRC may be the
+   same. */
+static void bin_shift(morph_bits_t dst[], const morph_bits_t src[], long nw,
+                      long s, int acc)
+{
+  if (s >= 0) {
+    long q = s/64;
+    int b = s%64;
+    for (long i = 0; i < nw; ++i) {
+      morph_bits_t v = 0;
+      if (i + q < nw) v = src[i + q] >> b;
+      if (b > 0 && i + q + 1 < nw) v |= src[i + q + 1] << (64 - b);
+      dst[i] = (acc ? dst[i] | v : v);
+    }
+  } else {
+    long q = (-s)/64;
+    int b = (-s)%64;
+    for (long i = nw - 1; i >= 0; --i) {
+      morph_bits_t v = 0;
+      if (i - q >= 0) v = src[i - q] << b;
+      if (b > 0 && i - q - 1 >= 0) v |= src[i - q - 1] >> (64 - b);
+      dst[i] = (acc ? dst[i] | v : v);
+    }
+  }
+}
+
+/* Replace, in-place, bit X of the row U of NW words by the OR of the bits X
+   to X + N - 1 (N > 0) or X + N + 1 to X (N < 0) by doubling the width of
+   the window. */
+static void bin_window(morph_bits_t u[], long nw, long n)
+{
+  long width = (n >= 0 ? n : -n);
+  long dir = (n >= 0 ? 1 : -1);
+  long span = 1;
+  while (2*span <= width) {
+    bin_shift(u, u, nw, dir*span, 1);
+    span *= 2;
+  }
+  if (width > span) bin_shift(u, u, nw, dir*(width - span), 1);
+}
+
+/* Apply a phase of the binary morphology to the rows [FIRST,LAST). */
+static void bin_task(void* data, long first, long last, int rank)
+{
+  const bin_task_t* t = data;
+  long nx = t->nx, ny = t->ny, nz = t->nz, nw = t->nw;
+  morph_bits_t last_mask = (nx%64 == 0 ? ~(morph_bits_t)0 :
+                            ((morph_bits_t)1 << (nx%64)) - 1);
+  for (long row = first; row < last; ++row) {
+    morph_bits_t* w = t->w + row*nw;
+    morph_bits_t* u = t->t + row*nw;
+    morph_bits_t* r = t->r + row*nw;
+    if (t->phase == BIN_PACK) {
+      const unsigned char* p = t->src + row*nx;
+      morph_bits_t flip = (t->invert ? 1 : 0);
+      for (long i = 0; i < nw; ++i) {
+        long n = (nx - 64*i < 64 ? nx - 64*i : 64);
+        morph_bits_t v = 0;
+        for (long k = 0; k < n; ++k) {
+          v |= ((morph_bits_t)p[k] ^ flip) << k;
+        }
+        w[i] = v;
+        r[i] = 0;
+        p += 64;
+      }
+    } else if (t->phase == BIN_WINDOW) {
+      /* Bit X of U is the OR of the bits X + LO to X + HI of W if LO <= 0
+         <= HI, X to X + HI - LO if LO > 0, or X + LO - HI to X if HI < 0.
+         The windows are computed by doubling their widths forward (from X)
+         and backward (to X), the bits out of the row are never needed. */
+      long fwd, bwd;
+      if (t->lo > 0) {
+        fwd = t->hi - t->lo + 1;
+        bwd = 1;
+      } else if (t->hi < 0) {
+        fwd = 1;
+        bwd = t->hi - t->lo + 1;
+      } else {
+        fwd = t->hi + 1;
+        bwd = 1 - t->lo;
+      }
+      morph_bits_t* v = t->ws + rank*nw;
+      bin_shift(u, w, nw, 0, 0);
+      bin_window(u, nw, fwd);
+      if (bwd > 1) {
+        bin_shift(v, w, nw, 0, 0);
+        bin_window(v, nw, -bwd);
+        v[nw - 1] &= last_mask;
+        for (long i = 0; i < nw; ++i) {
+          u[i] |= v[i];
+        }
+      }
+    } else if (t->phase == BIN_OR) {
+      /* Combine the windows shifted by LO (if LO > 0) or by HI (if HI < 0)
+         and clear the bits beyond the end of the row. */
+      long shift = (t->lo > 0 ? t->lo : (t->hi < 0 ? t->hi : 0));
+      long y = row%ny, z = row/ny;
+      for (long j = 0; j < t->nruns; ++j) {
+        long ys = y + t->run[4*j + 2];
+        long zs = z + t->run[4*j + 3];
+        if (ys < 0 || ys >= ny || zs < 0 || zs >= nz) continue;
+        bin_shift(r, t->t + (ys + ny*zs)*nw, nw, shift, 1);
+      }
+      r[nw - 1] &= last_mask;
+    } else {
+      unsigned char* p = t->dst + row*nx;
+      morph_bits_t flip = (t->invert ? 1 : 0);
+      for (long i = 0; i < nw; ++i) {
+        long n = (nx - 64*i < 64 ? nx - 64*i : 64);
+        morph_bits_t v = r[i];
+        for (long k = 0; k < n; ++k) {
+          p[k] = ((v >> k) & 1) ^ flip;
+        }
+        p += 64;
+      }
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* GRAYSCALE RECONSTRUCTION */
 
+void Y_morph_reconstruct(int argc)
+{
+  reconstruct(argc, 0);
+}
+
+void Y_morph_hmax(int argc)
+{
+  reconstruct(argc, 1);
+}
+
+void Y_morph_regional_max(int argc)
+{
+  reconstruct(argc, 2);
+}
+
+void Y_morph_fill_holes(int argc)
+{
+  reconstruct(argc, 3);
+}
+
+/* Reconstruction of a marker by dilation (or by erosion if keyword DUAL is
+   true) under a mask (MODE = 0), h-maxima (MODE = 1), regional maxima
+   (MODE = 2) or filling of holes (MODE = 3). */
+static void reconstruct(int argc, int mode)
+{
+  static const char* usage[] = {"usage: morph_reconstruct(marker, mask)",
+                                "usage: morph_hmax(a, h)",
+                                "usage: morph_regional_max(a)",
+                                "usage: morph_fill_holes(a)"};
+  int nargs = (mode <= 1 ? 2 : 1);
+  Symbol* iarg[2] = {NULL, NULL};
+  int nparsed = 0;
+  long connectivity = 0;
+  int dual = (mode == 3);
+  for (Symbol* stack = sp - argc + 1; stack <= sp; ++stack) {
+    if (stack->ops != NULL) {
+      /* Positional argument. */
+      if (nparsed >= nargs) yor_error(usage[mode]);
+      iarg[nparsed++] = stack;
+    } else {
+      /* Keyword argument. */
+      const char* keyword = globalTable.names[stack->index];
+      ++stack;
+      if (keyword[0] == 'c' && strcmp(keyword, "connectivity") == 0) {
+        if (YNotNil(stack)) connectivity = yor_get_integer(stack);
+      } else if (mode == 0 && keyword[0] == 'd' &&
+                 strcmp(keyword, "dual") == 0) {
+        dual = (YNotNil(stack) && yor_get_integer(stack) != 0);
+      } else {
+        yor_error("unknown keyword");
+      }
+    }
+  }
+  if (nparsed < nargs) yor_error(usage[mode]);
+  CheckStack(4);
+
+  /* Get the input array(s).  The marker and the mask are converted to their
+     promoted type. */
+  Operand op, mop;
+  morph_array(iarg[0], &op);
+  double h = 0.0;
+  if (mode == 0) {
+    morph_array(iarg[1], &mop);
+    Dimension* d1 = op.type.dims;
+    Dimension* d2 = mop.type.dims;
+    while (d1 != NULL && d2 != NULL && d1->number == d2->number) {
+      d1 = d1->next;
+      d2 = d2->next;
+    }
+    if (d1 != NULL || d2 != NULL) {
+      yor_error("marker and mask must have the same dimensions");
+    }
+    int type = op.ops->typeID;
+    if (mop.ops->typeID > type) type = mop.ops->typeID;
+    for (int k = 0; k < 2; ++k) {
+      Operand* o = (k == 0 ? &op : &mop);
+      if (o->ops->typeID == type) continue;
+      switch (type) {
+      case YOR_SHORT:  o->ops->ToShort(o);  break;
+      case YOR_INT:    o->ops->ToInt(o);    break;
+      case YOR_LONG:   o->ops->ToLong(o);   break;
+      case YOR_FLOAT:  o->ops->ToFloat(o);  break;
+      case YOR_DOUBLE: o->ops->ToDouble(o); break;
+      }
+    }
+  } else if (mode == 1) {
+    h = yor_get_real(iarg[1]);
+    if (! (h >= 0.0)) yor_error("H must be non-negative");
+  }
+  long dim[3];
+  int ndims = morph_dims(&op, dim);
+  long nbr[4*13];
+  int nnbr = morph_neighbors(nbr, ndims, dim, connectivity);
+
+  /* Compute the marker in the result (in a workspace for the regional
+     maxima) and apply the reconstruction. */
+  int type = op.ops->typeID;
+  size_t size = op.type.base->size;
+  long ntot = op.type.number;
+  long* fifo = yor_push_workspace(ntot*sizeof(long));
+  unsigned char* inq = yor_push_workspace(ntot);
+  memset(inq, 0, ntot);
+  char* mark;
+  Array* ap;
+  if (mode == 2) {
+    mark = yor_push_workspace(ntot*size);
+    ap = (Array*)PushDataBlock(NewArray(&intStruct, op.type.dims));
+  } else {
+    ap = (Array*)PushDataBlock(NewArray(op.type.base, op.type.dims));
+    mark = ap->value.c;
+  }
+  const void* mask = (mode == 0 ? mop.value : op.value);
+  if (mode == 0) memcpy(mark, op.value, ntot*size);
+  switch (type) {
 #undef _
-#define _(CMP) (voxel_t dst[], const voxel_t src[],			\
-                long width, long height, long depth,			\
-                const long dx[], const long dy[], const long dz[],	\
-                long number)						\
+#define _(T, id)                                                        \
+    if (mode != 0) {                                                    \
+      marker_##id((T*)mark, (const T*)op.value, dim, mode, h);          \
+    }                                                                   \
+    if (dual) {                                                         \
+      recon_min_##id((T*)mark, (const T*)mask, dim, nbr, nnbr,          \
+                     fifo, inq);                                        \
+    } else {                                                            \
+      recon_max_##id((T*)mark, (const T*)mask, dim, nbr, nnbr,          \
+                     fifo, inq);                                        \
+    }                                                                   \
+    if (mode == 2) {                                                    \
+      regmax_##id(ap->value.i, (const T*)op.value, (const T*)mark,      \
+                  ntot);                                                \
+    }                                                                   \
+    break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
+#undef _
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* EUCLIDEAN DISTANCE TRANSFORM */
+
+/* Arguments of a pass of the distance transform run by yeti_run_tasks. */
+typedef struct _edt_task edt_task_t;
+struct _edt_task {
+  double* d;           /* squared distances (distances after last pass) */
+  long* idx;           /* indices of the nearest features or NULL */
+  const long* dim;     /* dimensions of the array */
+  int axis;            /* dimension of the pass */
+  int last;            /* last pass? */
+  double s2;           /* squared voxel size along the axis */
+  char* ws;            /* workspaces of the threads */
+  size_t wsize;        /* size of the workspace of each thread (bytes) */
+};
+
+void Y_morph_distance(int argc)
+{
+  /* Parse the arguments. */
+  const char* usage = "usage: morph_distance(a, idx)";
+  Symbol* iarg[2] = {NULL, NULL};
+  Symbol* scale = NULL;
+  int nparsed = 0;
+  long nthreads = 1;
+  for (Symbol* stack = sp - argc + 1; stack <= sp; ++stack) {
+    if (stack->ops != NULL) {
+      /* Positional argument. */
+      if (nparsed >= 2) yor_error(usage);
+      iarg[nparsed++] = stack;
+    } else {
+      /* Keyword argument. */
+      const char* keyword = globalTable.names[stack->index];
+      ++stack;
+      if (keyword[0] == 's' && strcmp(keyword, "scale") == 0) {
+        if (YNotNil(stack)) scale = stack;
+      } else if (keyword[0] == 'n' && strcmp(keyword, "nthreads") == 0) {
+        if (YNotNil(stack)) nthreads = yor_get_integer(stack);
+      } else {
+        yor_error("unknown keyword");
+      }
+    }
+  }
+  if (nparsed < 1) yor_error(usage);
+  long index = -1L;
+  if (iarg[1] != NULL) {
+    if (iarg[1]->ops != &referenceSym) {
+      yor_error("needs simple variable reference to store the indices");
+    }
+    index = iarg[1]->index;
+  }
+  CheckStack(4);
+
+  /* Get the input array and the size of the voxels. */
+  Operand op;
+  morph_array(iarg[0], &op);
+  long dim[3];
+  int ndims = morph_dims(&op, dim);
+  double s2[3] = {1.0, 1.0, 1.0};
+  if (scale != NULL) {
+    Operand sop;
+    scale->ops->FormOperand(scale, &sop);
+    long number = sop.type.number;
+    if (! sop.ops->isArray || (number != 1 && number != ndims) ||
+        sop.ops->typeID < YOR_CHAR || sop.ops->typeID > YOR_DOUBLE) {
+      yor_error("SCALE must be a scalar or a vector of NDIMS reals");
+    }
+    if (sop.ops->typeID != YOR_DOUBLE) sop.ops->ToDouble(&sop);
+    const double* val = sop.value;
+    for (int j = 0; j < ndims; ++j) {
+      double t = val[number == 1 ? 0 : j];
+      if (! (t > 0.0)) yor_error("voxel sizes must be strictly positive");
+      s2[j] = t*t;
+    }
+  }
+
+  /* Allocate the result, the indices and the workspaces. */
+  long ntot = op.type.number;
+  long maxlen = dim[0];
+  if (dim[1] > maxlen) maxlen = dim[1];
+  if (dim[2] > maxlen) maxlen = dim[2];
+  edt_task_t t;
+  t.dim = dim;
+  t.wsize = (2*maxlen + 1)*sizeof(double) + 2*maxlen*sizeof(long);
+  int threads = yeti_effective_threads(nthreads, ntot/maxlen);
+  t.ws = yor_push_workspace(threads*t.wsize);
+  t.idx = NULL;
+  if (index >= 0) {
+    t.idx = yor_push_workspace(ntot*sizeof(long));
+  }
+  Array* ap = (Array*)PushDataBlock(NewArray(&doubleStruct, op.type.dims));
+  t.d = ap->value.d;
+  switch (op.ops->typeID) {
+#undef _
+#define _(T, id) edt_init_##id(t.d, t.idx, (const T*)op.value, ntot); break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
+#undef _
+  }
+
+  /* Apply the separable transform along every dimension, the lines of a
+     pass are distributed among the threads. */
+  for (int j = 0; j < ndims; ++j) {
+    t.axis = j;
+    t.last = (j == ndims - 1);
+    t.s2 = s2[j];
+    yeti_run_tasks(edt_task, &t, ntot/dim[j], threads);
+  }
+
+  /* Store the 1-based indices of the nearest features (0 if none). */
+  if (index >= 0) {
+    long* out = ((Array*)PushDataBlock(NewArray(&longStruct,
+                                                op.type.dims)))->value.l;
+    for (long i = 0; i < ntot; ++i) {
+      out[i] = t.idx[i] + 1;
+    }
+    PopTo(&globTab[index]);
+  }
+}
+
+/* Apply the 1-D squared distance transform of P. Felzenszwalb & D.
+   Huttenlocher ("Distance Transforms of Sampled Functions", Theory of
+   Computing, vol. 8, pp. 415-428, 2012) to the lines [FIRST,LAST) along the
+   axis of the pass.  The lower envelope of the parabolas rooted at the
+   voxels with a finite squared distance is computed and sampled in a
+   single sweep. */
+static void edt_task(void* data, long first, long last, int rank)
+{
+  edt_task_t* t = (edt_task_t*)data;
+  const long* dim = t->dim;
+  long n = dim[t->axis];
+  long stride = (t->axis >= 1 ? dim[0] : 1)*(t->axis >= 2 ? dim[1] : 1);
+  double s2 = t->s2;
+  double* f = (double*)(t->ws + rank*t->wsize); /* N values */
+  double* z = f + n;                            /* N + 1 values */
+  long* v = (long*)(z + n + 1);                 /* N values */
+  long* fi = v + n;                             /* N values */
+  for (long line = first; line < last; ++line) {
+    long base = (line%stride) + (line/stride)*stride*n;
+    double* d = t->d + base;
+    long* idx = (t->idx != NULL ? t->idx + base : NULL);
+    for (long q = 0; q < n; ++q) {
+      f[q] = d[q*stride];
+    }
+    if (idx != NULL) {
+      for (long q = 0; q < n; ++q) {
+        fi[q] = idx[q*stride];
+      }
+    }
+
+    /* Lower envelope: V[0..K] are the roots of the parabolas and
+       Z[0..K+1] the boundaries of the intervals where they are minimal. */
+    long k = -1;
+    for (long q = 0; q < n; ++q) {
+      if (f[q] == HUGE_VAL) continue;
+      double fq = f[q] + s2*(double)q*(double)q;
+      double s = -HUGE_VAL;
+      while (k >= 0) {
+        long r = v[k];
+        s = (fq - (f[r] + s2*(double)r*(double)r))/(2.0*s2*(double)(q - r));
+        if (s > z[k]) break;
+        s = -HUGE_VAL;
+        --k;
+      }
+      ++k;
+      v[k] = q;
+      z[k] = s;
+      z[k + 1] = HUGE_VAL;
+    }
+    if (k < 0) {
+      /* No features in this line, the distances remain infinite. */
+      continue;
+    }
+
+    /* Sample the lower envelope. */
+    k = 0;
+    for (long q = 0; q < n; ++q) {
+      while (z[k + 1] < (double)q) ++k;
+      long r = v[k];
+      double e = s2*(double)(q - r)*(double)(q - r) + f[r];
+      d[q*stride] = (t->last ? sqrt(e) : e);
+      if (idx != NULL) idx[q*stride] = fi[r];
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* CONNECTED REGION LABELING */
+
+/* Arguments of the first pass of the labeling run by yeti_run_tasks.  The
+   rows of the array are split in NTILES slabs of contiguous rows. */
+typedef struct _label_task label_task_t;
+struct _label_task {
+  int type;            /* type of the voxels */
+  long* lab;           /* array of parents */
+  const void* img;     /* input array */
+  const long* dim;     /* dimensions of the array */
+  const long* nbr;     /* neighbors (DX,DY,DZ,OFF) */
+  int nnbr;            /* number of neighbors */
+  long nrows;          /* number of rows */
+  long ntiles;         /* number of slabs */
+};
+
+void Y_morph_segmentation(int argc)
+{
+  /* Parse the arguments. */
+  const char* usage = "usage: morph_segmentation(img, stats)";
+  Symbol* iarg[2] = {NULL, NULL};
+  int nparsed = 0;
+  long connectivity = 0;
+  long nthreads = 1;
+  for (Symbol* stack = sp - argc + 1; stack <= sp; ++stack) {
+    if (stack->ops != NULL) {
+      /* Positional argument. */
+      if (nparsed >= 2) yor_error(usage);
+      iarg[nparsed++] = stack;
+    } else {
+      /* Keyword argument. */
+      const char* keyword = globalTable.names[stack->index];
+      ++stack;
+      if (keyword[0] == 'c' && strcmp(keyword, "connectivity") == 0) {
+        if (YNotNil(stack)) connectivity = yor_get_integer(stack);
+      } else if (keyword[0] == 'n' && strcmp(keyword, "nthreads") == 0) {
+        if (YNotNil(stack)) nthreads = yor_get_integer(stack);
+      } else {
+        yor_error("unknown keyword");
+      }
+    }
+  }
+  if (nparsed < 1) yor_error(usage);
+  long index = -1L;
+  if (iarg[1] != NULL) {
+    if (iarg[1]->ops != &referenceSym) {
+      yor_error("needs simple variable reference to store the statistics");
+    }
+    index = iarg[1]->index;
+  }
+  CheckStack(2);
+
+  /* Get the input array, its dimensions and the neighbors of a voxel. */
+  Operand op;
+  morph_array(iarg[0], &op);
+  long dim[3];
+  int ndims = morph_dims(&op, dim);
+  long nbr[4*13];
+  int nnbr = morph_neighbors(nbr, ndims, dim, connectivity);
+
+  /* First pass in parallel on slabs of rows, then merge the regions across
+     the seams between the slabs.  A row is only connected to the DIM[1] + 1
+     rows preceding it. */
+  long ntot = op.type.number;
+  long nrows = dim[1]*dim[2];
+  Array* ap = (Array*)PushDataBlock(NewArray(&longStruct, op.type.dims));
+  long* lab = ap->value.l;
+  label_task_t t;
+  t.type = op.ops->typeID;
+  t.lab = lab;
+  t.img = op.value;
+  t.dim = dim;
+  t.nbr = nbr;
+  t.nnbr = nnbr;
+  t.nrows = nrows;
+  t.ntiles = yeti_effective_threads(nthreads, nrows);
+  yeti_run_tasks(label_task, &t, t.ntiles, t.ntiles);
+  for (long k = 1; k < t.ntiles; ++k) {
+    long first = (nrows*k)/t.ntiles;
+    long last = (nrows*(k + 1))/t.ntiles;
+    if (last > first + dim[1] + 1) last = first + dim[1] + 1;
+    label_apply(t.type, lab, op.value, dim, nbr, nnbr,
+                first, last, 0, first, 0);
+  }
+
+  /* Second pass: replace the parents by the region numbers (the parent of a
+     voxel has a smaller index and has already been relabeled) and collect
+     the statistics of the regions.  The first voxel of a region has the
+     smallest Z. */
+  if (index < 0) {
+    long n = 0;
+    for (long i = 0; i < ntot; ++i) {
+      long p = lab[i];
+      lab[i] = (p == i ? ++n : lab[p]);
+    }
+  } else {
+    long nregions = 0;
+    for (long i = 0; i < ntot; ++i) {
+      if (lab[i] == i) ++nregions;
+    }
+    long nstats = 1 + 2*ndims;
+    long number[2] = {nstats, nregions};
+    long* stats = ((Array*)PushDataBlock(
+                     NewArray(&longStruct,
+                              yor_make_dims(number, NULL, 2))))->value.l;
+    long n = 0;
+    long i = 0;
+    for (long z = 1; z <= dim[2]; ++z) {
+      for (long y = 1; y <= dim[1]; ++y) {
+        for (long x = 1; x <= dim[0]; ++x, ++i) {
+          long p = lab[i];
+          long* r;
+          if (p == i) {
+            lab[i] = ++n;
+            r = stats + (n - 1)*nstats;
+            r[0] = 0;
+            r[1] = r[2] = x;
+            if (ndims >= 2) r[3] = r[4] = y;
+            if (ndims >= 3) r[5] = r[6] = z;
+          } else {
+            lab[i] = lab[p];
+            r = stats + (lab[i] - 1)*nstats;
+            if (x < r[1]) r[1] = x;
+            if (x > r[2]) r[2] = x;
+            if (ndims >= 2) {
+              if (y < r[3]) r[3] = y;
+              if (y > r[4]) r[4] = y;
+              if (ndims >= 3 && z > r[6]) r[6] = z;
+            }
+          }
+          ++r[0];
+        }
+      }
+    }
+    PopTo(&globTab[index]);
+  }
+}
+
+/* Get the dimensions DIM[0..2] of the array OP (trailing dimensions are
+   set to 1) and return its number of dimensions (at least 1). */
+static int morph_dims(const Operand* op, long dim[])
+{
+  int ndims = 0;
+  dim[0] = dim[1] = dim[2] = 1;
+  for (Dimension* dims = op->type.dims; dims != NULL; dims = dims->next) {
+    if (++ndims > 3) yor_error("too many dimensions for input array");
+    dim[2] = dim[1];
+    dim[1] = dim[0];
+    dim[0] = dims->number;
+  }
+  if (ndims == 0) ndims = 1;
+  for (int j = ndims; j < 3; ++j) dim[j] = 1;
+  return ndims;
+}
+
+/* Store in NBR[4*j..4*j+3] = (DX,DY,DZ,OFF) the neighbors preceding a voxel
+   in storage order for the given CONNECTIVITY and return their number.
+   The maximum number of non-zero offsets of a neighbor is 1 for the face
+   connectivity (the default), 2 for the edge connectivity and 3 for the
+   vertex connectivity.  The neighbor at DX = -1 comes first. */
+static int morph_neighbors(long nbr[], int ndims, const long dim[],
+                           long connectivity)
+{
+  int maxnz;
+  if (connectivity == 0 || connectivity == 2*ndims) {
+    maxnz = 1;
+  } else if ((ndims == 2 && connectivity == 8) ||
+             (ndims == 3 && connectivity == 18)) {
+    maxnz = 2;
+  } else if (ndims == 3 && connectivity == 26) {
+    maxnz = 3;
+  } else {
+    yor_error("invalid connectivity");
+    return 0;
+  }
+  int nnbr = 0;
+  for (long dz = 0; dz >= (ndims >= 3 ? -1 : 0); --dz) {
+    for (long dy = (ndims >= 2 ? 1 : 0); dy >= (ndims >= 2 ? -1 : 0); --dy) {
+      for (long dx = -1; dx <= 1; ++dx) {
+        long off = dx + dim[0]*(dy + dim[1]*dz);
+        int nz = (dx != 0) + (dy != 0) + (dz != 0);
+        if (off < 0 && nz <= maxnz) {
+          nbr[4*nnbr + 0] = dx;
+          nbr[4*nnbr + 1] = dy;
+          nbr[4*nnbr + 2] = dz;
+          nbr[4*nnbr + 3] = off;
+          ++nnbr;
+        }
+      }
+    }
+  }
+  return nnbr;
+}
+
+/* Apply the first pass of the labeling to the slabs [FIRST,LAST). */
+static void label_task(void* data, long first, long last, int rank)
+{
+  label_task_t* t = (label_task_t*)data;
+  for (long k = first; k < last; ++k) {
+    long r0 = (t->nrows*k)/t->ntiles;
+    long r1 = (t->nrows*(k + 1))/t->ntiles;
+    label_apply(t->type, t->lab, t->img, t->dim, t->nbr, t->nnbr,
+                r0, r1, r0, r1, 1);
+  }
+}
+
+static void label_apply(int type, long lab[], const void* img,
+                        const long dim[], const long nbr[], int nnbr,
+                        long first, long last, long rmin, long rmax,
+                        int init)
+{
+  switch (type) {
+#undef _
+#define _(T, id) label_##id(lab, (const T*)img, dim, nbr, nnbr, first, last, \
+                            rmin, rmax, init); break
+  case YOR_CHAR:   _(unsigned char, c);
+  case YOR_SHORT:  _(short, s);
+  case YOR_INT:    _(int, i);
+  case YOR_LONG:   _(long, l);
+  case YOR_FLOAT:  _(float, f);
+  case YOR_DOUBLE: _(double, d);
+#undef _
+  }
+}
+
+static long label_find(long lab[], long i)
+{
+  /* Find the root with path halving. */
+  while (lab[i] != i) {
+    lab[i] = lab[lab[i]];
+    i = lab[i];
+  }
+  return i;
+}
+
+static void label_union(long lab[], long i, long j)
+{
+  /* The root of the merged region is the one with the smallest index. */
+  i = label_find(lab, i);
+  j = label_find(lab, j);
+  if (i < j) {
+    lab[j] = i;
+  } else if (j < i) {
+    lab[i] = j;
+  }
+}
+
+#else /* _YETI_MORPH_C ------------------------------------------------------*/
+
+/*
+ * Dilation (MORPH_DILATION) or erosion (MORPH_EROSION) by an arbitrary
+ * structuring element made of NUMBER offsets (D[0][i],...,D[RANK-1][i])
+ * whose linear offsets in the array of dimensions DIM[0..RANK-1] are OFF.
+ * The voxels are split in an interior region (the box [INNER[0],INNER[1])
+ * x [INNER[2],INNER[3]) x ... where all offsets are known to be in bounds)
+ * and a border shell.  In the interior, the loop is offset-major over
+ * contiguous runs of the rows with no bounds checking so that the compiler
+ * can vectorize it.  In the border shell, every offset is checked (OK is a
+ * workspace of NUMBER bytes to store which offsets stay in bounds along the
+ * dimensions other than the first one) and voxels with no neighbors inside
+ * the array are set to zero.  Only the voxels X in [XBEG,XEND) of the rows
+ * of index Y + DIM[1]*(Z + DIM[2]*...) in the range [FIRST,LAST) are
+ * computed.
+ */
+#undef _
+#define _(CMP) (voxel_t dst[], const voxel_t src[], int rank,		\
+                const long dim[], const long* const d[],		\
+                const long off[], long number, const long inner[],	\
+                long first, long last, long xbeg, long xend,		\
+                unsigned char ok[])					\
 {									\
-  long i, x, y, z, xp, yp, zp;						\
-  voxel_t val, tmp;							\
-                                                                        \
-  val = 0; /* avoids compiler warnings */				\
-  if (depth > 1) {							\
-    /* 3-D case. */							\
-    for (z=0 ; z<depth ; ++z) {						\
-      for (y=0 ; y<height ; ++y) {					\
-        for (x=0 ; x<width ; ++x) {					\
-          int any = 0;							\
-          for (i = 0 ; i < number ; ++i) {				\
-            xp = x + dx[i];						\
-            yp = y + dy[i];						\
-            zp = z + dz[i];						\
-            if (xp >= 0 && xp < width &&				\
-                yp >= 0 && yp < height &&				\
-                zp >= 0 && zp < depth) {				\
-              if (any) {						\
-                if ((tmp = src[(zp*height + yp)*width + xp]) CMP val) {	\
-                  val = tmp;						\
-                }							\
-              } else {							\
-                val = src[(zp*height + yp)*width + xp];			\
-                any = 1;						\
-              }								\
-            }								\
-          }								\
-          if (any) {							\
-            dst[(z*height + y)*width + x] = val;			\
-          }								\
+  long nx = dim[0];							\
+  long pos[MORPH_MAX_RANK]; /* coordinates of the row */		\
+  for (long row = first; row < last; ++row) {				\
+    int interior = 1;							\
+    for (long j = 1, k = row; j < rank; ++j) {				\
+      pos[j] = k%dim[j];						\
+      k /= dim[j];							\
+      interior &= (pos[j] >= inner[2*j] && pos[j] < inner[2*j + 1]);	\
+    }									\
+    voxel_t* out = dst + row*nx;					\
+    const voxel_t* inp = src + row*nx;					\
+    long xa = xend, xb = xend; /* interior run [XA,XB) */		\
+    if (interior) {							\
+      xa = (inner[0] > xbeg ? inner[0] : xbeg);				\
+      xb = (inner[1] < xend ? inner[1] : xend);				\
+      if (xa >= xb) xa = xb = xend;					\
+    }									\
+    if (xa < xb) {							\
+      long n = xb - xa;							\
+      voxel_t* q = out + xa;						\
+      const voxel_t* p = inp + (off[0] + xa);				\
+      for (long k = 0; k < n; ++k) q[k] = p[k];				\
+      for (long i = 1; i < number; ++i) {				\
+        p = inp + (off[i] + xa);					\
+        for (long k = 0; k < n; ++k) {					\
+          voxel_t v = p[k];						\
+          q[k] = (v CMP q[k] ? v : q[k]);				\
         }								\
       }									\
     }									\
-  } else if (height > 1) {						\
-    /* 2-D case. */							\
-    for (y=0 ; y<height ; ++y) {					\
-      for (x=0 ; x<width ; ++x) {					\
-        int any = 0;							\
-        for (i = 0 ; i < number ; ++i) {				\
-          xp = x + dx[i];						\
-          yp = y + dy[i];						\
-          if (xp >= 0 && xp < width &&					\
-              yp >= 0 && yp < height) {					\
-            if (any) {							\
-              if ((tmp = src[yp*width + xp]) CMP val) {			\
-                val = tmp;						\
-              }								\
-            } else {							\
-              val = src[yp*width + xp];					\
-              any = 1;							\
-            }								\
-          }								\
-        }								\
-        if (any) {							\
-          dst[y*width + x] = val;					\
-        }								\
+    if (xa == xbeg && xb == xend) continue;				\
+    for (long i = 0; i < number; ++i) {					\
+      int in = 1;							\
+      for (long j = 1; j < rank && in; ++j) {				\
+        long p = pos[j] + d[j][i];					\
+        in = (p >= 0 && p < dim[j]);					\
       }									\
+      ok[i] = in;							\
     }									\
-  } else {								\
-    /* 1-D case. */							\
-    for (x=0 ; x<width ; ++x) {						\
+    for (long x = xbeg; x < xend; ++x) {				\
+      if (x == xa) {							\
+        x = xb - 1;							\
+        continue;							\
+      }									\
       int any = 0;							\
-      for (i=0 ; i<number ; ++i) {					\
-        xp = x + dx[i];							\
-        if (xp >= 0 && xp < width) {					\
-          if (any) {							\
-            if ((tmp = src[xp]) CMP val) {				\
-              val = tmp;						\
-            }								\
-          } else {							\
-            val = src[xp];						\
+      voxel_t val = 0;							\
+      for (long i = 0; i < number; ++i) {				\
+        long xp = x + d[0][i];						\
+        if (xp >= 0 && xp < nx && ok[i]) {				\
+          voxel_t v = inp[off[i] + x];					\
+          if (! any) {							\
+            val = v;							\
             any = 1;							\
+          } else if (v CMP val) {					\
+            val = v;							\
           }								\
         }								\
       }									\
-      if (any) {							\
-        dst[x] = val;							\
-      }									\
+      out[x] = (any ? val : 0);						\
     }									\
   }									\
 }
@@ -403,9 +2014,638 @@ static void MORPH_EROSION _(<)
 #endif /* MORPH_EROSION */
 #undef _
 
-#undef MORPH_SEGMENTATION
+/*
+ * Local minimum (DST1) and maximum (DST2) by an arbitrary structuring
+ * element in a single sweep.  The arguments are the same as for
+ * MORPH_DILATION and MORPH_EROSION.
+ */
+#ifdef MORPH_MINMAX
+static void
+MORPH_MINMAX(voxel_t dst1[], voxel_t dst2[], const voxel_t src[],
+             int rank, const long dim[], const long* const d[],
+             const long off[], long number, const long inner[],
+             long first, long last, long xbeg, long xend, unsigned char ok[])
+{
+  long nx = dim[0];
+  long pos[MORPH_MAX_RANK]; /* coordinates of the row */
+  for (long row = first; row < last; ++row) {
+    int interior = 1;
+    for (long j = 1, k = row; j < rank; ++j) {
+      pos[j] = k%dim[j];
+      k /= dim[j];
+      interior &= (pos[j] >= inner[2*j] && pos[j] < inner[2*j + 1]);
+    }
+    voxel_t* out1 = dst1 + row*nx;
+    voxel_t* out2 = dst2 + row*nx;
+    const voxel_t* inp = src + row*nx;
+    long xa = xend, xb = xend; /* interior run [XA,XB) */
+    if (interior) {
+      xa = (inner[0] > xbeg ? inner[0] : xbeg);
+      xb = (inner[1] < xend ? inner[1] : xend);
+      if (xa >= xb) xa = xb = xend;
+    }
+    if (xa < xb) {
+      long n = xb - xa;
+      voxel_t* q1 = out1 + xa;
+      voxel_t* q2 = out2 + xa;
+      const voxel_t* p = inp + (off[0] + xa);
+      for (long k = 0; k < n; ++k) q1[k] = q2[k] = p[k];
+      for (long i = 1; i < number; ++i) {
+        p = inp + (off[i] + xa);
+        for (long k = 0; k < n; ++k) {
+          voxel_t v = p[k];
+          q1[k] = (v < q1[k] ? v : q1[k]);
+          q2[k] = (v > q2[k] ? v : q2[k]);
+        }
+      }
+    }
+    if (xa == xbeg && xb == xend) continue;
+    for (long i = 0; i < number; ++i) {
+      int in = 1;
+      for (long j = 1; j < rank && in; ++j) {
+        long p = pos[j] + d[j][i];
+        in = (p >= 0 && p < dim[j]);
+      }
+      ok[i] = in;
+    }
+    for (long x = xbeg; x < xend; ++x) {
+      if (x == xa) {
+        x = xb - 1;
+        continue;
+      }
+      int any = 0;
+      voxel_t vmin = 0, vmax = 0;
+      for (long i = 0; i < number; ++i) {
+        long xp = x + d[0][i];
+        if (xp >= 0 && xp < nx && ok[i]) {
+          voxel_t v = inp[off[i] + x];
+          if (! any) {
+            vmin = vmax = v;
+            any = 1;
+          } else if (v < vmin) {
+            vmin = v;
+          } else if (v > vmax) {
+            vmax = v;
+          }
+        }
+      }
+      out1[x] = vmin;
+      out2[x] = vmax;
+    }
+  }
+}
+#endif /* MORPH_MINMAX */
+
+/*
+ * Van Herk/Gil-Werman algorithm.  The output of the filter is:
+ *
+ *     y[i] = max { x[i+k] for lo <= k <= hi and 0 <= i+k < n }
+ *
+ * for the dilation (min for the erosion).  The line X is copied in a buffer B
+ * padded by the neutral element PAD, so that y[i] is the extremum of B over
+ * the window [i, i+w-1] with w = hi - lo + 1.  B is divided in blocks of w
+ * elements, G is the running extremum from the start of each block and H the
+ * running extremum from the end of each block, hence y[i] = max(H[i],
+ * G[i+w-1]) since the window spans at most two blocks.  This costs about 3
+ * comparisons per element whatever the length of the segment.
+ *
+ * MORPH_VHGW_MAX and MORPH_VHGW_MIN compute y[i] for 0 <= i <= N - W in-place
+ * in the padded buffer BUF of N elements, G is a workspace of N elements.
+ */
+#undef _
+#define _(CMP) (voxel_t buf[], voxel_t g[], long n, long w)		\
+{									\
+  if (w <= 1) return;							\
+  for (long i = 0; i < n; i += w) {					\
+    long m = (i + w < n ? i + w : n);					\
+    voxel_t val = buf[i];						\
+    g[i] = val;								\
+    for (long j = i + 1; j < m; ++j) {					\
+      if (buf[j] CMP val) val = buf[j];					\
+      g[j] = val;							\
+    }									\
+    val = buf[m - 1];							\
+    for (long j = m - 2; j >= i; --j) {					\
+      if (val CMP buf[j]) buf[j] = val; else val = buf[j];		\
+    }									\
+  }									\
+  for (long i = 0; i + w <= n; ++i) {					\
+    voxel_t p = buf[i], q = g[i + w - 1];				\
+    buf[i] = (q CMP p ? q : p);						\
+  }									\
+}
+
+#ifdef MORPH_VHGW_MAX
+static void MORPH_VHGW_MAX _(>)
+#endif
+#ifdef MORPH_VHGW_MIN
+static void MORPH_VHGW_MIN _(<)
+#endif
+#undef _
+
+/*
+ * Dilation (MORPH_LINE_MAX) or erosion (MORPH_LINE_MIN) by the line segment
+ * of offsets K*U for LO <= K <= HI.  The lines are all the maximal chains of
+ * voxels separated by U in the array of dimensions DIM[0..2], the components
+ * of U are any integers (not all zero).  Only the lines starting in the rows
+ * (Y,Z) of index Y + DIM[1]*Z in the range [FIRST,LAST) and at the
+ * abscissae X in the range [XBEG,XEND) are processed.  The
+ * operation is done in-place in ARR.  WS is a workspace of 6 times the length
+ * of the longest line.  A voxel with no neighbors inside the array is set to
+ * zero like in the brute force algorithm.
+ */
+#undef _
+#define _(VHGW, PAD) (voxel_t arr[], const long dim[], const long u[],	\
+                      long lo, long hi, long first, long last,		\
+                      long xbeg, long xend, voxel_t ws[])		\
+{									\
+  long nx = dim[0], ny = dim[1], nz = dim[2];				\
+  long step = (u[2]*ny + u[1])*nx + u[0];				\
+  for (long row = first; row < last; ++row) {				\
+    long y = row%ny, z = row/ny;					\
+    int ys = ((u[2] > 0 ? z < u[2] : (u[2] < 0 ? z >= nz + u[2] : 0)) || \
+              (u[1] > 0 ? y < u[1] : (u[1] < 0 ? y >= ny + u[1] : 0)));	\
+    /* Unless Y or Z already makes it, only the voxels in [XA,XB) start	\
+       a line. */							\
+    long xa = 0, xb = nx;						\
+    if (! ys) {								\
+      if (u[0] > 0) {							\
+        if (u[0] < nx) xb = u[0];					\
+      } else if (u[0] < 0) {						\
+        if (nx + u[0] > 0) xa = nx + u[0];				\
+      } else {								\
+        xb = 0;								\
+      }									\
+    }									\
+    if (xa < xbeg) xa = xbeg;						\
+    if (xb > xend) xb = xend;						\
+    for (long x = xa; x < xb; ++x) {					\
+      /* Length of the line starting at (X,Y,Z). */			\
+      long len = LONG_MAX, t;						\
+      if (u[0] != 0) {							\
+        t = (u[0] > 0 ? (nx - 1 - x)/u[0] : x/(-u[0]));			\
+        if (t < len) len = t;						\
+      }									\
+      if (u[1] != 0) {							\
+        t = (u[1] > 0 ? (ny - 1 - y)/u[1] : y/(-u[1]));			\
+        if (t < len) len = t;						\
+      }									\
+      if (u[2] != 0) {							\
+        t = (u[2] > 0 ? (nz - 1 - z)/u[2] : z/(-u[2]));			\
+        if (t < len) len = t;						\
+      }									\
+      ++len;								\
+      voxel_t* v = arr + (z*ny + y)*nx + x;				\
+      /* Only offsets in [1-LEN,LEN-1] can reach a voxel of the line. */ \
+      long a = (lo > 1 - len ? lo : 1 - len);				\
+      long b = (hi < len - 1 ? hi : len - 1);				\
+      if (a > b) {							\
+        for (long i = 0; i < len; ++i) v[i*step] = 0;			\
+        continue;							\
+      }									\
+      long w = b - a + 1;						\
+      long n = len + w - 1;						\
+      voxel_t* buf = ws;						\
+      voxel_t* g = ws + n;						\
+      for (long i = 0; i < n; ++i) {					\
+        long j = i + a;							\
+        buf[i] = (j >= 0 && j < len ? v[j*step] : PAD);			\
+      }									\
+      VHGW(buf, g, n, w);						\
+      for (long i = 0; i < len; ++i) v[i*step] = buf[i];		\
+      /* Voxels without neighbors inside the array. */			\
+      for (long i = 0; i < -b; ++i) v[i*step] = 0;			\
+      for (long i = (len - a > 0 ? len - a : 0); i < len; ++i) {	\
+        v[i*step] = 0;							\
+      }									\
+    }									\
+  }									\
+}
+
+#ifdef MORPH_LINE_MAX
+static void MORPH_LINE_MAX _(MORPH_VHGW_MAX, VOXEL_MIN)
+#endif
+#ifdef MORPH_LINE_MIN
+static void MORPH_LINE_MIN _(MORPH_VHGW_MIN, VOXEL_MAX)
+#endif
+#undef _
+
+/*
+ * Dilation (MORPH_BALL_MAX) or erosion (MORPH_BALL_MIN) by a structuring
+ * element made of NCHORDS horizontal chords.  The J-th chord is the segment
+ * of offsets (DX,CHORD[3*J],CHORD[3*J+1]) for |DX| <= CHORD[3*J+2] and the
+ * first chord must be (0,0,H) with H >= 0 so that every voxel has at least
+ * one neighbor.  The result is computed for the rows (Y,Z) of index Y +
+ * DIM[1]*Z in the range [FIRST,LAST) of the output array DST.  Each row of
+ * DST is the extremum of the source rows at the offsets of the chords
+ * filtered by the van Herk/Gil-Werman algorithm, which costs O(NCHORDS)
+ * operations per voxel instead of the number of voxels in the structuring
+ * element.  WS is a workspace of 6*DIM[0] elements.
+ */
+#undef _
+#define _(CMP, VHGW, PAD) (voxel_t dst[], const voxel_t src[],		\
+                           const long dim[], const long chord[],		\
+                           long nchords, long first, long last,		\
+                           voxel_t ws[])				\
+{									\
+  long nx = dim[0], ny = dim[1], nz = dim[2];				\
+  voxel_t* g = ws + 3*nx;						\
+  for (long row = first; row < last; ++row) {				\
+    long y = row%ny, z = row/ny;					\
+    voxel_t* out = dst + row*nx;					\
+    for (long j = 0; j < nchords; ++j) {				\
+      long yp = y + chord[3*j];						\
+      long zp = z + chord[3*j + 1];					\
+      if (yp < 0 || yp >= ny || zp < 0 || zp >= nz) continue;		\
+      const voxel_t* inp = src + (zp*ny + yp)*nx;			\
+      long h = chord[3*j + 2];						\
+      if (h > nx - 1) h = nx - 1;					\
+      long w = 2*h + 1;							\
+      long n = nx + w - 1;						\
+      for (long i = 0; i < h; ++i) ws[i] = PAD;				\
+      for (long i = 0; i < nx; ++i) ws[h + i] = inp[i];			\
+      for (long i = h + nx; i < n; ++i) ws[i] = PAD;			\
+      VHGW(ws, g, n, w);						\
+      if (j == 0) {							\
+        for (long i = 0; i < nx; ++i) out[i] = ws[i];			\
+      } else {								\
+        for (long i = 0; i < nx; ++i) {					\
+          if (ws[i] CMP out[i]) out[i] = ws[i];				\
+        }								\
+      }									\
+    }									\
+  }									\
+}
+
+#ifdef MORPH_BALL_MAX
+static void MORPH_BALL_MAX _(>, MORPH_VHGW_MAX, VOXEL_MIN)
+#endif
+#ifdef MORPH_BALL_MIN
+static void MORPH_BALL_MIN _(<, MORPH_VHGW_MIN, VOXEL_MAX)
+#endif
+#undef _
+
+/*
+ * Local minimum (DST1) and maximum (DST2) by a ball decomposed in chords.
+ * The arguments are the same as for MORPH_BALL_MAX and MORPH_BALL_MIN
+ * except that WS is a workspace of 9*DIM[0] elements.  Each source row is
+ * padded once for the two filters.
+ */
+#ifdef MORPH_BALL_MINMAX
+static void
+MORPH_BALL_MINMAX(voxel_t dst1[], voxel_t dst2[], const voxel_t src[],
+                  const long dim[], const long chord[], long nchords,
+                  long first, long last, voxel_t ws[])
+{
+  long nx = dim[0], ny = dim[1], nz = dim[2];
+  voxel_t* b1 = ws;
+  voxel_t* b2 = ws + 3*nx;
+  voxel_t* g = ws + 6*nx;
+  for (long row = first; row < last; ++row) {
+    long y = row%ny, z = row/ny;
+    voxel_t* out1 = dst1 + row*nx;
+    voxel_t* out2 = dst2 + row*nx;
+    for (long j = 0; j < nchords; ++j) {
+      long yp = y + chord[3*j];
+      long zp = z + chord[3*j + 1];
+      if (yp < 0 || yp >= ny || zp < 0 || zp >= nz) continue;
+      const voxel_t* inp = src + (zp*ny + yp)*nx;
+      long h = chord[3*j + 2];
+      if (h > nx - 1) h = nx - 1;
+      long w = 2*h + 1;
+      long n = nx + w - 1;
+      for (long i = 0; i < h; ++i) {
+        b1[i] = VOXEL_MAX;
+        b2[i] = VOXEL_MIN;
+      }
+      for (long i = 0; i < nx; ++i) b1[h + i] = b2[h + i] = inp[i];
+      for (long i = h + nx; i < n; ++i) {
+        b1[i] = VOXEL_MAX;
+        b2[i] = VOXEL_MIN;
+      }
+      MORPH_VHGW_MIN(b1, g, n, w);
+      MORPH_VHGW_MAX(b2, g, n, w);
+      if (j == 0) {
+        for (long i = 0; i < nx; ++i) {
+          out1[i] = b1[i];
+          out2[i] = b2[i];
+        }
+      } else {
+        for (long i = 0; i < nx; ++i) {
+          if (b1[i] < out1[i]) out1[i] = b1[i];
+          if (b2[i] > out2[i]) out2[i] = b2[i];
+        }
+      }
+    }
+  }
+}
+#endif /* MORPH_BALL_MINMAX */
+
+/*
+ * Difference X - Y of two arrays of N voxels with the same result type as
+ * in Yorick.
+ */
+#ifdef MORPH_DIFF
+static void MORPH_DIFF(result_t dst[], const voxel_t x[], const voxel_t y[],
+                       long n)
+{
+  for (long i = 0; i < n; ++i) {
+    dst[i] = (result_t)x[i] - (result_t)y[i];
+  }
+}
+#endif /* MORPH_DIFF */
+
+/*
+ * Toggle filter: every voxel of A is replaced by the closest of its local
+ * minimum AMIN and local maximum AMAX (the maximum in case of a tie).
+ */
+#ifdef MORPH_TOGGLE
+static void MORPH_TOGGLE(voxel_t dst[], const voxel_t a[],
+                         const voxel_t amin[], const voxel_t amax[], long n)
+{
+  for (long i = 0; i < n; ++i) {
+    result_t x = a[i];
+    dst[i] = ((x - (result_t)amin[i]) >= ((result_t)amax[i] - x) ?
+              amax[i] : amin[i]);
+  }
+}
+#endif /* MORPH_TOGGLE */
+
+/*
+ * First pass of the connected region labeling of IMG, an array of
+ * dimensions DIM[0..2].  The rows (Y,Z) of index Y + DIM[1]*Z in the range
+ * [FIRST,LAST) are scanned and every voxel is merged with its neighbors
+ * having the same value.  The NNBR neighbors are given by NBR[4*j..4*j+3]
+ * = (DX,DY,DZ,OFF) and only precede the voxel in storage order; only the
+ * neighbors whose row is in [RMIN,RMAX) are considered.  LAB is the array
+ * of parents: the root of a region is its voxel of smallest index.  If INIT
+ * is true, the parents of the voxels of the scanned rows are initialized,
+ * otherwise (merging of the seam between two slabs) they are left
+ * unchanged.
+ */
+#ifdef MORPH_LABEL
+static void MORPH_LABEL(long lab[], const voxel_t img[], const long dim[],
+                        const long nbr[], int nnbr, long first, long last,
+                        long rmin, long rmax, int init)
+{
+  long nx = dim[0], ny = dim[1], nz = dim[2];
+  for (long row = first; row < last; ++row) {
+    /* Select the neighbors in bounds for this row. */
+    long y = row%ny, z = row/ny;
+    const long* sel[13];
+    int m = 0;
+    for (int j = 0; j < nnbr; ++j) {
+      const long* q = nbr + 4*j;
+      long yn = y + q[1], zn = z + q[2], rn = yn + ny*zn;
+      if (yn >= 0 && yn < ny && zn >= 0 && zn < nz &&
+          rn >= rmin && rn < rmax) {
+        sel[m++] = q;
+      }
+    }
+    long i = row*nx;
+    for (long x = 0; x < nx; ++x, ++i) {
+      voxel_t v = img[i];
+      int root = init;
+      if (init) lab[i] = i;
+      for (int j = 0; j < m; ++j) {
+        const long* q = sel[j];
+        long xn = x + q[0];
+        if (xn < 0 || xn >= nx) continue;
+        long l = i + q[3];
+        if (img[l] != v) continue;
+        if (root) {
+          /* First neighbor found: no need to search the roots. */
+          lab[i] = lab[l];
+          root = 0;
+        } else {
+          label_union(lab, i, l);
+        }
+      }
+    }
+  }
+}
+#endif /* MORPH_LABEL */
+
+/*
+ * Grayscale reconstruction by dilation (MORPH_RECON_MAX) or by erosion
+ * (MORPH_RECON_MIN) of the marker J under the mask I by the hybrid
+ * algorithm of L. Vincent ("Morphological Grayscale Reconstruction in
+ * Image Analysis: Applications and Efficient Algorithms", IEEE Trans. on
+ * Image Processing, vol. 2, pp. 176-201, 1993).  J is overwritten by the
+ * result.  A raster and an anti-raster scans propagate the values, the
+ * voxels which may still propagate their value after the anti-raster scan
+ * are put in a FIFO queue which is processed until stability.  The arrays
+ * have dimensions DIM[0..2] and the NNBR neighbors preceding a voxel are
+ * given by NBR[4*j..4*j+3] = (DX,DY,DZ,OFF).  FIFO and INQ are workspaces
+ * of DIM[0]*DIM[1]*DIM[2] elements, INQ must be zero-filled.
+ */
+#undef _
+#define _(GT) (voxel_t J[], const voxel_t I[], const long dim[],	\
+               const long nbr[], int nnbr, long fifo[],			\
+               unsigned char inq[])					\
+{									\
+  long nx = dim[0], ny = dim[1], nz = dim[2];				\
+  long nrows = ny*nz, n = nx*nrows;					\
+  const long* sel[13];							\
+									\
+  /* Raster scan. */							\
+  for (long row = 0; row < nrows; ++row) {				\
+    long y = row%ny, z = row/ny;					\
+    int m = 0;								\
+    for (int j = 0; j < nnbr; ++j) {					\
+      const long* q = nbr + 4*j;					\
+      long yn = y + q[1], zn = z + q[2];				\
+      if (yn >= 0 && yn < ny && zn >= 0 && zn < nz) sel[m++] = q;	\
+    }									\
+    long i = row*nx;							\
+    for (long x = 0; x < nx; ++x, ++i) {				\
+      voxel_t v = J[i];							\
+      for (int j = 0; j < m; ++j) {					\
+        long xn = x + sel[j][0];					\
+        if (xn < 0 || xn >= nx) continue;				\
+        voxel_t w = J[i + sel[j][3]];					\
+        if (w GT v) v = w;						\
+      }									\
+      J[i] = (v GT I[i] ? I[i] : v);					\
+    }									\
+  }									\
+									\
+  /* Anti-raster scan. */						\
+  long head = 0, count = 0;						\
+  for (long row = nrows - 1; row >= 0; --row) {				\
+    long y = row%ny, z = row/ny;					\
+    int m = 0;								\
+    for (int j = 0; j < nnbr; ++j) {					\
+      const long* q = nbr + 4*j;					\
+      long yn = y - q[1], zn = z - q[2];				\
+      if (yn >= 0 && yn < ny && zn >= 0 && zn < nz) sel[m++] = q;	\
+    }									\
+    long i = row*nx + nx - 1;						\
+    for (long x = nx - 1; x >= 0; --x, --i) {				\
+      voxel_t v = J[i];							\
+      for (int j = 0; j < m; ++j) {					\
+        long xn = x - sel[j][0];					\
+        if (xn < 0 || xn >= nx) continue;				\
+        voxel_t w = J[i - sel[j][3]];					\
+        if (w GT v) v = w;						\
+      }									\
+      if (v GT I[i]) v = I[i];						\
+      J[i] = v;								\
+      for (int j = 0; j < m; ++j) {					\
+        long xn = x - sel[j][0];					\
+        if (xn < 0 || xn >= nx) continue;				\
+        long k = i - sel[j][3];						\
+        if (v GT J[k] && I[k] GT J[k]) {				\
+          fifo[(head + count)%n] = i;					\
+          ++count;							\
+          inq[i] = 1;							\
+          break;							\
+        }								\
+      }									\
+    }									\
+  }									\
+									\
+  /* Propagation of the values in the queue to all neighbors. */	\
+  while (count > 0) {							\
+    long i = fifo[head];						\
+    head = (head + 1)%n;						\
+    --count;								\
+    inq[i] = 0;								\
+    long x = i%nx, y = (i/nx)%ny, z = i/(nx*ny);			\
+    voxel_t v = J[i];							\
+    for (int j = 0; j < 2*nnbr; ++j) {					\
+      const long* q = nbr + 4*(j>>1);					\
+      long s = ((j&1) ? -1 : 1);					\
+      long xn = x + s*q[0], yn = y + s*q[1], zn = z + s*q[2];		\
+      if (xn < 0 || xn >= nx || yn < 0 || yn >= ny ||			\
+          zn < 0 || zn >= nz) continue;					\
+      long k = i + s*q[3];						\
+      if (v GT J[k] && I[k] != J[k]) {					\
+        J[k] = (v GT I[k] ? I[k] : v);					\
+        if (! inq[k]) {							\
+          fifo[(head + count)%n] = k;					\
+          ++count;							\
+          inq[k] = 1;							\
+        }								\
+      }									\
+    }									\
+  }									\
+}
+
+#ifdef MORPH_RECON_MAX
+static void MORPH_RECON_MAX _(>)
+#endif
+#ifdef MORPH_RECON_MIN
+static void MORPH_RECON_MIN _(<)
+#endif
+#undef _
+
+/*
+ * Marker of a reconstruction from the N voxels of A: A - H (saturated) for
+ * the h-maxima (MODE = 1), the predecessor of A for the regional maxima
+ * (MODE = 2) or A on the border of the array of dimensions DIM[0..2] and
+ * the largest value elsewhere for the filling of holes (MODE = 3).
+ */
+#ifdef MORPH_MARKER
+static void MORPH_MARKER(voxel_t J[], const voxel_t a[], const long dim[],
+                         int mode, double h)
+{
+  long nx = dim[0], ny = dim[1], nz = dim[2], n = nx*ny*nz;
+  if (mode == 1) {
+    /* For integer types, A - H is rounded down (a cast would round toward
+       zero, differently for negative and positive values). */
+    const int integer = ((voxel_t)0.5 == 0);
+    for (long i = 0; i < n; ++i) {
+      double v = (double)a[i] - h;
+      if (integer) v = floor(v);
+      J[i] = (v > (double)VOXEL_MIN ? (voxel_t)v : VOXEL_MIN);
+    }
+  } else if (mode == 2) {
+    for (long i = 0; i < n; ++i) {
+      J[i] = VOXEL_PRED(a[i]);
+    }
+  } else {
+    /* Dimensions of length 1 have no border. */
+    long i = 0;
+    for (long z = 0; z < nz; ++z) {
+      for (long y = 0; y < ny; ++y) {
+        int edge = ((nz > 1 && (z == 0 || z == nz - 1)) ||
+                    (ny > 1 && (y == 0 || y == ny - 1)));
+        for (long x = 0; x < nx; ++x, ++i) {
+          J[i] = ((edge || (nx > 1 && (x == 0 || x == nx - 1))) ?
+                  a[i] : VOXEL_MAX);
+        }
+      }
+    }
+  }
+}
+#endif /* MORPH_MARKER */
+
+/*
+ * Regional maxima of the N voxels of A given the reconstruction J of its
+ * predecessor.  A constant array is a single regional maximum.
+ */
+#ifdef MORPH_REGMAX
+static void MORPH_REGMAX(int dst[], const voxel_t a[], const voxel_t J[],
+                         long n)
+{
+  long count = 0;
+  for (long i = 0; i < n; ++i) {
+    count += (dst[i] = (a[i] > J[i]));
+  }
+  if (count == 0) {
+    for (long i = 1; i < n; ++i) {
+      if (a[i] != a[0]) return;
+    }
+    for (long i = 0; i < n; ++i) {
+      dst[i] = 1;
+    }
+  }
+}
+#endif /* MORPH_REGMAX */
+
+/*
+ * Initialize the squared distance D of the N voxels of A for the distance
+ * transform: 0 for the features (the voxels equal to zero) and infinite
+ * elsewhere.  If IDX is not NULL, the index of the nearest feature is set
+ * to the voxel index for the features and to -1 elsewhere.
+ */
+#ifdef MORPH_EDT_INIT
+static void MORPH_EDT_INIT(double d[], long idx[], const voxel_t a[], long n)
+{
+  for (long i = 0; i < n; ++i) {
+    d[i] = (a[i] == 0 ? 0.0 : HUGE_VAL);
+  }
+  if (idx != NULL) {
+    for (long i = 0; i < n; ++i) {
+      idx[i] = (a[i] == 0 ? i : -1);
+    }
+  }
+}
+#endif /* MORPH_EDT_INIT */
+
 #undef MORPH_DILATION
 #undef MORPH_EROSION
+#undef MORPH_LINE_MAX
+#undef MORPH_LINE_MIN
+#undef MORPH_VHGW_MAX
+#undef MORPH_VHGW_MIN
+#undef MORPH_BALL_MAX
+#undef MORPH_BALL_MIN
+#undef MORPH_MINMAX
+#undef MORPH_BALL_MINMAX
+#undef MORPH_DIFF
+#undef MORPH_TOGGLE
+#undef MORPH_LABEL
+#undef MORPH_RECON_MAX
+#undef MORPH_RECON_MIN
+#undef MORPH_MARKER
+#undef MORPH_REGMAX
+#undef MORPH_EDT_INIT
+#undef VOXEL_PRED
+#undef VOXEL_MIN
+#undef VOXEL_MAX
+#undef result_t
 #undef voxel_t
 
 #endif /* _YETI_MORPH_C -----------------------------------------------------*/
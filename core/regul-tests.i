@@ -290,8 +290,179 @@ func rgl_test
   e0 = rgl5a(hyper,cost_l2l0,x,g0);
   e1 = rgl_roughness_l2l0(hyper,[0,0,0,0,1],x,g1);
   write, format=format, 20, cost, e1 - e0, max(abs(g1 - g0));
+
+  /*----------------------------------------*/
+  /* multi-threaded versions (results must be identical) */
+  format = "%2d %-15s - delta_penalty = %9.2g / max(|delta_gradient|) = %g (nthreads=4)\n";
+  x = random(70,80,90) - 0.5;
+  g0 = array(double, dimsof(x));
+  g1 = array(double, dimsof(x));
+  e0 = rgl_roughness_cauchy(hyper,[1,0,-2],x,g0);
+  e1 = rgl_roughness_cauchy(hyper,[1,0,-2],x,g1,nthreads=4);
+  write, format=format, 21, "cauchy", e1 - e0, max(abs(g1 - g0));
+
+  g0 = array(double, dimsof(x));
+  g1 = array(double, dimsof(x));
+  e0 = rgl_roughness_l2l1_periodic(hyper,[0,-1,3],x,g0);
+  e1 = rgl_roughness_l2l1_periodic(hyper,[0,-1,3],x,g1,nthreads=4);
+  write, format=format, 22, "l2l1_periodic", e1 - e0, max(abs(g1 - g0));
+
+  /*----------------------------------------*/
+  /* several offsets at once */
+  format = "%2d %-15s - delta_penalty = %9.2g / max(|delta_gradient|) = %g (multiple offsets)\n";
+  off = [[1,0,0], [0,1,0], [1,-1,0], [1,1,-1]];
+  wgt = [1.0, 2.0, 0.5, 0.0];
+  g0 = array(double, dimsof(x));
+  g1 = array(double, dimsof(x));
+  e0 = 0.0;
+  for (k = 1; k <= 3; ++k) {
+    e0 += rgl_roughness_l2l1([wgt(k)*hyper(1), hyper(2)], off(,k), x, g0);
+  }
+  e1 = rgl_roughness_l2l1(hyper, off, x, g1, weight=wgt, nthreads=4);
+  write, format=format, 23, "l2l1", e1 - e0, max(abs(g1 - g0));
+
+  g0 = array(double, dimsof(x));
+  g1 = array(double, dimsof(x));
+  e0 = 0.0;
+  for (k = 1; k <= 4; ++k) {
+    e0 += rgl_roughness_l2_periodic(mu, off(,k), x, g0);
+  }
+  e1 = rgl_roughness_l2_periodic(mu, off, x, g1);
+  write, format=format, 24, "l2_periodic", e1 - e0, max(abs(g1 - g0));
+
+  /*----------------------------------------*/
+  /* single precision */
+  format = "%2d %-15s - delta_penalty = %9.2g / max(|delta_gradient|) = %g (float)\n";
+  xf = float(x);
+  g0 = array(double, dimsof(x));
+  g1 = [];
+  e0 = rgl_roughness_cauchy_periodic(hyper, off, double(xf), g0, weight=wgt);
+  e1 = rgl_roughness_cauchy_periodic(hyper, off, xf, g1, weight=wgt);
+  write, format=format, 25, "cauchy_periodic", (e1 - e0)/e0,
+    max(abs(g1 - g0))/max(abs(g0));
+  if (structof(g1) != float) error, "expecting a float gradient";
+}
+
+/* isotropic total variation (HUBER = 0) or Huber-TV (HUBER = 1) */
+func tv_ref(hyper, x, &g, huber=, periodic=)
+{
+  mu = hyper(1);
+  eps = hyper(2);
+  dims = dimsof(x);
+  t = array(double, dims);
+  dx = array(pointer, dims(1));
+  for (k = 1; k <= dims(1); ++k) {
+    off = array(long, dims(1));
+    off(k) = -1;
+    if (periodic) {
+      d = roll(x, off) - x;
+    } else {
+      d = array(double, dims);
+      /* forward difference along k-th dimension, zero at the end */
+      y = (k == 1 ? x : transpose(x, [1,k]));
+      z = array(double, dimsof(y));
+      if (dimsof(y)(2) > 1) z(1:-1,..) = y(dif,..);
+      d = (k == 1 ? z : transpose(z, [1,k]));
+    }
+    dx(k) = &d;
+    t += d*d;
+  }
+  if (huber) {
+    u = sqrt(t);
+    small = (u <= eps);
+    f = small*t/(2.0*eps) + (!small)*(u - 0.5*eps);
+    q = mu*(small/eps + (!small)/max(u, eps));
+  } else {
+    u = sqrt(t + eps*eps);
+    f = u;
+    q = mu/u;
+  }
+  g = array(double, dims);
+  for (k = 1; k <= dims(1); ++k) {
+    r = q*(*dx(k));
+    g -= r;
+    off = array(long, dims(1));
+    off(k) = 1;
+    if (periodic) {
+      g += roll(r, off);
+    } else {
+      y = (k == 1 ? r : transpose(r, [1,k]));
+      z = array(double, dimsof(y));
+      if (dimsof(y)(2) > 1) z(2:0,..) = y(1:-1,..);
+      g += (k == 1 ? z : transpose(z, [1,k]));
+    }
+  }
+  return mu*sum(f);
+}
+
+func tv_test
+{
+  format = "%2d %-21s - delta_penalty = %9.2g / max(|delta_gradient|) = %g\n";
+  format_mt = "%2d %-21s - delta_penalty = %9.2g / max(|delta_gradient|) = %g (nthreads=4)\n";
+  hyper = [1.7, 0.1];
+  /* Several blocks along the last dimension. */
+  x = random(40,30,64) - 0.5;
+  names = ["rgl_tv", "rgl_tv_periodic", "rgl_tv_huber", "rgl_tv_huber_periodic"];
+  for (i = 1; i <= 4; ++i) {
+    local g0, g1, g4;
+    f = symbol_def(names(i));
+    e0 = tv_ref(hyper, x, g0, huber=(i >= 3), periodic=(i%2 == 0));
+    e1 = f(hyper, x, g1, nthreads=1);
+    e4 = f(hyper, x, g4, nthreads=4);
+    write, format=format, i, names(i), e1 - e0, max(abs(g1 - g0));
+    write, format=format_mt, i, names(i), e4 - e1, max(abs(g4 - g1));
+  }
+  xf = float(random(40,30) - 0.5);
+  g1 = array(float, dimsof(xf));
+  e0 = tv_ref(hyper, double(xf), g0);
+  e1 = rgl_tv(hyper, xf, g1);
+  write, format=format, 5, "rgl_tv (float)", e1 - e0, max(abs(g1 - g0));
+  /* Several blocks of a 1-D array. */
+  x = random(50000) - 0.5;
+  for (i = 1; i <= 4; ++i) {
+    local g0, g1, g4;
+    f = symbol_def(names(i));
+    e0 = tv_ref(hyper, x, g0, huber=(i >= 3), periodic=(i%2 == 0));
+    e1 = f(hyper, x, g1, nthreads=1);
+    e4 = f(hyper, x, g4, nthreads=4);
+    write, format=format, i + 5, names(i), e1 - e0, max(abs(g1 - g0));
+    write, format=format_mt, i + 5, names(i), e4 - e1, max(abs(g4 - g1));
+  }
+}
+
+func hessian_test
+{
+  format = "%2d %-29s - max(|H.x - g|) = %9.2g / max(|diag - H.e|) = %g\n";
+  format_mt = "%2d %-29s - max(|delta_diag|) = %9.2g / max(|delta_H.x|) = %g (nthreads=4)\n";
+  /* Several blocks along the last dimension. */
+  x = random(40,30,64) - 0.5;
+  off = [[1,0,0], [0,1,0], [-1,1,2]];
+  wgt = [1.0, 0.5, 2.0];
+  names = ["l2", "l2_periodic", "l2l1", "l2l1_periodic",
+           "l2l0", "l2l0_periodic", "cauchy", "cauchy_periodic"];
+  for (i = 1; i <= 8; ++i) {
+    hyper = (i <= 2 ? 1.3 : [1.3, 0.2]);
+    f = symbol_def("rgl_roughness_"+names(i));
+    h = symbol_def("rgl_roughness_"+names(i)+"_hessian");
+    g = [];
+    f, hyper, off, x, g, weight=wgt;
+    /* H(x).x is the gradient at x */
+    hx = h(hyper, off, x, x, weight=wgt);
+    d = h(hyper, off, x, weight=wgt);
+    e = array(double, dimsof(x));
+    k = 123;
+    e(k) = 1.0;
+    he = h(hyper, off, x, e, weight=wgt);
+    write, format=format, i, "rgl_roughness_"+names(i)+"_hessian",
+      max(abs(hx - g)), abs(d(k) - he(k));
+    write, format=format_mt, i, "rgl_roughness_"+names(i)+"_hessian",
+      max(abs(h(hyper, off, x, weight=wgt, nthreads=4) - d)),
+      max(abs(h(hyper, off, x, x, weight=wgt, nthreads=4) - hx));
+  }
 }
 
 plug_dir,".";
 include,"./yeti.i";
 rgl_test;
+tv_test;
+hessian_test;
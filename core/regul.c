@@ -17,13 +17,6 @@
  *	Yorick: This code can be compiled with preprocessor flag
  *		-DYORICK to enable Yorick support.
  *
- *	Number of dimensions: Compile this code with preprocessor flag
- *		-DRGL_MAX_NDIMS=n with n <= 8 to limit the maximum number
- *		of dimensions (and reduce the size of the code).  Since the
- *		code is smart enough to "compress" dimensions, it may
- *		however be applicable for more than RGL_MAX_NDIMS
- *		dimensions.
- *
  *-----------------------------------------------------------------------------
  */
 
@@ -33,18 +26,16 @@
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #ifdef YORICK
 # include <yapi.h> /* for Yorick interface */
 #endif
+#include "yeti-threads.h"
 
 #ifndef NULL
 # define NULL 0
 #endif
 
-#ifndef RGL_MAX_NDIMS
-# define RGL_MAX_NDIMS 8
-#endif
-
 /*---------------------------------------------------------------------------*/
 /* DEFINITIONS */
 
@@ -66,8 +57,218 @@ extern rgl_roughness_penalty_t rgl_roughness_l2l0_periodic;
 extern rgl_roughness_penalty_t rgl_roughness_cauchy;
 extern rgl_roughness_penalty_t rgl_roughness_cauchy_periodic;
 
+/* Same as above but the work is distributed among at most NTHREADS
+   threads.  The result does not depend on the number of threads. */
+typedef double rgl_roughness_penalty_mt_t(const double hyper[],
+                                          const long ndims,
+                                          const long dim[],
+                                          const long off[],
+                                          const double arr[],
+                                          double grd[],
+                                          int nthreads);
+
+extern rgl_roughness_penalty_mt_t rgl_roughness_l2_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_l2_periodic_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_l1_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_l1_periodic_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_l2l1_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_l2l1_periodic_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_l2l0_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_l2l0_periodic_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_cauchy_mt;
+extern rgl_roughness_penalty_mt_t rgl_roughness_cauchy_periodic_mt;
+
+/* Sum of the penalties for NOFFS offsets, OFF[k*NDIMS + j] being the
+   offset along j-th dimension of the k-th offset, weighted by WGT[k] (all
+   weights are equal to 1 if WGT is NULL).  The model array and the
+   gradient are processed by blocks which are visited for all the offsets
+   while they are still in the cache. */
+typedef double rgl_roughness_penalty_multi_t(const double hyper[],
+                                             const long ndims,
+                                             const long dim[],
+                                             const long noffs,
+                                             const long off[],
+                                             const double wgt[],
+                                             const double arr[],
+                                             double grd[],
+                                             int nthreads);
+
+extern rgl_roughness_penalty_multi_t rgl_roughness_l2_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_l2_periodic_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_l1_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_l1_periodic_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_l2l1_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_l2l1_periodic_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_l2l0_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_l2l0_periodic_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_cauchy_multi;
+extern rgl_roughness_penalty_multi_t rgl_roughness_cauchy_periodic_multi;
+
+/* Single precision versions of the above functions, the array ARR and the
+   gradient GRD are of type float.  The differences are computed in single
+   precision, the penalty is accumulated in double precision. */
+typedef double rgl_roughness_penalty_f_t(const double hyper[],
+                                         const long ndims,
+                                         const long dim[],
+                                         const long off[],
+                                         const float arr[],
+                                         float grd[]);
+typedef double rgl_roughness_penalty_mt_f_t(const double hyper[],
+                                            const long ndims,
+                                            const long dim[],
+                                            const long off[],
+                                            const float arr[],
+                                            float grd[],
+                                            int nthreads);
+typedef double rgl_roughness_penalty_multi_f_t(const double hyper[],
+                                               const long ndims,
+                                               const long dim[],
+                                               const long noffs,
+                                               const long off[],
+                                               const double wgt[],
+                                               const float arr[],
+                                               float grd[],
+                                               int nthreads);
+
+#define DECLARE_F(name)                                 \
+  extern rgl_roughness_penalty_f_t name##_f;            \
+  extern rgl_roughness_penalty_mt_f_t name##_mt_f;      \
+  extern rgl_roughness_penalty_multi_f_t name##_multi_f
+DECLARE_F(rgl_roughness_l2);
+DECLARE_F(rgl_roughness_l2_periodic);
+DECLARE_F(rgl_roughness_l1);
+DECLARE_F(rgl_roughness_l1_periodic);
+DECLARE_F(rgl_roughness_l2l1);
+DECLARE_F(rgl_roughness_l2l1_periodic);
+DECLARE_F(rgl_roughness_l2l0);
+DECLARE_F(rgl_roughness_l2l0_periodic);
+DECLARE_F(rgl_roughness_cauchy);
+DECLARE_F(rgl_roughness_cauchy_periodic);
+#undef DECLARE_F
+
+/* Curvature of the roughness penalties for second order methods.  At ARR,
+   the Hessian of the penalty is majorized by H = D'.W.D where D yields
+   the differences R[k] between the elements of the pairs and W is
+   diagonal with W[k] = COST'(R[k])/R[k] (which is the exact Hessian for the
+   quadratic cost).  H is positive semi-definite and is never stored: if
+   VEC is NULL, the diagonal of H is added to OUT (e.g. to build a diagonal
+   preconditioner), otherwise the product H.VEC is added to OUT.  The other
+   arguments are the same as for the penalties and the returned value is 0
+   or a negative error code.  There are no such functions for the L1 cost
+   which is not differentiable. */
+typedef int rgl_roughness_hessian_t(const double hyper[],
+                                    const long ndims,
+                                    const long dim[],
+                                    const long noffs,
+                                    const long off[],
+                                    const double wgt[],
+                                    const double arr[],
+                                    const double vec[],
+                                    double out[],
+                                    int nthreads);
+typedef int rgl_roughness_hessian_f_t(const double hyper[],
+                                      const long ndims,
+                                      const long dim[],
+                                      const long noffs,
+                                      const long off[],
+                                      const double wgt[],
+                                      const float arr[],
+                                      const float vec[],
+                                      float out[],
+                                      int nthreads);
+
+#define DECLARE_H(name)                                 \
+  extern rgl_roughness_hessian_t name##_hessian;        \
+  extern rgl_roughness_hessian_f_t name##_hessian_f
+DECLARE_H(rgl_roughness_l2);
+DECLARE_H(rgl_roughness_l2_periodic);
+DECLARE_H(rgl_roughness_l2l1);
+DECLARE_H(rgl_roughness_l2l1_periodic);
+DECLARE_H(rgl_roughness_l2l0);
+DECLARE_H(rgl_roughness_l2l0_periodic);
+DECLARE_H(rgl_roughness_cauchy);
+DECLARE_H(rgl_roughness_cauchy_periodic);
+#undef DECLARE_H
+
+/* Isotropic total variation of array ARR of dimensions DIM (at most 4
+   dimensions, not counting trailing dimensions of length 1), that is the sum over all elements
+   of COST(|D|) where D is the vector of the forward differences along all
+   dimensions, with:
+
+      COST(t) = MU*sqrt(t^2 + EPS^2)                         (rgl_tv)
+
+      COST(t) = MU*t^2/(2*EPS)   if t <= EPS                 (rgl_tv_huber)
+              = MU*(t - EPS/2)   otherwise
+
+   MU = HYPER[0] and EPS = HYPER[1] > 0.  At the end of non-periodic
+   dimensions, the differences are zero.  The penalty and its gradient (if
+   GRD is not NULL) are computed in a single pass with at most NTHREADS
+   threads and the result does not depend on the number of threads. */
+typedef double rgl_tv_penalty_t(const double hyper[],
+                                const long ndims,
+                                const long dim[],
+                                const double arr[],
+                                double grd[],
+                                int nthreads);
+typedef double rgl_tv_penalty_f_t(const double hyper[],
+                                  const long ndims,
+                                  const long dim[],
+                                  const float arr[],
+                                  float grd[],
+                                  int nthreads);
+
+extern rgl_tv_penalty_t rgl_tv;
+extern rgl_tv_penalty_t rgl_tv_periodic;
+extern rgl_tv_penalty_t rgl_tv_huber;
+extern rgl_tv_penalty_t rgl_tv_huber_periodic;
+extern rgl_tv_penalty_f_t rgl_tv_f;
+extern rgl_tv_penalty_f_t rgl_tv_periodic_f;
+extern rgl_tv_penalty_f_t rgl_tv_huber_f;
+extern rgl_tv_penalty_f_t rgl_tv_huber_periodic_f;
+
 #define integer_t long
-#define real_t double
+
+/* Sweep of a penalty over the compact dimensions DIM_C and offsets OFF_C
+   restricted to the indices [FIRST,LAST) of the last compact dimension. */
+typedef double rgl_sweep_t(const double hyper[], const integer_t n,
+                           const integer_t dim_c[], const integer_t off_c[],
+                           const void* arr, void* grd,
+                           const integer_t first, const integer_t last);
+
+/* Same as above but add the curvature of the penalty (see
+   rgl_roughness_hessian_t) to OUT. */
+typedef void rgl_hessian_sweep_t(const double hyper[], const integer_t n,
+                                 const integer_t dim_c[],
+                                 const integer_t off_c[], const void* arr,
+                                 const void* vec, void* out,
+                                 const integer_t first, const integer_t last);
+
+/* Run SWEEP, or HSWEEP if not NULL (then VEC is passed to HSWEEP and GRD
+   is the output array), over all offsets with at most NTHREADS threads. */
+static double rgl_run(rgl_sweep_t* sweep, rgl_hessian_sweep_t* hsweep,
+                      int periodic, int nhyper,
+                      const double hyper[], const integer_t ndims,
+                      const integer_t dim[], const integer_t noffs,
+                      const integer_t off[], const double wgt[],
+                      const void* arr, const void* vec, void* grd,
+                      int nthreads);
+
+/* Check the hyper-parameters and the weights, return a negative error
+   code, 1 if the penalty is zero or 0 otherwise. */
+static int rgl_check(int nhyper, const double hyper[], const integer_t noffs,
+                     const double wgt[]);
+
+/* Sweep of the total variation over the slices [FIRST,LAST) of the last of
+   the RANK dimensions DIM[0:3] (the trailing ones being equal to 1).  If
+   RANK is 1, the slices are the elements of the array. */
+typedef double rgl_tv_sweep_t(const double hyper[], const integer_t rank,
+                              const integer_t dim[], const void* arr,
+                              void* grd, const integer_t first,
+                              const integer_t last);
+
+static double rgl_tv_run(rgl_tv_sweep_t* sweep, const double hyper[],
+                         const integer_t ndims, const integer_t dim[],
+                         const void* arr, void* grd, int nthreads);
 
 /* Error codes: */
 #define RGL_ERROR_BAD_ADDRESS   -1
@@ -75,9 +276,6 @@ extern rgl_roughness_penalty_t rgl_roughness_cauchy_periodic;
 #define RGL_ERROR_BAD_HYPER     -3
 #define RGL_ERROR_TOO_MANY_DIMS -4
 
-/* Maximum number of dimensions: */
-#define RGL_MAX_NDIMS 8
-
 /* Codes for cost functions: */
 #define RGL_COST_L1        1
 #define RGL_COST_L2        2
@@ -88,68 +286,654 @@ extern rgl_roughness_penalty_t rgl_roughness_cauchy_periodic;
 #define RGL_MAX(a,b) ((a) >= (b) ? (a) : (b))
 #define RGL_MIN(a,b) ((a) <= (b) ? (a) : (b))
 
+/* Get the range [LO,HI) of the indices along the K-th compact dimension
+   of the 1st element of the pairs, the indices along the last one being
+   restricted to [FIRST,LAST). */
+static void rgl_range(int periodic, const integer_t n, const integer_t k,
+                      const integer_t dim_c[], const integer_t off_c[],
+                      const integer_t first, const integer_t last,
+                      integer_t* lo, integer_t* hi)
+{
+  integer_t l, h;
+
+  l = (periodic || off_c[k] >= 0 ? 0 : -off_c[k]);
+  h = (periodic || off_c[k] <= 0 ? dim_c[k] : dim_c[k] - off_c[k]);
+  if (k == n - 1) {
+    l = RGL_MAX(l, first);
+    h = RGL_MIN(h, last);
+  }
+  *lo = l;
+  *hi = RGL_MAX(l, h);
+}
+
 #define RGL_PERIODIC  0
 #define RGL_COST      RGL_COST_L2
 #define RGL_ROUGHNESS rgl_roughness_l2
+#define RGL_ROUGHNESS_MT rgl_roughness_l2_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2_multi
+#define RGL_SWEEP sweep_l2
+#define RGL_HESSIAN rgl_roughness_l2_hessian
+#define RGL_HESSIAN_SWEEP hessian_l2
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  1
 #define RGL_COST      RGL_COST_L2
 #define RGL_ROUGHNESS rgl_roughness_l2_periodic
+#define RGL_ROUGHNESS_MT rgl_roughness_l2_periodic_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2_periodic_multi
+#define RGL_SWEEP sweep_l2_periodic
+#define RGL_HESSIAN rgl_roughness_l2_periodic_hessian
+#define RGL_HESSIAN_SWEEP hessian_l2_periodic
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  0
 #define RGL_COST      RGL_COST_L1
 #define RGL_ROUGHNESS rgl_roughness_l1
+#define RGL_ROUGHNESS_MT rgl_roughness_l1_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l1_multi
+#define RGL_SWEEP sweep_l1
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  1
 #define RGL_COST      RGL_COST_L1
 #define RGL_ROUGHNESS rgl_roughness_l1_periodic
+#define RGL_ROUGHNESS_MT rgl_roughness_l1_periodic_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l1_periodic_multi
+#define RGL_SWEEP sweep_l1_periodic
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  0
 #define RGL_COST      RGL_COST_L2L1
 #define RGL_ROUGHNESS rgl_roughness_l2l1
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l1_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l1_multi
+#define RGL_SWEEP sweep_l2l1
+#define RGL_HESSIAN rgl_roughness_l2l1_hessian
+#define RGL_HESSIAN_SWEEP hessian_l2l1
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  1
 #define RGL_COST      RGL_COST_L2L1
 #define RGL_ROUGHNESS rgl_roughness_l2l1_periodic
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l1_periodic_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l1_periodic_multi
+#define RGL_SWEEP sweep_l2l1_periodic
+#define RGL_HESSIAN rgl_roughness_l2l1_periodic_hessian
+#define RGL_HESSIAN_SWEEP hessian_l2l1_periodic
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  0
 #define RGL_COST      RGL_COST_CAUCHY
 #define RGL_ROUGHNESS rgl_roughness_cauchy
+#define RGL_ROUGHNESS_MT rgl_roughness_cauchy_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_cauchy_multi
+#define RGL_SWEEP sweep_cauchy
+#define RGL_HESSIAN rgl_roughness_cauchy_hessian
+#define RGL_HESSIAN_SWEEP hessian_cauchy
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  1
 #define RGL_COST      RGL_COST_CAUCHY
 #define RGL_ROUGHNESS rgl_roughness_cauchy_periodic
+#define RGL_ROUGHNESS_MT rgl_roughness_cauchy_periodic_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_cauchy_periodic_multi
+#define RGL_SWEEP sweep_cauchy_periodic
+#define RGL_HESSIAN rgl_roughness_cauchy_periodic_hessian
+#define RGL_HESSIAN_SWEEP hessian_cauchy_periodic
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  0
 #define RGL_COST      RGL_COST_L2L0
 #define RGL_ROUGHNESS rgl_roughness_l2l0
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l0_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l0_multi
+#define RGL_SWEEP sweep_l2l0
+#define RGL_HESSIAN rgl_roughness_l2l0_hessian
+#define RGL_HESSIAN_SWEEP hessian_l2l0
+#define real_t double
 #include __FILE__
 
 #define RGL_PERIODIC  1
 #define RGL_COST      RGL_COST_L2L0
 #define RGL_ROUGHNESS rgl_roughness_l2l0_periodic
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l0_periodic_mt
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l0_periodic_multi
+#define RGL_SWEEP sweep_l2l0_periodic
+#define RGL_HESSIAN rgl_roughness_l2l0_periodic_hessian
+#define RGL_HESSIAN_SWEEP hessian_l2l0_periodic
+#define real_t double
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_COST      RGL_COST_L2
+#define RGL_ROUGHNESS rgl_roughness_l2_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l2_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2_multi_f
+#define RGL_SWEEP sweep_l2_f
+#define RGL_HESSIAN rgl_roughness_l2_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_l2_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_COST      RGL_COST_L2
+#define RGL_ROUGHNESS rgl_roughness_l2_periodic_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l2_periodic_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2_periodic_multi_f
+#define RGL_SWEEP sweep_l2_periodic_f
+#define RGL_HESSIAN rgl_roughness_l2_periodic_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_l2_periodic_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_COST      RGL_COST_L1
+#define RGL_ROUGHNESS rgl_roughness_l1_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l1_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l1_multi_f
+#define RGL_SWEEP sweep_l1_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_COST      RGL_COST_L1
+#define RGL_ROUGHNESS rgl_roughness_l1_periodic_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l1_periodic_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l1_periodic_multi_f
+#define RGL_SWEEP sweep_l1_periodic_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_COST      RGL_COST_L2L1
+#define RGL_ROUGHNESS rgl_roughness_l2l1_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l1_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l1_multi_f
+#define RGL_SWEEP sweep_l2l1_f
+#define RGL_HESSIAN rgl_roughness_l2l1_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_l2l1_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_COST      RGL_COST_L2L1
+#define RGL_ROUGHNESS rgl_roughness_l2l1_periodic_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l1_periodic_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l1_periodic_multi_f
+#define RGL_SWEEP sweep_l2l1_periodic_f
+#define RGL_HESSIAN rgl_roughness_l2l1_periodic_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_l2l1_periodic_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_COST      RGL_COST_CAUCHY
+#define RGL_ROUGHNESS rgl_roughness_cauchy_f
+#define RGL_ROUGHNESS_MT rgl_roughness_cauchy_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_cauchy_multi_f
+#define RGL_SWEEP sweep_cauchy_f
+#define RGL_HESSIAN rgl_roughness_cauchy_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_cauchy_f
+#define real_t float
 #include __FILE__
 
+#define RGL_PERIODIC  1
+#define RGL_COST      RGL_COST_CAUCHY
+#define RGL_ROUGHNESS rgl_roughness_cauchy_periodic_f
+#define RGL_ROUGHNESS_MT rgl_roughness_cauchy_periodic_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_cauchy_periodic_multi_f
+#define RGL_SWEEP sweep_cauchy_periodic_f
+#define RGL_HESSIAN rgl_roughness_cauchy_periodic_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_cauchy_periodic_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_COST      RGL_COST_L2L0
+#define RGL_ROUGHNESS rgl_roughness_l2l0_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l0_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l0_multi_f
+#define RGL_SWEEP sweep_l2l0_f
+#define RGL_HESSIAN rgl_roughness_l2l0_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_l2l0_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_COST      RGL_COST_L2L0
+#define RGL_ROUGHNESS rgl_roughness_l2l0_periodic_f
+#define RGL_ROUGHNESS_MT rgl_roughness_l2l0_periodic_mt_f
+#define RGL_ROUGHNESS_MULTI rgl_roughness_l2l0_periodic_multi_f
+#define RGL_SWEEP sweep_l2l0_periodic_f
+#define RGL_HESSIAN rgl_roughness_l2l0_periodic_hessian_f
+#define RGL_HESSIAN_SWEEP hessian_l2l0_periodic_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_TV_HUBER  0
+#define RGL_TV        rgl_tv
+#define RGL_TV_SWEEP tv_sweep
+#define real_t double
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_TV_HUBER  0
+#define RGL_TV        rgl_tv_periodic
+#define RGL_TV_SWEEP tv_sweep_periodic
+#define real_t double
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_TV_HUBER  1
+#define RGL_TV        rgl_tv_huber
+#define RGL_TV_SWEEP tv_sweep_huber
+#define real_t double
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_TV_HUBER  1
+#define RGL_TV        rgl_tv_huber_periodic
+#define RGL_TV_SWEEP tv_sweep_huber_periodic
+#define real_t double
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_TV_HUBER  0
+#define RGL_TV        rgl_tv_f
+#define RGL_TV_SWEEP tv_sweep_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_TV_HUBER  0
+#define RGL_TV        rgl_tv_periodic_f
+#define RGL_TV_SWEEP tv_sweep_periodic_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  0
+#define RGL_TV_HUBER  1
+#define RGL_TV        rgl_tv_huber_f
+#define RGL_TV_SWEEP tv_sweep_huber_f
+#define real_t float
+#include __FILE__
+
+#define RGL_PERIODIC  1
+#define RGL_TV_HUBER  1
+#define RGL_TV        rgl_tv_huber_periodic_f
+#define RGL_TV_SWEEP tv_sweep_huber_periodic_f
+#define real_t float
+#include __FILE__
+
+/*---------------------------------------------------------------------------*/
+/* MULTI-THREADED DRIVER */
+
+/*
+ * The slowest varying dimension is split into blocks of fixed length (which
+ * only depend on the dimensions and offsets, not on the number of threads)
+ * and the pairs of elements are visited in two phases: first the pairs
+ * whose both elements belong to the same block, then the pairs straddling
+ * the boundary at the beginning of each block.  Since the blocks are at
+ * least twice as long as the offsets, the tasks of a given phase never
+ * update the same entries of the gradient.  All the offsets are applied to
+ * a block before moving to the next one so that the block is read from
+ * the cache.  The partial penalties are summed in a fixed order so the
+ * result does not depend on the number of threads.
+ */
+
+#define RGL_MAX_BLOCKS    256  /* maximum number of blocks */
+#define RGL_MIN_BLOCK    8192  /* minimum number of elements per block */
+
+typedef struct _rgl_task rgl_task_t;
+struct _rgl_task {
+  rgl_sweep_t* sweep;
+  rgl_hessian_sweep_t* hsweep; /* sweep for the curvature (can be NULL) */
+  int periodic;
+  int nhyper;             /* number of hyper-parameters */
+  const double* hyper;
+  const double* wgt;      /* weights of the offsets (can be NULL) */
+  integer_t ndims;        /* number of dimensions */
+  integer_t nd;           /* same without trailing dimensions of length 1 */
+  const integer_t* dim;   /* dimensions */
+  integer_t noffs;        /* number of offsets */
+  const integer_t* off;   /* offsets */
+  const integer_t* cmp;   /* compact dimensions and offsets */
+  const void* arr;
+  const void* vec;        /* argument of the Hessian (can be NULL) */
+  void* grd;              /* gradient or output of HSWEEP */
+  integer_t len;          /* length of the blocks */
+  integer_t nblocks;      /* number of blocks */
+  int phase;              /* 0 for inner pairs, 1 for straddling ones */
+  double penalty[2*RGL_MAX_BLOCKS];
+};
+
+/* Compact the ND first dimensions DIM and offsets OFF into DIM_C and
+   OFF_C, the NDIMS - ND other dimensions being of length 1.  Consecutive
+   dimensions with no offsets are collapsed and periodic offsets are
+   reduced to the range [0,DIM_C[j]).  The returned value is the number of
+   compact dimensions or 0 if there are no pairs of distinct elements. */
+static integer_t rgl_compact(int periodic, const integer_t nd,
+                             const integer_t ndims, const integer_t dim[],
+                             const integer_t off[],
+                             integer_t dim_c[], integer_t off_c[])
+{
+  integer_t n, j, jc;
+
+  if (! periodic) {
+    for (j = 0; j < ndims; ++j) {
+      if (off[j] >= dim[j] || -off[j] >= dim[j]) {
+        return 0;
+      }
+    }
+  }
+  jc = 0; /* index over "compact" dimensions list */
+  dim_c[0] = dim[0];
+  off_c[0] = off[0];
+  for (j = 1; j < nd; ++j) {
+    if (off[j] == 0 && off_c[jc] == 0) {
+      /* Collapse with previous dimension. */
+      dim_c[jc] *= dim[j];
+    } else {
+      /* Add new dimension. */
+      ++jc;
+      dim_c[jc] = dim[j];
+      off_c[jc] = off[j];
+    }
+  }
+  n = jc + 1; /* number of "compact" dimensions */
+  if (periodic) {
+    for (jc = 0; jc < n; ++jc) {
+      if (off_c[jc] >= 0) {
+        off_c[jc] %= dim_c[jc];
+      } else {
+        off_c[jc] = ((-off_c[jc])%dim_c[jc]);
+        if (off_c[jc]) {
+          off_c[jc] = dim_c[jc] - off_c[jc];
+        }
+      }
+    }
+  }
+  for (jc = 0; jc < n; ++jc) {
+    if (off_c[jc]) {
+      return n;
+    }
+  }
+  return 0; /* an element compared to itself has no cost */
+}
+
+/* Signed offset along the slowest dimension of length M. */
+static integer_t rgl_outer_offset(int periodic, integer_t m, integer_t o)
+{
+  if (periodic) {
+    o = (o >= 0 ? o%m : m - ((-o)%m));
+    if (2*o > m) {
+      o -= m;
+    }
+  }
+  return o;
+}
+
+static void rgl_task(void* data, long first, long last, int rank)
+{
+  rgl_task_t* t = (rgl_task_t*)data;
+  const integer_t* dim_c; /* compact dimensions */
+  const integer_t* off_c; /* compact offsets */
+  integer_t b, k, n, m, o, p, start, end, lo, hi;
+  double hyper[2], penalty;
+
+  m = t->dim[t->nd - 1];
+  hyper[1] = (t->nhyper > 1 ? t->hyper[1] : 0.0);
+  for (b = first; b < last; ++b) {
+    start = b*t->len;
+    end = (b + 1 < t->nblocks ? start + t->len : m);
+    penalty = 0.0;
+    for (k = 0; k < t->noffs; ++k) {
+      hyper[0] = (t->wgt ? t->wgt[k]*t->hyper[0] : t->hyper[0]);
+      if (hyper[0] <= 0.0) {
+        continue;
+      }
+      n = t->cmp[k*(2*t->nd + 1)];
+      if (n <= 0) {
+        continue;
+      }
+      dim_c = t->cmp + k*(2*t->nd + 1) + 1;
+      off_c = dim_c + t->nd;
+      o = rgl_outer_offset(t->periodic, m, t->off[k*t->ndims + t->nd - 1]);
+      if (t->phase == 0) {
+        /* Pairs inside the block. */
+        lo = (o >= 0 ? start : start - o);
+        hi = (o >= 0 ? end - o : end);
+      } else if (o >= 0) {
+        /* Pairs across the boundary at START (which is the same as the
+           boundary at M for the first block). */
+        lo = (b > 0 ? start : m) - o;
+        hi = (b > 0 ? start : m);
+      } else {
+        lo = start;
+        hi = start - o;
+      }
+      if (lo < hi) {
+        /* The last compact dimension may embed faster dimensions with no
+           offsets. */
+        p = dim_c[n - 1]/m;
+        if (t->hsweep != NULL) {
+          t->hsweep(hyper, n, dim_c, off_c, t->arr, t->vec, t->grd,
+                    lo*p, hi*p);
+        } else {
+          penalty += t->sweep(hyper, n, dim_c, off_c, t->arr, t->grd,
+                              lo*p, hi*p);
+        }
+      }
+    }
+    t->penalty[2*b + t->phase] = penalty;
+  }
+}
+
+static double rgl_run(rgl_sweep_t* sweep, rgl_hessian_sweep_t* hsweep,
+                      int periodic, int nhyper,
+                      const double hyper[], const integer_t ndims,
+                      const integer_t dim[], const integer_t noffs,
+                      const integer_t off[], const double wgt[],
+                      const void* arr, const void* vec, void* grd,
+                      int nthreads)
+{
+  rgl_task_t task;
+  integer_t* cmp;
+  integer_t nd, j, k, s, m, o, len;
+  double penalty;
+
+  /* Trailing dimensions of length 1 are dropped (there are no pairs of
+     elements along them with a non-zero offset in the non-periodic case
+     and the periodic offsets are reduced to zero). */
+  nd = ndims;
+  while (nd > 1 && dim[nd - 1] == 1) {
+    --nd;
+  }
+
+  /* Compact the dimensions for every offset, the K-th one is stored as
+     N, DIM_C[0:ND-1] and OFF_C[0:ND-1] in CMP[K*(2*ND + 1):...]. */
+  cmp = (integer_t*)malloc(noffs*(2*nd + 1)*sizeof(integer_t));
+  if (cmp == NULL) {
+    return -12.0;
+  }
+  for (k = 0; k < noffs; ++k) {
+    j = k*(2*nd + 1);
+    cmp[j] = rgl_compact(periodic, nd, ndims, dim, off + k*ndims,
+                         cmp + j + 1, cmp + j + 1 + nd);
+  }
+
+  /* Split the slowest dimension into blocks. */
+  m = dim[nd - 1];
+  s = 1;
+  for (j = 0; j < nd - 1; ++j) {
+    s *= dim[j];
+  }
+  len = (RGL_MIN_BLOCK + s - 1)/s;
+  len = RGL_MAX(len, (m + RGL_MAX_BLOCKS - 1)/RGL_MAX_BLOCKS);
+  for (k = 0; k < noffs; ++k) {
+    o = rgl_outer_offset(periodic, m, off[k*ndims + nd - 1]);
+    len = RGL_MAX(len, 2*(o >= 0 ? o : -o));
+  }
+  len = RGL_MAX(len, 1);
+  task.sweep = sweep;
+  task.hsweep = hsweep;
+  task.periodic = periodic;
+  task.nhyper = nhyper;
+  task.hyper = hyper;
+  task.wgt = wgt;
+  task.ndims = ndims;
+  task.nd = nd;
+  task.dim = dim;
+  task.noffs = noffs;
+  task.off = off;
+  task.cmp = cmp;
+  task.arr = arr;
+  task.vec = vec;
+  task.grd = grd;
+  task.len = len;
+  task.nblocks = RGL_MAX(m/len, 1);
+  task.phase = 0;
+  yeti_run_tasks(rgl_task, &task, task.nblocks, nthreads);
+  task.phase = 1;
+  yeti_run_tasks(rgl_task, &task, task.nblocks, nthreads);
+  penalty = 0.0;
+  for (j = 0; j < 2*task.nblocks; ++j) {
+    penalty += task.penalty[j];
+  }
+  free(cmp);
+  return penalty;
+}
+
+static int rgl_check(int nhyper, const double hyper[], const integer_t noffs,
+                     const double wgt[])
+{
+  integer_t k;
+
+  if (hyper[0] < 0.0) {
+    return -1;
+  }
+  if (nhyper > 1 && hyper[1] <= 0.0) {
+    /*  By continuity, the cost is zero when HYPER[1] = 0. */
+    return (hyper[1] ? -2 : 1);
+  }
+  if (wgt != NULL) {
+    for (k = 0; k < noffs; ++k) {
+      if (wgt[k] < 0.0) {
+        return -3;
+      }
+    }
+  }
+  return (hyper[0] > 0.0 ? 0 : 1);
+}
+
+/* The total variation is split into blocks of slices along the last
+   dimension like the roughness penalties.  The elements of a slice only
+   update the gradient in this slice and in the next one, hence the last
+   slice of each block is processed in a second phase. */
+typedef struct _rgl_tv_task rgl_tv_task_t;
+struct _rgl_tv_task {
+  rgl_tv_sweep_t* sweep;
+  const double* hyper;
+  integer_t rank;         /* number of dimensions */
+  integer_t dim[4];       /* dimensions */
+  const void* arr;
+  void* grd;
+  integer_t len;          /* length of the blocks */
+  integer_t nblocks;      /* number of blocks */
+  int phase;              /* 0 for inner slices, 1 for the last ones */
+  double penalty[2*RGL_MAX_BLOCKS];
+};
+
+static void rgl_tv_task(void* data, long first, long last, int rank)
+{
+  rgl_tv_task_t* t = (rgl_tv_task_t*)data;
+  integer_t b, start, end;
+
+  for (b = first; b < last; ++b) {
+    start = b*t->len;
+    end = (b + 1 < t->nblocks ? start + t->len : t->dim[t->rank - 1]);
+    t->penalty[2*b + t->phase] =
+      (t->phase == 0 ?
+       t->sweep(t->hyper, t->rank, t->dim, t->arr, t->grd, start, end - 1) :
+       t->sweep(t->hyper, t->rank, t->dim, t->arr, t->grd, end - 1, end));
+  }
+}
+
+static double rgl_tv_run(rgl_tv_sweep_t* sweep, const double hyper[],
+                         const integer_t ndims, const integer_t dim[],
+                         const void* arr, void* grd, int nthreads)
+{
+  rgl_tv_task_t task;
+  integer_t j, s, m, len;
+  double penalty;
+
+  /* Drop trailing dimensions of length 1. */
+  task.rank = ndims;
+  while (task.rank > 1 && dim[task.rank - 1] == 1) {
+    --task.rank;
+  }
+  if (task.rank > 4) {
+    return -11.0;
+  }
+  for (j = 0; j < 4; ++j) {
+    task.dim[j] = (j < task.rank ? dim[j] : 1);
+  }
+  if (task.rank < 1) {
+    task.rank = 1;
+  }
+
+  /* Split the last dimension into blocks of at least 2 slices (elements
+     for a 1-D array). */
+  m = task.dim[task.rank - 1];
+  s = 1;
+  for (j = 0; j < task.rank - 1; ++j) {
+    s *= task.dim[j];
+  }
+  len = (RGL_MIN_BLOCK + s - 1)/s;
+  len = RGL_MAX(len, (m + RGL_MAX_BLOCKS - 1)/RGL_MAX_BLOCKS);
+  len = RGL_MAX(len, 2);
+  task.sweep = sweep;
+  task.hyper = hyper;
+  task.arr = arr;
+  task.grd = grd;
+  task.len = len;
+  task.nblocks = RGL_MAX(m/len, 1);
+  task.phase = 0;
+  yeti_run_tasks(rgl_tv_task, &task, task.nblocks, nthreads);
+  task.phase = 1;
+  yeti_run_tasks(rgl_tv_task, &task, task.nblocks, nthreads);
+  penalty = 0.0;
+  for (j = 0; j < 2*task.nblocks; ++j) {
+    penalty += task.penalty[j];
+  }
+  return penalty;
+}
 
 /*---------------------------------------------------------------------------*/
 /* YORICK INTERFACE */
 
 #ifdef YORICK
 
-static long* get_vector_l(int iarg, long* ntot)
+static long* get_offsets(int iarg, long* len, long* noffs)
 {
-  if (yarg_number(iarg) != 1 || yarg_rank(iarg) > 1) {
-    y_error("expecting a vector of integers");
+  long dims[Y_DIMSIZE], ntot;
+  long* offset;
+  if (yarg_number(iarg) != 1 || yarg_rank(iarg) > 2) {
+    y_error("expecting a vector or a matrix of integers");
   }
-  return ygeta_l(iarg, ntot, NULL);
+  offset = ygeta_l(iarg, &ntot, dims);
+  *len = (dims[0] == 2 ? dims[1] : ntot);
+  *noffs = (dims[0] == 2 ? dims[2] : 1);
+  return offset;
 }
 
 static double* get_vector_d(int iarg, long* ntot)
@@ -161,36 +945,167 @@ static double* get_vector_d(int iarg, long* ntot)
   return ygeta_d(iarg, ntot, NULL);
 }
 
-static double* get_array_d(int iarg, long* ntot, long dims[])
+/* Get array of reals, as floats if SINGLE is true. */
+static void* get_array(int iarg, int single, long* ntot, long dims[])
 {
   int id = yarg_number(iarg);
   if (id < 1 || id > 2) {
     y_error("expecting an array of reals");
   }
+  if (single) {
+    return ygeta_f(iarg, ntot, dims);
+  }
   return ygeta_d(iarg, ntot, dims);
 }
 
+/* Get the array to store the gradient from the simple variable reference
+   IARG which must be nil or an array of reals with dimensions DIM.  The
+   gradient is converted to float if SINGLE is true, to double otherwise.
+   A new array is pushed on top of the stack if the variable is nil. */
+static void* get_gradient(int iarg, int single, long ndims, const long dim[])
+{
+  long dims[Y_DIMSIZE];
+  void* grd = NULL;
+  long j, ref;
+  int type, flag;
+
+  ref = yget_ref(iarg);
+  if (ref == -1L) {
+    y_error("expecting a simple variable reference for argument GRD");
+  }
+  type = yarg_typeid(iarg);
+  flag = 0;
+  switch (type) {
+  case Y_CHAR:
+  case Y_SHORT:
+  case Y_INT:
+  case Y_LONG:
+  case Y_FLOAT:
+  case Y_DOUBLE:
+    grd = get_array(iarg, single, NULL, dims);
+    if (dims[0] != ndims) {
+      flag = 1;
+    } else {
+      for (j = 0; j < ndims; ++j) {
+        if (dims[j + 1] != dim[j]) {
+          flag = 1;
+          break;
+        }
+      }
+    }
+    break;
+  case Y_VOID:
+    dims[0] = ndims;
+    for (j = 0; j < ndims; ++j) {
+      dims[j + 1] = dim[j];
+    }
+    grd = (single ? (void*)ypush_f(dims) : (void*)ypush_d(dims));
+    iarg = 0;
+    break;
+  default:
+    flag = 1;
+  }
+  if (flag) {
+    y_error("argument GRD must be nil or an array of reals with same dimension list as ARR");
+  }
+  if (type != (single ? Y_FLOAT : Y_DOUBLE)) {
+    yput_global(ref, iarg);
+  }
+  return grd;
+}
+
+/* Check whether single precision can be used for array ARR and gradient
+   GRD at positions IARG_ARR and IARG_GRD (-1 if omitted) on the stack. */
+static int use_single(int iarg_arr, int iarg_grd)
+{
+  int type;
+  if (yarg_typeid(iarg_arr) != Y_FLOAT) {
+    return 0;
+  }
+  if (iarg_grd < 0) {
+    return 1;
+  }
+  type = yarg_typeid(iarg_grd);
+  return (type == Y_FLOAT || type == Y_VOID);
+}
+
+/* Raise an error if PENALTY is an error code. */
+static void check_penalty(double penalty, const char* name)
+{
+  char buf[100];
+  if (penalty < 0.0) {
+    if (penalty == -1.0) {
+      strcpy(buf, "bad 1st hyper-parameter in ");
+    } else if (penalty == -2.0) {
+      strcpy(buf, "bad 2nd hyper-parameter in ");
+    } else if (penalty == -3.0) {
+      strcpy(buf, "bad weight in ");
+    } else if (penalty == -11.0) {
+      strcpy(buf, "too many dimensions in ");
+    } else if (penalty == -12.0) {
+      strcpy(buf, "insufficient memory in ");
+    } else {
+      strcpy(buf, "unknown error in ");
+    }
+    strcat(buf, name);
+    y_error(buf);
+  }
+}
+
+static char* roughness_knames[] = {"nthreads", "weight", NULL};
+static long roughness_kglobs[3];
+
+/* Compute a roughness penalty with RGL_D or RGL_F or, if HESS_D and
+   HESS_F are not NULL, the curvature of the penalty.  In the latter case,
+   the optional 4th argument is the vector VEC (instead of the gradient) and
+   the result is H.VEC or the diagonal of H if VEC is omitted. */
 static void roughness(int argc, const char* name,
-                      rgl_roughness_penalty_t* rgl,
+                      rgl_roughness_penalty_multi_t* rgl_d,
+                      rgl_roughness_penalty_multi_f_t* rgl_f,
+                      rgl_roughness_hessian_t* hess_d,
+                      rgl_roughness_hessian_f_t* hess_f,
                       int n)
 {
   double penalty;
   char buf[100];
-  double* arr, *grd, *hyp;
+  double* hyp, *wgt;
+  void* arr, *grd, *vec;
   long dims[Y_DIMSIZE];
-  long off[Y_DIMSIZE - 1], dim[Y_DIMSIZE - 1];
-  long* offset;
-  long j, ndims, ref, noffs, nhyps, ntot;
-  int iarg, type, flag;
-
-  if (argc < 3 || argc > 4) {
+  long dim[Y_DIMSIZE - 1];
+  long* offset, *off;
+  long j, k, len, ndims, noffs, nhyps, nwgts, ntot, nthreads;
+  int iarg, nargs, kiargs[2], iargs[4], single;
+
+  nargs = 0;
+  yarg_kw_init(roughness_knames, roughness_kglobs, kiargs);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    iarg = yarg_kw(iarg, roughness_kglobs, kiargs);
+    if (iarg < 0) break;
+    if (nargs < 4) iargs[nargs] = iarg;
+    ++nargs;
+  }
+  if (nargs < 3 || nargs > 4) {
     strcpy(buf, name);
     strcat(buf, " takes 3 or 4 arguments");
     y_error(buf);
   }
+  nthreads = (kiargs[0] < 0 || yarg_nil(kiargs[0]) ? 1 : ygets_l(kiargs[0]));
+  if (nthreads <= 0) {
+    y_error("bad value for keyword NTHREADS");
+  }
+  wgt = NULL;
+  nwgts = 0;
+  if (kiargs[1] >= 0 && ! yarg_nil(kiargs[1])) {
+    wgt = get_vector_d(kiargs[1], &nwgts);
+    for (k = 0; k < nwgts; ++k) {
+      if (wgt[k] < 0.0) {
+        y_error("invalid weight value(s)");
+      }
+    }
+  }
 
   /* Get HYPER argument. */
-  hyp = get_vector_d(argc - 1, &nhyps);
+  hyp = get_vector_d(iargs[2], &nhyps);
   if (nhyps != n) {
     y_error("bad number of hyper-parameters");
   }
@@ -201,89 +1116,95 @@ static void roughness(int argc, const char* name,
   }
 
   /* Get OFFSET and ARR arguments.  Check compatibility of OFFSET and
-     dimension list of ARR. */
-  offset = get_vector_l(argc - 2, &noffs);
-  arr = get_array_d(argc - 3, &ntot, dims);
+     dimension list of ARR.  Single precision is used if ARR is a float
+     array and GRD is omitted, nil or also a float array. */
+  offset = get_offsets(iargs[1], &len, &noffs);
+  if (wgt != NULL && nwgts != noffs) {
+    y_error("bad number of weights");
+  }
+  single = use_single(iargs[0], (nargs >= 4 ? iargs[3] : -1));
+  arr = get_array(iargs[0], single, &ntot, dims);
   ndims = dims[0];
   for (j = 0; j < ndims; ++j) {
-    if (j < noffs) {
-      off[j] = offset[j];
-    } else {
-      off[j] = 0;
-    }
     dim[j] = dims[j + 1];
   }
-  for (j = ndims; j < noffs; ++j) {
-    if (offset[j]) {
-      y_error("non-zero extra offset(s)");
+  for (k = 0; k < noffs; ++k) {
+    for (j = ndims; j < len; ++j) {
+      if (offset[k*len + j]) {
+        y_error("non-zero extra offset(s)");
+      }
     }
   }
 
-  /* Get GRD argument.  Create output gradient if needed. */
-  grd = NULL;
-  if (argc >= 4) {
-    iarg = argc - 4;
-    ref = yget_ref(iarg);
-    if (ref == -1L) {
-      y_error("expecting a simple variable reference for argument GRD");
-    }
-    type = yarg_typeid(iarg);
-    flag = 0;
-    switch (type) {
-    case Y_CHAR:
-    case Y_SHORT:
-    case Y_INT:
-    case Y_LONG:
-    case Y_FLOAT:
-    case Y_DOUBLE:
-      grd = ygeta_d(iarg, NULL, dims);
+  /* Get GRD (or VEC) argument.  Create output gradient if needed. */
+  vec = NULL;
+  if (hess_d != NULL) {
+    grd = NULL;
+    if (nargs >= 4) {
+      vec = get_array(iargs[3], single, NULL, dims);
       if (dims[0] != ndims) {
-        flag = 1;
-      } else {
-        for (j = 0; j < ndims; ++j) {
-          if (dims[j + 1] != dim[j]) {
-            flag = 1;
-            break;
-          }
+        y_error("argument VEC must have the same dimension list as ARR");
+      }
+      for (j = 0; j < ndims; ++j) {
+        if (dims[j + 1] != dim[j]) {
+          y_error("argument VEC must have the same dimension list as ARR");
         }
       }
-      break;
-    case Y_VOID:
-      grd = ypush_d(dims);
-      break;
-    default:
-      flag = 1;
-    }
-    if (flag) {
-      y_error("argument GRD must be nil or an array of reals with same dimension list as ARR");
-    }
-    if (type != Y_DOUBLE) {
-      yput_global(ref, iarg);
     }
+  } else {
+    grd = (nargs >= 4 ? get_gradient(iargs[3], single, ndims, dim) : NULL);
   }
 
-  /* Compute penalty and return result. */
-  penalty = rgl(hyp, ndims, dim, off, arr, grd);
-  if (penalty < 0.0) {
-    if (penalty == -1.0) {
-      strcpy(buf, "bad 1st hyper-parameter in ");
-    } else if (penalty == -2.0) {
-      strcpy(buf, "bad 2nd hyper-parameter in ");
-    } else if (penalty == -11.0) {
-      strcpy(buf, "too many dimensions in ");
+  /* Store the offsets as an NDIMS-by-NOFFS array and compute penalty. */
+  dims[0] = 1;
+  dims[1] = (ndims > 0 ? ndims : 1)*noffs;
+  off = ypush_l(dims);
+  for (k = 0; k < noffs; ++k) {
+    for (j = 0; j < ndims; ++j) {
+      off[k*ndims + j] = (j < len ? offset[k*len + j] : 0);
+    }
+  }
+  nthreads = yeti_effective_threads(nthreads, ntot);
+  if (hess_d != NULL) {
+    /* The result is left on top of the stack. */
+    dims[0] = ndims;
+    for (j = 0; j < ndims; ++j) {
+      dims[j + 1] = dim[j];
+    }
+    if (single) {
+      penalty = hess_f(hyp, ndims, dim, noffs, off, wgt, (const float*)arr,
+                       (const float*)vec, ypush_f(dims), nthreads);
     } else {
-      strcpy(buf, "unknown error in ");
+      penalty = hess_d(hyp, ndims, dim, noffs, off, wgt, (const double*)arr,
+                       (const double*)vec, ypush_d(dims), nthreads);
     }
-    strcat(buf, name);
-    y_error(buf);
+    check_penalty(penalty, name);
+    return;
   }
+  if (single) {
+    penalty = rgl_f(hyp, ndims, dim, noffs, off, wgt, (const float*)arr,
+                    (float*)grd, nthreads);
+  } else {
+    penalty = rgl_d(hyp, ndims, dim, noffs, off, wgt, (const double*)arr,
+                    (double*)grd, nthreads);
+  }
+  check_penalty(penalty, name);
   ypush_double(penalty);
 }
 
 #define MAKE_BUILTIN(cost, n)						\
 void Y_rgl_roughness_##cost(int argc)					\
 {									\
-   roughness(argc, "rgl_roughness_"#cost, rgl_roughness_##cost, n);	\
+   roughness(argc, "rgl_roughness_"#cost, rgl_roughness_##cost##_multi,	\
+             rgl_roughness_##cost##_multi_f, NULL, NULL, n);		\
+}
+
+#define MAKE_HESSIAN_BUILTIN(cost, n)					\
+void Y_rgl_roughness_##cost##_hessian(int argc)				\
+{									\
+   roughness(argc, "rgl_roughness_"#cost"_hessian", NULL, NULL,		\
+             rgl_roughness_##cost##_hessian,				\
+             rgl_roughness_##cost##_hessian_f, n);			\
 }
 
 MAKE_BUILTIN(l2, 1)
@@ -301,6 +1222,92 @@ MAKE_BUILTIN(l2l0_periodic, 2)
 MAKE_BUILTIN(cauchy, 2)
 MAKE_BUILTIN(cauchy_periodic, 2)
 
+MAKE_HESSIAN_BUILTIN(l2, 1)
+MAKE_HESSIAN_BUILTIN(l2_periodic, 1)
+
+MAKE_HESSIAN_BUILTIN(l2l1, 2)
+MAKE_HESSIAN_BUILTIN(l2l1_periodic, 2)
+
+MAKE_HESSIAN_BUILTIN(l2l0, 2)
+MAKE_HESSIAN_BUILTIN(l2l0_periodic, 2)
+
+MAKE_HESSIAN_BUILTIN(cauchy, 2)
+MAKE_HESSIAN_BUILTIN(cauchy_periodic, 2)
+
+static char* tv_knames[] = {"nthreads", NULL};
+static long tv_kglobs[2];
+
+static void total_variation(int argc, const char* name,
+                            rgl_tv_penalty_t* tv_d,
+                            rgl_tv_penalty_f_t* tv_f)
+{
+  double penalty;
+  char buf[100];
+  double* hyp;
+  void* arr, *grd;
+  long dims[Y_DIMSIZE];
+  long dim[Y_DIMSIZE - 1];
+  long j, ndims, nhyps, ntot, nthreads;
+  int iarg, nargs, kiargs[1], iargs[3], single;
+
+  nargs = 0;
+  yarg_kw_init(tv_knames, tv_kglobs, kiargs);
+  for (iarg = argc - 1; iarg >= 0; --iarg) {
+    iarg = yarg_kw(iarg, tv_kglobs, kiargs);
+    if (iarg < 0) break;
+    if (nargs < 3) iargs[nargs] = iarg;
+    ++nargs;
+  }
+  if (nargs < 2 || nargs > 3) {
+    strcpy(buf, name);
+    strcat(buf, " takes 2 or 3 arguments");
+    y_error(buf);
+  }
+  nthreads = (kiargs[0] < 0 || yarg_nil(kiargs[0]) ? 1 : ygets_l(kiargs[0]));
+  if (nthreads <= 0) {
+    y_error("bad value for keyword NTHREADS");
+  }
+
+  /* Get HYPER and ARR arguments. */
+  hyp = get_vector_d(iargs[0], &nhyps);
+  if (nhyps != 2) {
+    y_error("bad number of hyper-parameters");
+  }
+  if (hyp[0] < 0.0 || hyp[1] <= 0.0) {
+    y_error("invalid hyper-parameter value(s)");
+  }
+  single = use_single(iargs[1], (nargs >= 3 ? iargs[2] : -1));
+  arr = get_array(iargs[1], single, &ntot, dims);
+  ndims = dims[0];
+  for (j = 0; j < ndims; ++j) {
+    dim[j] = dims[j + 1];
+  }
+
+  /* Get GRD argument and compute penalty. */
+  grd = (nargs >= 3 ? get_gradient(iargs[2], single, ndims, dim) : NULL);
+  nthreads = yeti_effective_threads(nthreads, ntot);
+  if (single) {
+    penalty = tv_f(hyp, ndims, dim, (const float*)arr, (float*)grd,
+                   nthreads);
+  } else {
+    penalty = tv_d(hyp, ndims, dim, (const double*)arr, (double*)grd,
+                   nthreads);
+  }
+  check_penalty(penalty, name);
+  ypush_double(penalty);
+}
+
+#define MAKE_TV_BUILTIN(name)						\
+void Y_##name(int argc)							\
+{									\
+  total_variation(argc, #name, name, name##_f);				\
+}
+
+MAKE_TV_BUILTIN(rgl_tv)
+MAKE_TV_BUILTIN(rgl_tv_periodic)
+MAKE_TV_BUILTIN(rgl_tv_huber)
+MAKE_TV_BUILTIN(rgl_tv_huber_periodic)
+
 #endif /* YORICK */
 
 #else /* _RGL_CODE is defined */
@@ -311,7 +1318,7 @@ MAKE_BUILTIN(cauchy_periodic, 2)
 /*
  * Nomenclature:
  *
- *   PREFIX_NAME_COST[_PERIODIC]
+ *   PREFIX_NAME_COST[_PERIODIC][_MT|_MULTI|_HESSIAN][_f]
  *
  * where:
  *
@@ -324,6 +1331,8 @@ MAKE_BUILTIN(cauchy_periodic, 2)
  *   DIMENSIONS = # of dimensions of interest, prefixed with a 'p' for
  *                periodic bounds
  *
+ * and the suffix "_f" is for single precision arrays (real_t is float).
+ *
  * Prototype of penalty functions:
  *
  *    double rgl(const double hyper[], const integer_t ndims,
@@ -356,6 +1365,13 @@ MAKE_BUILTIN(cauchy_periodic, 2)
  */
 
 #ifdef RGL_ROUGHNESS
+#undef RGL_NHYPER
+#if (RGL_COST == RGL_COST_L1) || (RGL_COST == RGL_COST_L2)
+# define RGL_NHYPER 1
+#else
+# define RGL_NHYPER 2
+#endif
+
 double RGL_ROUGHNESS(const double hyper[],  /* hyper-parameters */
                      const integer_t ndims, /* number of dimensions */
                      const integer_t dim[], /* dimensions */
@@ -363,11 +1379,67 @@ double RGL_ROUGHNESS(const double hyper[],  /* hyper-parameters */
                      const real_t arr[],    /* model array */
                      real_t grd[])          /* gradient (can be NULL) */
 {
-  const double ZERO = 0.0;
+  return RGL_ROUGHNESS_MT(hyper, ndims, dim, off, arr, grd, 1);
+}
+
+static double RGL_SWEEP(const double hyper[], const integer_t n,
+                        const integer_t dim_c[], const integer_t off_c[],
+                        const void* arr, void* grd,
+                        const integer_t first, const integer_t last);
+
+double RGL_ROUGHNESS_MT(const double hyper[],  /* hyper-parameters */
+                        const integer_t ndims, /* number of dimensions */
+                        const integer_t dim[], /* dimensions */
+                        const integer_t off[], /* offsets */
+                        const real_t arr[],    /* model array */
+                        real_t grd[],          /* gradient (can be NULL) */
+                        int nthreads)          /* number of threads */
+{
+  return RGL_ROUGHNESS_MULTI(hyper, ndims, dim, 1, off, NULL, arr, grd,
+                             nthreads);
+}
+
+double RGL_ROUGHNESS_MULTI(const double hyper[],  /* hyper-parameters */
+                           const integer_t ndims, /* number of dimensions */
+                           const integer_t dim[], /* dimensions */
+                           const integer_t noffs, /* number of offsets */
+                           const integer_t off[], /* offsets */
+                           const double wgt[],    /* weights (can be NULL) */
+                           const real_t arr[],    /* model array */
+                           real_t grd[],          /* gradient (can be NULL) */
+                           int nthreads)          /* number of threads */
+{
+  int status;
+
+  /* Check arguments. */
+  status = rgl_check(RGL_NHYPER, hyper, noffs, wgt);
+  if (status != 0) {
+    return (status < 0 ? (double)status : 0.0);
+  }
+  if (ndims <= 0 || noffs <= 0 || dim == NULL || off == NULL ||
+      arr == NULL) {
+    return 0.0;
+  }
+  return rgl_run(RGL_SWEEP, NULL, RGL_PERIODIC, RGL_NHYPER, hyper, ndims,
+                 dim, noffs, off, wgt, arr, NULL, grd, nthreads);
+}
+
+/* Sweep over the N compact dimensions DIM_C with offsets OFF_C (in the
+   range [0,DIM_C[j]) if periodic) restricted to the indices [FIRST,LAST) of
+   the last compact dimension. */
+static double RGL_SWEEP(const double hyper[], const integer_t n,
+                        const integer_t dim_c[], const integer_t off_c[],
+                        const void* arr_, void* grd_,
+                        const integer_t first, const integer_t last)
+{
+  const real_t* arr = (const real_t*)arr_;
+  real_t* grd = (real_t*)grd_;
 #if (RGL_COST == RGL_COST_L2)
+  const double ZERO = 0.0;
   double w ,r;
 #endif
 #if (RGL_COST == RGL_COST_L1)
+  const double ZERO = 0.0;
   double w;
 #endif
 #if (RGL_COST == RGL_COST_L2L1)
@@ -383,107 +1455,11 @@ double RGL_ROUGHNESS(const double hyper[],  /* hyper-parameters */
   double q, r, s, w;
 #endif
   double penalty;
-#undef s1
-#define s1 1 /* fisrt stride is always equal to 1 */
-  integer_t j1, e1, lo1, hi1;
-  integer_t j2, e2, lo2, hi2, s2;
-  integer_t j3, e3, lo3, hi3, s3;
-  integer_t j4, e4, lo4, hi4, s4;
-  integer_t j5, e5, lo5, hi5, s5;
-  integer_t j6, e6, lo6, hi6, s6;
-  integer_t j7, e7, lo7, hi7, s7;
-  integer_t j8, e8, lo8, hi8, s8;
-  integer_t j9,               s9;
-  integer_t n, j, jc;
-  integer_t dim_c[RGL_MAX_NDIMS]; /* compact offsets */
-  integer_t off_c[RGL_MAX_NDIMS]; /* compact dimensions */
+  integer_t d0, o0, lo0, hi0, mid0, d1, o1, lo1, hi1, i1, p1;
+  integer_t k, c, nc, rem, i, p, lo, hi, a, e, j, stride, base1, base2;
 
-  /* Check arguments. */
-  if (hyper[0] < ZERO) {
-    return -1.0;
-  }
-#if (RGL_COST == RGL_COST_L2L1) || \
-    (RGL_COST == RGL_COST_L2L0) || \
-    (RGL_COST == RGL_COST_CAUCHY)
-  if (hyper[1] <= ZERO) {
-    /*  By continuity, the cost is ZERO when HYPER[1] = 0. */
-    return (hyper[1] ? -2.0 : 0.0);
-  }
-#endif
-  if (ndims <= 0 || dim == NULL || off == NULL || hyper == NULL ||
-      arr == NULL || hyper[0] <= 0.0) {
-    return 0.0;
-  }
-
-  /* Compact dimensions. */
-  jc = 0; /* index over "compact" dimensions list */
-  dim_c[0] = dim[0];
-  off_c[0] = off[0];
-  for (j = 1; j < ndims; ++j) {
-    if (off[j] == 0 && off_c[jc] == 0) {
-      /* Collapse with previous dimension. */
-      dim_c[jc] *= dim[j];
-    } else {
-      /* Add new dimension. */
-      if (++jc >= RGL_MAX_NDIMS) {
-        return -1.0;
-      }
-      dim_c[jc] = dim[j];
-      off_c[jc] = off[j];
-    }
-  }
-  n = jc + 1; /* number of "compact" dimensions */
-#if RGL_PERIODIC
-  for (jc = 0; jc < n; ++jc) {
-    if (off_c[jc] >= 0) {
-      off_c[jc] %= dim_c[jc];
-    } else {
-      off_c[jc] = ((-off_c[jc])%dim_c[jc]);
-      if (off_c[jc]) {
-        off_c[jc] = dim_c[jc] - off_c[jc];
-      }
-    }
-  }
-#endif /* RGL_PERIODIC */
-
-
-  /* Macros for spk = (k+1)-th stride, jpk = (k+1)-th index. */
-#undef jp1
-#define jp1 j2
-#undef jp2
-#define jp2 j3
-#undef jp3
-#define jp3 j4
-#undef jp4
-#define jp4 j5
-#undef jp5
-#define jp5 j6
-#undef jp6
-#define jp6 j7
-#undef jp7
-#define jp7 j8
-#undef jp8
-#define jp8 j9
-
-#undef sp1
-#define sp1 s2
-#undef sp2
-#define sp2 s3
-#undef sp3
-#define sp3 s4
-#undef sp4
-#define sp4 s5
-#undef sp5
-#define sp5 s6
-#undef sp6
-#define sp6 s7
-#undef sp7
-#define sp7 s8
-#undef sp8
-#define sp8 s9
-
-#undef LOOP
-#undef CODE
+#undef RGL_ENGINE
+#undef RGL_PREPARE
 
 #undef BODY_1
 #undef FINAL_1
@@ -598,160 +1574,379 @@ double RGL_ROUGHNESS(const double hyper[],  /* hyper-parameters */
 #endif /* RGL_COST_CAUCHY */
 
 
-#if RGL_PERIODIC
-
   /*
-   *  Periodic case
-   *  ~~~~~~~~~~~~~
-   *
-   *    At k-th dimension, j_k is the offset of the 'other' element
-   *    not accounting for indices lower than k.  Therefore a loop
-   *    writes:
-   *
-   *      for (i_k = 0; i_k < dim_k; ++i_k) {
-   *        j_k = j_{k+1} + ((i_k + off_k)%dim_k)*s_k;
-   *        ...;
-   *
-   *    where i_k and s_k are the index and the stride along k-th
-   *    dimension.
-   *
-   *    This can be rewritten as:
-   *
-   *      j_k = j_{k+1} + ((i_k*s_k + off_k*s_k) % (dim_k*s_k)
-   *          = j_{k+1} + (e_k % s_{k+1})
-   *
-   *    with:
-   *
-   *      e_k = i_k*s_k + off_k*s_k
-   *          = lo_k, lo_k + s_k, ..., hi_k - s_k
-   *      lo_k = off_k*s_k          (i_k = 0)
-   *      hi_k = lo_k + dim_k*s_k   (i_k = dim_k)
-   *
-   *    finally the loop reads:
-   *
-   *      for (e_k = lo_k; e_k < hi_k; e_k += s_k) {
-   *        j_k = j_{k+1} + (e_k % s_{k+1});
-   *        ...;
-   *
-   *    Note that j1 is the position of the 'other' element inside the
-   *    final loop.
+   * The two first (fastest varying) compact dimensions are walked by
+   * nested loops, the innermost one running over contiguous elements; the
+   * position in the other dimensions is decoded from a single counter C
+   * (odometer).  Along each dimension, I is the index of the 1st element
+   * of a pair and P = I + OFF (modulo DIM if periodic) the index of the
+   * 2nd one.  In the periodic case, the innermost loop is split in two
+   * runs [LO0,MID0) and [MID0,HI0), the latter wrapping around.
    */
+#define RGL_ENGINE(BODY)					\
+  for (c = 0; c < nc; ++c) {					\
+    rem = c;							\
+    base1 = 0;							\
+    base2 = 0;							\
+    stride = d0*d1;						\
+    for (k = 2; k < n; ++k) {					\
+      rgl_range(RGL_PERIODIC, n, k, dim_c, off_c,		\
+                first, last, &lo, &hi);				\
+      i = lo + rem%(hi - lo);					\
+      rem /= (hi - lo);						\
+      p = i + off_c[k];						\
+      if (RGL_PERIODIC && p >= dim_c[k]) p -= dim_c[k];		\
+      base1 += i*stride;					\
+      base2 += p*stride;					\
+      stride *= dim_c[k];					\
+    }								\
+    for (i1 = lo1; i1 < hi1; ++i1) {				\
+      p1 = i1 + o1;						\
+      if (RGL_PERIODIC && p1 >= d1) p1 -= d1;			\
+      a = base1 + i1*d0;					\
+      e = base2 + p1*d0 - a + o0;				\
+      for (j = a + lo0; j < a + mid0; ++j) {			\
+        BODY(j, j + e)						\
+      }								\
+      if (RGL_PERIODIC) {					\
+        e -= d0;						\
+        for (j = a + mid0; j < a + hi0; ++j) {			\
+          BODY(j, j + e)					\
+        }							\
+      }								\
+    }								\
+  }
 
-# define LOOP(k)					\
-  for (e##k = lo##k, j##k = jp##k + e##k;		\
-       e##k < hi##k;					\
-       e##k += s##k, j##k = jp##k + (e##k % sp##k))
-
-# define CODE(k)					\
-  sp##k =  dim_c[k-1]*s##k; /* next stride */		\
-  lo##k =  off_c[k-1]*s##k;				\
-  hi##k = (off_c[k-1] + dim_c[k-1])*s##k;		\
-  if (n == k) {						\
-    jp##k = 0; /* let the optimizer do the job */	\
-    if (grd) {						\
-      LOOPS {						\
-        BODY_2(j, j1)					\
-        ++j;						\
-      }							\
-      FINAL_2						\
-    } else {						\
-      LOOPS {						\
-        BODY_1(j, j1)					\
-        ++j;						\
-      }							\
-      FINAL_1						\
-    }							\
-    return penalty;					\
-  }
-
-#else /* not RGL_PERIODIC */
-
-# define LOOP(k) \
-  for (j##k = lo##k + jp##k, e##k = hi##k + jp##k; j##k < e##k; j##k += s##k)
-
-# define CODE(k)							\
-  j += off_c[k-1]*s##k;	/* increment total offset */			\
-  sp##k =  dim_c[k-1]*s##k; /* next stride */				\
-  lo##k = (off_c[k-1] >= 0 ? 0 : -off_c[k-1]*s##k);			\
-  hi##k = (off_c[k-1] >= 0 ? dim_c[k-1] - off_c[k-1] : dim_c[k-1])*s##k;\
-  if (lo##k >= hi##k) {							\
-    return 0.0;								\
-  }									\
-  if (n == k) {								\
-    jp##k = 0; /* let the optimizer do the job */			\
-    if (grd) {								\
-      LOOPS {								\
-        BODY_2(j1, j1 + j)						\
-      }									\
-      FINAL_2								\
-    } else {								\
-      LOOPS {								\
-        BODY_1(j1, j1 + j)						\
-      }									\
-      FINAL_1								\
-    }									\
-    return penalty;							\
-  }
-
-#endif /* not RGL_PERIODIC */
+  /* Ranges of the dimensions and number NC of rows of the 2 first ones. */
+#define RGL_PREPARE						\
+  d0 = dim_c[0];						\
+  o0 = off_c[0];						\
+  rgl_range(RGL_PERIODIC, n, 0, dim_c, off_c,			\
+            first, last, &lo0, &hi0);				\
+  mid0 = RGL_MAX(lo0, RGL_MIN(hi0, d0 - o0));			\
+  if (n > 1) {							\
+    d1 = dim_c[1];						\
+    o1 = off_c[1];						\
+    rgl_range(RGL_PERIODIC, n, 1, dim_c, off_c,			\
+              first, last, &lo1, &hi1);				\
+  } else {							\
+    d1 = 1;							\
+    o1 = 0;							\
+    lo1 = 0;							\
+    hi1 = 1;							\
+  }								\
+  nc = (lo0 < hi0 && lo1 < hi1 ? 1 : 0);			\
+  for (k = 2; k < n; ++k) {					\
+    rgl_range(RGL_PERIODIC, n, k, dim_c, off_c,			\
+              first, last, &lo, &hi);				\
+    nc *= hi - lo;						\
+  }
+
+  RGL_PREPARE
+  if (nc <= 0) {
+    return 0.0;
+  }
 
   /* Loop over dimensions. */
   penalty = 0.0;
-  j = 0;
+  if (grd) {
+    RGL_ENGINE(BODY_2)
+    FINAL_2
+  } else {
+    RGL_ENGINE(BODY_1)
+    FINAL_1
+  }
+  return penalty;
+}
 
-#if (RGL_MAX_NDIMS >= 1)
-# undef LOOPS
-# define LOOPS LOOP(1)
-  CODE(1);
-#endif
+#ifdef RGL_HESSIAN
+static void RGL_HESSIAN_SWEEP(const double hyper[], const integer_t n,
+                              const integer_t dim_c[],
+                              const integer_t off_c[], const void* arr,
+                              const void* vec, void* out,
+                              const integer_t first, const integer_t last);
+
+int RGL_HESSIAN(const double hyper[],  /* hyper-parameters */
+                const integer_t ndims, /* number of dimensions */
+                const integer_t dim[], /* dimensions */
+                const integer_t noffs, /* number of offsets */
+                const integer_t off[], /* offsets */
+                const double wgt[],    /* weights (can be NULL) */
+                const real_t arr[],    /* model array */
+                const real_t vec[],    /* argument (NULL for the diagonal) */
+                real_t out[],          /* output array */
+                int nthreads)          /* number of threads */
+{
+  int status;
 
-#if (RGL_MAX_NDIMS >= 2)
-# undef LOOPS
-# define LOOPS LOOP(2) LOOP(1)
-  CODE(2);
-#endif
+  /* Check arguments. */
+  status = rgl_check(RGL_NHYPER, hyper, noffs, wgt);
+  if (status != 0) {
+    return (status < 0 ? status : 0);
+  }
+  if (ndims <= 0 || noffs <= 0 || dim == NULL || off == NULL ||
+      arr == NULL || out == NULL) {
+    return 0;
+  }
+  return (rgl_run(NULL, RGL_HESSIAN_SWEEP, RGL_PERIODIC, RGL_NHYPER, hyper,
+                  ndims, dim, noffs, off, wgt, arr, vec, out,
+                  nthreads) < 0.0 ? -12 : 0);
+}
 
-#if (RGL_MAX_NDIMS >= 3)
-# undef LOOPS
-# define LOOPS LOOP(3) LOOP(2) LOOP(1)
-  CODE(3);
+/* Add the diagonal of the majorant of the Hessian (if VEC is NULL) or its
+   product with VEC to OUT.  The sweep is done by the same engine as
+   RGL_SWEEP (whose macros are still defined).  W is the curvature of the
+   cost at the difference R between the elements of a pair. */
+static void RGL_HESSIAN_SWEEP(const double hyper[], const integer_t n,
+                              const integer_t dim_c[],
+                              const integer_t off_c[], const void* arr_,
+                              const void* vec_, void* out_,
+                              const integer_t first, const integer_t last)
+{
+  const real_t* arr = (const real_t*)arr_;
+  const real_t* vec = (const real_t*)vec_;
+  real_t* out = (real_t*)out_;
+#if (RGL_COST != RGL_COST_L2)
+  const double ONE = 1.0;
+  double q, r;
 #endif
+  double h, w;
+  integer_t d0, o0, lo0, hi0, mid0, d1, o1, lo1, hi1, i1, p1;
+  integer_t k, c, nc, rem, i, p, lo, hi, a, e, j, stride, base1, base2;
 
-#if (RGL_MAX_NDIMS >= 4)
-# undef LOOPS
-# define LOOPS LOOP(4) LOOP(3) LOOP(2) LOOP(1)
-  CODE(4);
-#endif
+#undef CURVATURE
+#undef DIAG
+#undef MULT
 
-#if (RGL_MAX_NDIMS >= 5)
-# undef LOOPS
-# define LOOPS LOOP(5) LOOP(4) LOOP(3) LOOP(2) LOOP(1)
-  CODE(5);
-#endif
+#if (RGL_COST == RGL_COST_L2)
+  /* The Hessian is constant, ARR is not used. */
+  (void)arr;
+  h = 2.0*hyper[0];
+# define CURVATURE(a1, a2)  w = h;
+#endif /* RGL_COST_L2 */
 
-#if (RGL_MAX_NDIMS >= 6)
-# undef LOOPS
-# define LOOPS LOOP(6) LOOP(5) LOOP(4) LOOP(3) LOOP(2) LOOP(1)
-  CODE(6);
-#endif
+#if (RGL_COST == RGL_COST_L2L1)
+  h = 2.0*hyper[0];
+  q = ONE/hyper[1];
+# define CURVATURE(a1, a2)  r = q*(arr[a2] - arr[a1]); \
+                            w = h/(ONE + fabs(r));
+#endif /* RGL_COST_L2L1 */
 
-#if (RGL_MAX_NDIMS >= 7)
-# undef LOOPS
-# define LOOPS LOOP(7) LOOP(6) LOOP(5) LOOP(4) LOOP(3) LOOP(2) LOOP(1)
-  CODE(7);
-#endif
+#if (RGL_COST == RGL_COST_L2L0)
+  h = 2.0*hyper[0];
+  q = ONE/hyper[1];
+# define CURVATURE(a1, a2)  r = q*(arr[a2] - arr[a1]); \
+                            w = (r ? h*atan(r)/(r*(ONE + r*r)) : h);
+#endif /* RGL_COST_L2L0 */
 
-#if (RGL_MAX_NDIMS >= 8)
-# undef LOOPS
-# define LOOPS LOOP(8) LOOP(7) LOOP(6) LOOP(5) LOOP(4) LOOP(3) LOOP(2) LOOP(1)
-  CODE(8);
-#endif
+#if (RGL_COST == RGL_COST_CAUCHY)
+  h = 2.0*hyper[0];
+  q = ONE/hyper[1];
+# define CURVATURE(a1, a2)  r = q*(arr[a2] - arr[a1]); \
+                            w = h/(ONE + r*r);
+#endif /* RGL_COST_CAUCHY */
 
-  return -11.0;
+#define DIAG(a1, a2)  CURVATURE(a1, a2) \
+                      out[a1] += w; \
+                      out[a2] += w;
+#define MULT(a1, a2)  CURVATURE(a1, a2) \
+                      w *= (vec[a2] - vec[a1]); \
+                      out[a2] += w; \
+                      out[a1] -= w;
+
+  RGL_PREPARE
+  if (nc <= 0) {
+    return;
+  }
+  if (vec != NULL) {
+    RGL_ENGINE(MULT)
+  } else {
+    RGL_ENGINE(DIAG)
+  }
 }
+#endif /* RGL_HESSIAN */
 
 #endif /* RGL_ROUGHNESS */
 
+/*---------------------------------------------------------------------------*/
+/* ISOTROPIC TOTAL VARIATION */
+
+#ifdef RGL_TV
+static double RGL_TV_SWEEP(const double hyper[], const integer_t rank,
+                           const integer_t dim[], const void* arr_,
+                           void* grd_, const integer_t first,
+                           const integer_t last);
+
+double RGL_TV(const double hyper[],  /* hyper-parameters */
+              const integer_t ndims, /* number of dimensions */
+              const integer_t dim[], /* dimensions */
+              const real_t arr[],    /* model array */
+              real_t grd[],          /* gradient (can be NULL) */
+              int nthreads)          /* number of threads */
+{
+  if (hyper == NULL || hyper[0] < 0.0) {
+    return -1.0;
+  }
+  if (hyper[1] <= 0.0) {
+    return -2.0;
+  }
+  if (ndims < 0 || (ndims > 0 && dim == NULL) || arr == NULL ||
+      hyper[0] == 0.0) {
+    return 0.0;
+  }
+  return rgl_tv_run(RGL_TV_SWEEP, hyper, ndims, dim, arr, grd, nthreads);
+}
+
+/*
+ * Each element X0[I] of a row along the 1st dimension is compared to its
+ * neighbor X0[J] along the 1st dimension and to the elements at the same
+ * position in the neighbor rows X1, X2 and X3 along the other dimensions.
+ * At the end of a non-periodic dimension, the neighbor is the element
+ * itself (the difference is zero and so is its contribution to the
+ * gradient).  Q is the derivative of the cost with respect to |D| divided
+ * by |D|.
+ */
+#undef RGL_TV_ELEM
+#if RGL_TV_HUBER
+# define RGL_TV_ELEM(RANK, GRAD, I, J)					\
+  a = x0[I];								\
+  d0 = x0[J] - a;							\
+  t = d0*d0;								\
+  if (RANK > 1) { d1 = x1[I] - a; t += d1*d1; }				\
+  if (RANK > 2) { d2 = x2[I] - a; t += d2*d2; }				\
+  if (RANK > 3) { d3 = x3[I] - a; t += d3*d3; }				\
+  if (t <= eps2) {							\
+    penalty += t*half_inv_eps;						\
+    q = mu_inv_eps;							\
+  } else {								\
+    u = sqrt(t);							\
+    penalty += u - half_eps;						\
+    q = mu/u;								\
+  }									\
+  if (GRAD) {								\
+    d0 *= q;								\
+    c = d0;								\
+    g0[J] += d0;							\
+    if (RANK > 1) { d1 *= q; c += d1; g1[I] += d1; }			\
+    if (RANK > 2) { d2 *= q; c += d2; g2[I] += d2; }			\
+    if (RANK > 3) { d3 *= q; c += d3; g3[I] += d3; }			\
+    g0[I] -= c;								\
+  }
+#else
+# define RGL_TV_ELEM(RANK, GRAD, I, J)					\
+  a = x0[I];								\
+  d0 = x0[J] - a;							\
+  t = d0*d0 + eps2;							\
+  if (RANK > 1) { d1 = x1[I] - a; t += d1*d1; }				\
+  if (RANK > 2) { d2 = x2[I] - a; t += d2*d2; }				\
+  if (RANK > 3) { d3 = x3[I] - a; t += d3*d3; }				\
+  u = sqrt(t);								\
+  penalty += u;								\
+  if (GRAD) {								\
+    q = mu/u;								\
+    d0 *= q;								\
+    c = d0;								\
+    g0[J] += d0;							\
+    if (RANK > 1) { d1 *= q; c += d1; g1[I] += d1; }			\
+    if (RANK > 2) { d2 *= q; c += d2; g2[I] += d2; }			\
+    if (RANK > 3) { d3 *= q; c += d3; g3[I] += d3; }			\
+    g0[I] -= c;								\
+  }
+#endif
+
+#undef RGL_TV_ROW
+#define RGL_TV_ROW(RANK, GRAD)						\
+  for (i0 = lo0; i0 < e0; ++i0) {					\
+    RGL_TV_ELEM(RANK, GRAD, i0, i0 + 1)					\
+  }									\
+  if (hi0 == n0) {							\
+    i0 = n0 - 1;							\
+    RGL_TV_ELEM(RANK, GRAD, i0, (RGL_PERIODIC ? 0 : i0))		\
+  }
+
+/* Neighbor index of I along a dimension of length N. */
+#undef RGL_TV_NEXT
+#define RGL_TV_NEXT(I, N) ((I) + 1 < (N) ? (I) + 1 : (RGL_PERIODIC ? 0 : (I)))
+
+static double RGL_TV_SWEEP(const double hyper[], const integer_t rank,
+                           const integer_t dim[], const void* arr_,
+                           void* grd_, const integer_t first,
+                           const integer_t last)
+{
+  const real_t* arr = (const real_t*)arr_;
+  real_t* grd = (real_t*)grd_;
+  const real_t* x0, *x1, *x2, *x3;
+  real_t* g0, *g1, *g2, *g3;
+  const double mu = hyper[0];
+  const double eps = hyper[1];
+  const double eps2 = eps*eps;
+#if RGL_TV_HUBER
+  const double half_eps = 0.5*eps;
+  const double half_inv_eps = 0.5/eps;
+  const double mu_inv_eps = mu/eps;
+#endif
+  double penalty, a, c, d0, d1, d2, d3, q, t, u;
+  integer_t n0, n1, n2, n3, i0, i1, i2, i3, j1, j2, j3;
+  integer_t lo0, hi0, e0, lo1, hi1, lo2, hi2, lo3, hi3;
+  integer_t o, o1, o2, o3;
+
+  n0 = dim[0];
+  n1 = dim[1];
+  n2 = dim[2];
+  n3 = dim[3];
+  lo0 = (rank == 1 ? first : 0);
+  hi0 = (rank == 1 ? last  : n0);
+  e0 = (hi0 < n0 ? hi0 : n0 - 1); /* end of the elements with a successor */
+  lo1 = (rank == 2 ? first : 0);
+  hi1 = (rank == 2 ? last  : n1);
+  lo2 = (rank == 3 ? first : 0);
+  hi2 = (rank == 3 ? last  : n2);
+  lo3 = (rank == 4 ? first : 0);
+  hi3 = (rank == 4 ? last  : n3);
+  x1 = x2 = x3 = NULL;
+  g0 = g1 = g2 = g3 = NULL;
+  d1 = d2 = d3 = 0.0;
+  penalty = 0.0;
+  for (i3 = lo3; i3 < hi3; ++i3) {
+    j3 = RGL_TV_NEXT(i3, n3);
+    for (i2 = lo2; i2 < hi2; ++i2) {
+      j2 = RGL_TV_NEXT(i2, n2);
+      for (i1 = lo1; i1 < hi1; ++i1) {
+        j1 = RGL_TV_NEXT(i1, n1);
+        o  = ((i3*n2 + i2)*n1 + i1)*n0;
+        o1 = ((i3*n2 + i2)*n1 + j1)*n0;
+        o2 = ((i3*n2 + j2)*n1 + i1)*n0;
+        o3 = ((j3*n2 + i2)*n1 + i1)*n0;
+        x0 = arr + o;
+        x1 = arr + o1;
+        x2 = arr + o2;
+        x3 = arr + o3;
+        if (grd) {
+          g0 = grd + o;
+          g1 = grd + o1;
+          g2 = grd + o2;
+          g3 = grd + o3;
+          switch (rank) {
+          case 1: RGL_TV_ROW(1, 1); break;
+          case 2: RGL_TV_ROW(2, 1); break;
+          case 3: RGL_TV_ROW(3, 1); break;
+          default: RGL_TV_ROW(4, 1);
+          }
+        } else {
+          switch (rank) {
+          case 1: RGL_TV_ROW(1, 0); break;
+          case 2: RGL_TV_ROW(2, 0); break;
+          case 3: RGL_TV_ROW(3, 0); break;
+          default: RGL_TV_ROW(4, 0);
+          }
+        }
+      }
+    }
+  }
+  return mu*penalty;
+}
+#endif /* RGL_TV */
+
 /*---------------------------------------------------------------------------*/
 /* CLEANUP */
 
@@ -759,5 +1954,14 @@ double RGL_ROUGHNESS(const double hyper[],  /* hyper-parameters */
 #undef RGL_COST
 #undef RGL_PERIODIC
 #undef RGL_ROUGHNESS
+#undef RGL_ROUGHNESS_MT
+#undef RGL_ROUGHNESS_MULTI
+#undef real_t
+#undef RGL_SWEEP
+#undef RGL_HESSIAN
+#undef RGL_HESSIAN_SWEEP
+#undef RGL_TV
+#undef RGL_TV_HUBER
+#undef RGL_TV_SWEEP
 
 #endif /* _RGL_CODE */
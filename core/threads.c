@@ -0,0 +1,94 @@
+/*
+ * threads.c -
+ *
+ * Run independent tasks on several threads.
+ *
+ *-----------------------------------------------------------------------------
+ *
+ * This file is part of Yeti (https://github.com/emmt/Yeti) released under the
+ * MIT "Expat" license.
+ *
+ * Copyright (C) 1996-2020: Éric Thiébaut.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#ifndef YETI_NO_THREADS
+# include <pthread.h>
+#endif
+
+#include "yeti-threads.h"
+
+int yeti_effective_threads(int nthreads, long number)
+{
+#ifdef YETI_NO_THREADS
+  return 1;
+#else
+  if (nthreads > YETI_MAX_THREADS) nthreads = YETI_MAX_THREADS;
+  if (nthreads > number) nthreads = number;
+  return (nthreads > 1 ? nthreads : 1);
+#endif
+}
+
+#ifdef YETI_NO_THREADS
+
+void yeti_run_tasks(yeti_task_t* task, void* data,
+                    long number, int nthreads)
+{
+  if (number > 0) task(data, 0, number, 0);
+}
+
+#else /* YETI_NO_THREADS not defined */
+
+typedef struct _chunk chunk_t;
+struct _chunk {
+  yeti_task_t* task;
+  void* data;
+  long first, last;
+  int rank;
+  int started;
+  pthread_t id;
+};
+
+static void* run_chunk(void* arg)
+{
+  chunk_t* c = (chunk_t*)arg;
+  c->task(c->data, c->first, c->last, c->rank);
+  return NULL;
+}
+
+void yeti_run_tasks(yeti_task_t* task, void* data,
+                    long number, int nthreads)
+{
+  if (number <= 0) return;
+  nthreads = yeti_effective_threads(nthreads, number);
+  if (nthreads <= 1) {
+    task(data, 0, number, 0);
+    return;
+  }
+  chunk_t chunk[YETI_MAX_THREADS];
+  for (int r = 0; r < nthreads; ++r) {
+    chunk_t* c = &chunk[r];
+    c->task = task;
+    c->data = data;
+    c->first = (number*r)/nthreads;
+    c->last = (number*(r + 1))/nthreads;
+    c->rank = r;
+    c->started = 0;
+  }
+  for (int r = 1; r < nthreads; ++r) {
+    chunk[r].started = (pthread_create(&chunk[r].id, NULL, run_chunk,
+                                       &chunk[r]) == 0);
+  }
+  run_chunk(&chunk[0]);
+  for (int r = 1; r < nthreads; ++r) {
+    if (chunk[r].started) {
+      pthread_join(chunk[r].id, NULL);
+    } else {
+      run_chunk(&chunk[r]);
+    }
+  }
+}
+
+#endif /* YETI_NO_THREADS */
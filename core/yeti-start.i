@@ -55,9 +55,17 @@ autoload, "yeti.i",
     morph_black_top_hat,
     morph_closing,
     morph_dilation,
+    morph_distance,
     morph_enhance,
     morph_erosion,
+    morph_fill_holes,
+    morph_hmax,
+    morph_minmax,
     morph_opening,
+    morph_reconstruct,
+    morph_regional_max,
+    morph_segmentation,
+    morph_toggle,
     morph_white_top_hat,
     mvect_create,
     mvect_collect,
@@ -102,5 +110,7 @@ autoload, "yeti.i",
     typemin,
     value_of_symlink,
     yeti_convolve,
+    yeti_gaussian,
     yeti_init,
-    yeti_wavelet;
+    yeti_wavelet,
+    yeti_wavelet_step;
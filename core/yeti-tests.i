@@ -270,10 +270,366 @@ func test_mixed_vectors(nil)
     test_eval, "dbg.nrefs == 1";
 }
 
+func test_convolve(nil)
+{
+    /* Check against explicit convolution in the interior. */
+    x = random(20);
+    k = [1.0, 2.0, 1.0]/4.0;
+    y = yeti_convolve(x, kernel=k);
+    test_assert, max(abs(y(2:-1) - (k(1)*x(1:-2) + k(2)*x(2:-1) +
+                                    k(3)*x(3:0)))) < 1e-15,
+        "bad yeti_convolve result in the interior";
+    test_assert, y(1) == (k(1) + k(2))*x(1) + k(3)*x(2),
+        "bad yeti_convolve result at the left border";
+
+    /* Input array must not be modified, temporary one may be. */
+    x0 = x;
+    y = yeti_convolve(x, which=1, count=2);
+    test_assert, allof(x == x0), "yeti_convolve modifies its input";
+    test_assert, allof(yeti_convolve(x0 + 0.0, which=1, count=2) == y),
+        "yeti_convolve gives different result for a temporary input";
+    test_assert, structof(yeti_convolve(indgen(5))) == float,
+        "yeti_convolve must yield a float array for integer input";
+
+    /* Complex convolution. */
+    z = random_n(16,9) + 1i*random_n(16,9);
+    y = yeti_convolve(z, scale=2, border=3);
+    test_assert, allof(y == (yeti_convolve(z.re, scale=2, border=3) +
+                             1i*yeti_convolve(z.im, scale=2, border=3))),
+        "bad complex yeti_convolve result";
+
+    /* Border conditions are tested with I = -1, ..., 4 for BORDER=I and
+       I = 5, 6 for MIRROR=I-4. */
+    a = random(37,23,11);
+    for (i = -1; i <= 6; ++i) {
+        border = (i <= 4 ? i : []);
+        mirror = (i <= 4 ? 0 : i - 4);
+        b = yeti_convolve(a, border=border, mirror=mirror);
+        c = yeti_convolve(a, border=border, mirror=mirror, nthreads=4);
+        test_assert, allof(b == c),
+            "yeti_convolve multi-threaded result differs (i=%d)", i;
+    }
+    test_assert, allof(yeti_convolve(a, border=5) ==
+                       yeti_convolve(a, border=-1)),
+        "yeti_convolve with border=5 is not normalized";
+
+    /* Mirror border conditions. */
+    x = random(9);
+    k = [1.0, 2.0, 3.0, 4.0, 5.0];
+    xm = grow(x(5:2:-1), x, x(-1:-4:-1));
+    xh = grow(x(4:1:-1), x, x(0:-3:-1));
+    for (scale = 1; scale <= 2; ++scale) {
+        ym = yh = 0.0;
+        for (j = -2; j <= 2; ++j) {
+            ym += k(j+3)*xm(5+j*scale:13+j*scale);
+            yh += k(j+3)*xh(5+j*scale:13+j*scale);
+        }
+        test_assert, max(abs(yeti_convolve(x, kernel=k, scale=scale,
+                                           mirror=1) - ym)) < 1e-13,
+            "bad yeti_convolve result with mirror=1 (scale=%d)", scale;
+        test_assert, max(abs(yeti_convolve(x, kernel=k, scale=scale,
+                                           mirror=2) - yh)) < 1e-13,
+            "bad yeti_convolve result with mirror=2 (scale=%d)", scale;
+    }
+
+    /* FFT and direct methods must give the same result. */
+    k = exp(-0.5*((indgen(61) - 31.0)/8.0)^2) + 0.1;
+    ndiff = 0;
+    for (i = -1; i <= 6; ++i) {
+        border = (i <= 4 ? i : []);
+        mirror = (i <= 4 ? 0 : i - 4);
+        for (scale = 1; scale <= 2; ++scale) {
+            b = yeti_convolve(a, kernel=k, scale=scale, border=border,
+                              mirror=mirror, fft=0);
+            c = yeti_convolve(a, kernel=k, scale=scale, border=border,
+                              mirror=mirror, fft=1, nthreads=2);
+            test_assert, max(abs(b - c)) <= 1e-13*max(abs(b)),
+                "yeti_convolve FFT result differs (i=%d, scale=%d)",
+                i, scale;
+            ndiff += anyof(b != c);
+        }
+    }
+    /* The two methods only agree up to rounding errors, identical results
+       in all cases would mean that the FFT method is never used. */
+    test_assert, ndiff > 0, "yeti_convolve FFT method not used with fft=1";
+
+    /* Wavelet transform: the scales must sum up to the input and must be
+       the same as the ones delivered to a callback. */
+    cube = yeti_wavelet(a, 3, border=2);
+    test_assert, structof(cube) == double && numberof(cube) == 4*numberof(a),
+        "bad yeti_wavelet result type or size";
+    test_assert, max(abs(cube(..,sum) - a)) < 1e-14,
+        "yeti_wavelet scales do not sum up to the input";
+    s = a + 0.0; /* private copy modified in-place */
+    t = yeti_convolve(s, border=2);
+    test_assert, allof(yeti_wavelet_step(s, 1, border=2) == a - t) &&
+        allof(s == t), "bad yeti_wavelet_step result";
+    extern _test_wavelet_cube;
+    _test_wavelet_cube = array(double, dimsof(cube));
+    yeti_wavelet, a, 3, border=2, callback=_test_wavelet_callback;
+    test_assert, allof(_test_wavelet_cube == cube),
+        "yeti_wavelet scales differ in streaming mode";
+    _test_wavelet_cube = [];
+
+    /* Recursive Gaussian filter: compare the impulse response with a
+       Gaussian of same FWHM and check that a constant is preserved. */
+    x = array(double, 201);
+    x(101) = 1.0;
+    sigma = 5.0;
+    y = yeti_gaussian(x, sigma*sqrt(8.0*log(2.0)), border=3);
+    g = exp(-0.5*((indgen(201) - 101.0)/sigma)^2)/(sqrt(2.0*pi)*sigma);
+    test_assert, max(abs(y - g)) < 0.02*max(g),
+        "bad yeti_gaussian impulse response";
+    test_assert, abs(sum(y*(indgen(201) - 101.0)^2) - sigma^2) < 1e-3,
+        "bad variance of yeti_gaussian impulse response";
+    for (i = -1; i <= 6; ++i) {
+        if (i == 1 || i == 2 || i == 3) continue;
+        border = (i <= 4 ? i : []);
+        mirror = (i <= 4 ? 0 : i - 4);
+        test_assert, max(abs(yeti_gaussian(array(3.0, 30, 20), 7.5,
+                                           border=border, mirror=mirror)
+                             - 3.0)) < 1e-10,
+            "yeti_gaussian does not preserve a constant (i=%d)", i;
+    }
+    for (i = -1; i <= 6; ++i) {
+        border = (i <= 4 ? i : []);
+        mirror = (i <= 4 ? 0 : i - 4);
+        b = yeti_gaussian(a, [3.0, 2.0], which=[1,3], border=border,
+                          mirror=mirror);
+        c = yeti_gaussian(a, [3.0, 2.0], which=[1,3], border=border,
+                          mirror=mirror, nthreads=3);
+        test_assert, allof(b == c),
+            "yeti_gaussian multi-threaded result differs (i=%d)", i;
+    }
+}
+
+func _test_wavelet_callback(plane, i)
+{
+    extern _test_wavelet_cube;
+    _test_wavelet_cube(..,i) = plane;
+}
+
+func test_morph(nil)
+{
+    /* Repeating an offset defeats the detection of boxes and lines, this is
+       used to compare the fast algorithms with the brute force one. */
+    a = char(random(23,17)*256);
+    dx = indgen(-1:1);
+    dy = indgen(-2:2);
+    r = [dx, dy(-,)];
+    s = _test_morph_repeat(r, [-1,-1]);
+    b = morph_dilation(a, r);
+    test_assert, allof(b == morph_dilation(a, s)),
+        "bad morph_dilation result for a box";
+    test_assert, allof(b == morph_dilation(a, box=[3,5])),
+        "bad morph_dilation result with BOX=[3,5]";
+    test_assert, allof(b == morph_dilation(a, box=[[-1,1],[-2,2]])),
+        "bad morph_dilation result with BOX=[[-1,1],[-2,2]]";
+    test_assert, allof(morph_erosion(a, r) == morph_erosion(a, s)),
+        "bad morph_erosion result for a box";
+
+    /* Box not containing the origin (some voxels have no neighbors). */
+    a = random(19,8,7);
+    dx = indgen(3:5);
+    dy = indgen(-9:-8);
+    dz = [0];
+    r = [dx, dy(-,), dz(-,-,)];
+    s = _test_morph_repeat(r, [4,-9,0]);
+    test_assert, allof(morph_erosion(a, r) == morph_erosion(a, s)),
+        "bad morph_erosion result for a shifted box";
+    test_assert, allof(morph_dilation(a, box=[[3,5],[-9,-8],[0,0]]) ==
+                       morph_dilation(a, s)),
+        "bad morph_dilation result for a shifted box";
+
+    /* Balls are decomposed in chords. */
+    r = 3;
+    x = indgen(-r:r);
+    y = x(-,);
+    z = x(-,-,);
+    i = where(x*x + y*y <= r*(r + 1));
+    s = _test_morph_repeat([(x + 0*y)(i), (y + 0*x)(i)], [0,0]);
+    b = random(31,27);
+    test_assert, allof(morph_dilation(b, r) == morph_dilation(b, s)),
+        "bad morph_dilation result for a disk";
+    test_assert, allof(morph_erosion(b, r) == morph_erosion(b, s)),
+        "bad morph_erosion result for a disk";
+    i = where(x*x + y*y + z*z <= r*(r + 1));
+    s = _test_morph_repeat([(x + 0*y + 0*z)(i), (0*x + y + 0*z)(i),
+                            (0*x + 0*y + z)(i)], [0,0,0]);
+    test_assert, allof(morph_erosion(a, r) == morph_erosion(a, s)),
+        "bad morph_erosion result for a ball";
+
+    /* Multi-threading. */
+    test_assert, allof(morph_dilation(a, 2) == morph_dilation(a, 2, nthreads=3)),
+        "morph_dilation multi-threaded result differs for a ball";
+    test_assert, allof(morph_erosion(a, s) == morph_erosion(a, s, nthreads=4)),
+        "morph_erosion multi-threaded result differs";
+    test_assert, allof(morph_erosion(a, box=[3,5,2]) ==
+                       morph_erosion(a, box=[3,5,2], nthreads=2)),
+        "morph_erosion multi-threaded result differs for a box";
+    c = random(150,40);
+    test_assert, allof(morph_dilation(c, box=[1,7]) ==
+                       morph_dilation(c, box=[1,7], nthreads=4)),
+        "morph_dilation multi-threaded result differs along last dimension";
+
+    /* Oblique line. */
+    k = indgen(-2:4);
+    r = [k, -k, k];
+    s = _test_morph_repeat(r, [0,0,0]);
+    test_assert, allof(morph_dilation(a, r) == morph_dilation(a, s)),
+        "bad morph_dilation result for an oblique line";
+
+    /* Fused local minimum and maximum. */
+    b = char(random(25,19)*256);
+    for (j = 1; j <= 2; ++j) {
+        r = (j == 1 ? 2 : _test_morph_repeat([dx, dy(-,)], [0,0]));
+        amin = morph_erosion(b, r);
+        amax = morph_dilation(b, r);
+        amm = morph_minmax(b, r, nthreads=2);
+        test_assert, (allof(amm(..,1) == amin) && allof(amm(..,2) == amax)),
+            "bad morph_minmax result";
+        test = ((b - amin) >= (amax - b));
+        test_assert, allof(morph_toggle(b, r) == merge2(amax, amin, test)),
+            "bad morph_toggle result";
+    }
+    r = 3;
+    s = 1;
+    test_assert, allof(morph_white_top_hat(b, r) ==
+                       b - morph_opening(b, r)),
+        "bad morph_white_top_hat result";
+    test_assert, allof(morph_black_top_hat(a, r, s, nthreads=2) ==
+                       morph_closing(morph_opening(a, s), r)
+                       - morph_opening(a, s)),
+        "bad morph_black_top_hat result";
+    test_assert, allof(morph_opening(b, box=[3,5], nthreads=2) ==
+                       morph_dilation(morph_erosion(b, box=[3,5]), box=[3,5])),
+        "bad morph_opening result with a box";
+    test_assert, allof(morph_closing(b, box=[3,5]) ==
+                       morph_closing(b, [indgen(-1:1), indgen(-2:2)(-,)])),
+        "bad morph_closing result with a box";
+    test_assert, structof(morph_white_top_hat(b, r, s)) == int,
+        "bad morph_white_top_hat result type";
+
+    /* Connected regions. */
+    img = [[1,1,0,2], [0,1,0,2], [3,0,0,2]];
+    lab = morph_segmentation(img, stats);
+    test_assert, allof(lab == [[1,1,2,3], [4,1,2,3], [5,2,2,3]]),
+        "bad morph_segmentation result";
+    test_assert, allof(stats == [[3,1,2,1,2], [4,2,3,1,3], [3,4,4,1,3],
+                                 [1,1,1,2,2], [1,1,1,3,3]]),
+        "bad morph_segmentation statistics";
+    lab = morph_segmentation(float(img), connectivity=8);
+    test_assert, allof(lab == [[1,1,2,3], [2,1,2,3], [4,2,2,3]]),
+        "bad morph_segmentation result with CONNECTIVITY=8";
+    img = char(random(31,23,9)*3);
+    lab = morph_segmentation(img, stats, connectivity=26);
+    test_assert, (allof(lab == morph_segmentation(img, connectivity=26,
+                                                  nthreads=3)) &&
+                  allof(stats(1,) == histogram(lab(*)))),
+        "bad multi-threaded morph_segmentation result";
+
+    /* Grayscale reconstruction. */
+    r = [[0,-1,0,1,0], [-1,0,0,0,1]];
+    b = random(20,15);
+    c = b*random(20,15);
+    j = min(c, b);
+    do {
+        k = j;
+        j = min(morph_dilation(j, r), b);
+    } while (anyof(j != k));
+    test_assert, allof(morph_reconstruct(c, b) == j),
+        "bad morph_reconstruct result";
+    test_assert, allof(morph_hmax(b, 0.3) == morph_reconstruct(b - 0.3, b)),
+        "bad morph_hmax result";
+    i = long(floor(20*b)) - 10;
+    test_assert, allof(morph_hmax(i, 1.5) == morph_hmax(i, 2)),
+        "bad morph_hmax result for integers and a non-integer height";
+    test_assert, allof(morph_regional_max([[0,1,0], [0,0,0], [2,2,0]]) ==
+                       [[0,1,0], [0,0,0], [1,1,0]]),
+        "bad morph_regional_max result";
+    img = char([[1,1,1,0], [1,0,1,0], [1,1,1,0], [0,0,0,0]]);
+    c = img;
+    c(2,2) = 1;
+    test_assert, allof(morph_fill_holes(img) == c),
+        "bad morph_fill_holes result";
+    test_assert, allof(morph_fill_holes(char([1,0,1,0,0,1,1,0])) ==
+                       [1,1,1,1,1,1,1,0]),
+        "bad morph_fill_holes result for a 1-D array";
+    test_assert, allof(morph_fill_holes(img(,,-)) == c),
+        "bad morph_fill_holes result for a 4x4x1 array";
+
+    /* Euclidean distance transform. */
+    img = (random(13,11) > 0.2);
+    w = where(! img);
+    x = indgen(13);
+    y = indgen(11)(-,);
+    d = sqrt(((x - ((w - 1)%13 + 1)(-,-,))^2 +
+              (2.0*(y - ((w - 1)/13 + 1)(-,-,)))^2)(,,min));
+    dst = morph_distance(img, idx, scale=[1,2], nthreads=2);
+    test_assert, allof(abs(dst - d) <= 1e-12*d),
+        "bad morph_distance result";
+    test_assert, allof(img(idx) == 0),
+        "bad morph_distance indices";
+
+    /* Binary masks are packed in words, compare with an array of ints. */
+    img = char(random(150,37) > 0.6);
+    r = [[-70,0,0,1,2,3], [0,-1,0,0,0,1]];
+    for (j = 1; j <= 3; ++j) {
+        if (j == 3) r = 4;
+        test_assert, (allof(morph_dilation(img, r) == morph_dilation(2*img, r)/2)
+                      && allof(morph_erosion(img, r, nthreads=2) ==
+                               morph_erosion(2*img, r)/2)),
+            "bad morph_dilation/morph_erosion result for a binary mask";
+        r = [[-2,-1,0,1,2], [0,0,0,0,0]];
+    }
+    test_assert, allof(morph_dilation(img, box=[[-3,-1],[1,2]]) ==
+                       morph_dilation(2*img, box=[[-3,-1],[1,2]])/2),
+        "bad morph_dilation result for a binary mask and a shifted box";
+    b = morph_minmax(img, r, nthreads=2);
+    test_assert, (structof(b) == char && allof(dimsof(b) == [3,150,37,2]) &&
+                  allof(b(..,1) == morph_erosion(2*img, r)/2) &&
+                  allof(b(..,2) == morph_dilation(2*img, r)/2)),
+        "bad morph_minmax result for a binary mask";
+    test_assert, allof(morph_toggle(img, r) == morph_toggle(2*img, r)/2),
+        "bad morph_toggle result for a binary mask";
+    m = array(char, 7);
+    m(4) = 1;
+    test_assert, (allof(morph_dilation(m, 1) == [0,0,1,1,1,0,0]) &&
+                  allof(morph_erosion(morph_dilation(m, 1), 1) == m)),
+        "bad morph_dilation/morph_erosion values for a binary mask";
+
+    /* More than 3 dimensions, the 2nd and 3rd ones are folded. */
+    a = random(9,5,4,6);
+    r = _test_morph_repeat(transpose([[-1,0,0,2], [0,0,0,-1], [1,0,0,0]]),
+                           [0,0,0,0]);
+    s = _test_morph_repeat(transpose([[-1,2], [0,-1], [1,0]]), [0,0]);
+    b = morph_erosion(a, r, nthreads=2);
+    c = morph_dilation(a, box=[3,1,1,3]);
+    flag = 1n;
+    for (k = 1; k <= 4; ++k) {
+        for (j = 1; j <= 5; ++j) {
+            flag &= (allof(b(,j,k,) == morph_erosion(a(,j,k,), s)) &&
+                     allof(c(,j,k,) == morph_dilation(a(,j,k,), box=[3,3])));
+        }
+    }
+    test_assert, flag, "bad morpho-math result for a 4-D array";
+    test_assert, allof(morph_dilation(a, box=[3,3,2,3]) ==
+                       morph_dilation(morph_dilation(c, box=[1,3,1,1]),
+                                      box=[1,1,2,1])),
+        "bad morph_dilation result for a 4-D box";
+}
+
+func _test_morph_repeat(r, o)
+{
+    return transpose(grow(transpose(r(*,)), o(,-)));
+}
+
 if (batch()) {
     test_tuples;
     test_types;
     test_mixed_vectors;
     test_quick_quartile;
+    test_convolve;
+    test_morph;
     test_summary;
 }
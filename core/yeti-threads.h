@@ -0,0 +1,52 @@
+/*
+ * yeti-threads.h -
+ *
+ * Definitions for running independent tasks on several threads.
+ *
+ *-----------------------------------------------------------------------------
+ *
+ * This file is part of Yeti (https://github.com/emmt/Yeti) released under the
+ * MIT "Expat" license.
+ *
+ * Copyright (C) 1996-2020: Éric Thiébaut.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+#ifndef _YETI_THREADS_H
+#define _YETI_THREADS_H 1
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of worker threads. */
+#define YETI_MAX_THREADS 256
+
+typedef void yeti_task_t(void* data, long first, long last, int rank);
+/*----- Prototype of a task to run in parallel.  DATA is the client data,
+        FIRST and LAST (exclusive) are the bounds of the range of indices to
+        process and RANK (in the range [0,NTHREADS-1]) is the index of the
+        worker, it can be used to select a private workspace.  A task must not
+        call Yorick API and must not throw errors. */
+
+extern void yeti_run_tasks(yeti_task_t* task, void* data,
+                           long number, int nthreads);
+/*----- Split the range [0,NUMBER-1] in at most NTHREADS contiguous chunks of
+        (almost) equal sizes and apply TASK on each chunk in a separate
+        thread.  The calling thread processes the first chunk and waits for
+        the others to complete.  If a thread cannot be started, its chunk is
+        processed by the calling thread so that the result does not depend on
+        the number of threads actually used.  If NTHREADS <= 1 or if Yeti has
+        been compiled with YETI_NO_THREADS defined, TASK is applied to the
+        whole range by the calling thread. */
+
+extern int yeti_effective_threads(int nthreads, long number);
+/*----- Return the number of threads that would be used by yeti_run_tasks
+        for NUMBER indices and at most NTHREADS threads. */
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* _YETI_THREADS_H */
@@ -1341,16 +1341,23 @@ if (! batch() && SAVE_BUILTINS && ! is_hash(__h_saved_builtins)) {
 extern morph_dilation;
 extern morph_erosion;
 /* DOCUMENT morph_dilation(a, r);
+         or morph_dilation(a, box=b);
          or morph_erosion(a, r);
+         or morph_erosion(a, box=b);
 
      These functions perform a dilation/erosion morpho-math operation onto
-     input array A which must have at most 3 dimensions.  A dilation (erosion)
-     operation replaces every voxel of A by the maximum (minimum) value found
+     input array A which may have any number of dimensions.  A dilation
+     (erosion) operation replaces every voxel of A by the maximum (minimum) value found
      in the voxel neighborhood as defined by the structuring element. Argument
      R defines the structuring element as follows:
 
       - If R is a scalar integer, then it is taken as the radius (in voxels)
-        of the structuring element.
+        of the structuring element which is a ball made of the offsets
+        (DX,DY,DZ) such that DX^2 + DY^2 + DZ^2 <= R*(R + 1).  For a 2-D or
+        a 3-D array, the ball is decomposed in chords along the first
+        dimension, which are applied by the van Herk/Gil-Werman algorithm
+        (see below).  The cost per voxel grows as R for a 2-D array and as
+        R^2 for a 3-D array.
 
       - Otherwise, R gives the offsets of the structuring element relative to
         the coordinates of the voxel of interest.  In that case, R must an
@@ -1376,31 +1383,70 @@ extern morph_erosion;
            dy = indgen(-2:2);
            result =  morph_dilation(img, [dx, dy(-,)])
 
+     Keyword BOX may be specified instead of R to use a rectangular
+     structuring element.  BOX is either the size of the box (a scalar for
+     all dimensions or one value per dimension of A) or a 2-by-NDIMS array
+     of integers giving the minimum and maximum offsets along each dimension
+     of A.  A box of odd size is centered at the voxel of interest, a box of
+     even size extends one voxel further toward the lower coordinates.  The
+     above example is thus the same as:
+
+           result =  morph_dilation(img, box=[3,5])
+           result =  morph_dilation(img, box=[[-1,1],[-2,2]])
+
+     When the structuring element is a box (possibly given by R) or a line
+     segment whose direction has all its components equal to -1, 0 or +1,
+     the operation is computed by separable passes of the van Herk/Gil-Werman
+     algorithm whose cost, about 3 comparisons per voxel and per pass, does
+     not depend on the size of the structuring element.  Lines along the
+     dimensions are boxes of width 1 in the other dimensions.
+
+     Voxels whose neighborhood is entirely outside the array are set to
+     zero.
+
+     The consecutive dimensions of A along which the structuring element has
+     no extent are folded together.  For instance, the dilation of a
+     4-D array by a structuring element which only extends along the 1st
+     and 4th dimensions is computed as for a 3-D array whose 2nd dimension
+     is the product of the 2nd and 3rd dimensions of A.  The operation on
+     the whole array is thus done in a single pass whatever its number of
+     dimensions.
+
+     Binary masks (arrays of type char whose values are all 0 or 1) are
+     packed in words of 64 bits and the result is computed by bitwise
+     operations on the shifted rows, which is much faster.  The result is
+     the same as for any other array.
+
+     Keyword NTHREADS may be set with the maximum number of threads to use
+     (default is 1).  The rows of the result (or the lines of the van
+     Herk/Gil-Werman passes) are distributed among the threads.  The result
+     does not depend on the number of threads.
 
    SEE ALSO: morph_closing, morph_opening, morph_white_top_hat,
              morph_black_top_hat, morph_enhance.
  */
 
-func morph_closing(a, r)
-{ return morph_erosion(morph_dilation(a, r), r); }
-func morph_opening(a, r)
-{ return morph_dilation(morph_erosion(a, r), r); }
+func morph_closing(a, r, box=, nthreads=)
+{ return morph_erosion(morph_dilation(a, r, box=box, nthreads=nthreads), r,
+                       box=box, nthreads=nthreads); }
+func morph_opening(a, r, box=, nthreads=)
+{ return morph_dilation(morph_erosion(a, r, box=box, nthreads=nthreads), r,
+                        box=box, nthreads=nthreads); }
 /* DOCUMENT morph_closing(a, r);
+         or morph_closing(a, box=b);
          or morph_opening(a, r);
+         or morph_opening(a, box=b);
      Perform an image closing/opening of A by a structuring element R.  A
      closing is a dilation followed by an erosion, whereas an opening is an
-     erosion followed by a dilation.  See morph_dilation for the meaning of
-     the arguments.
+     erosion followed by a dilation.  Keyword BOX may be used instead of R
+     to specify a box-shaped structuring element.  See morph_dilation for
+     the meaning of the arguments and of keywords BOX and NTHREADS.
 
    SEE ALSO: morph_dilation, morph_white_top_hat,
              morph_black_top_hat. */
 
-func morph_white_top_hat(a, r, s) {
-  if (! is_void(s)) a = morph_closing(a, s);
-  return a - morph_opening(a, r); }
-func morph_black_top_hat(a, r, s) {
-  if (! is_void(s)) a = morph_opening(a, s);
-  return morph_closing(a, r) - a; }
+extern morph_white_top_hat;
+extern morph_black_top_hat;
 /* DOCUMENT morph_white_top_hat(a, r);
          or morph_white_top_hat(a, r, s);
          or morph_black_top_hat(a, r);
@@ -1416,10 +1462,178 @@ func morph_black_top_hat(a, r, s) {
 
      may be used to detect text or lines in a bimap image.
 
+     The white top-hat is A - morph_opening(A, R) and the black top-hat is
+     morph_closing(A, R) - A, where A has been previously smoothed by
+     morph_closing(A, S) or morph_opening(A, S) respectively if S is
+     specified.  The intermediate results are not returned to Yorick and
+     the difference is directly stored into the result which has the same
+     type as the difference of two arrays of A's type in Yorick (that is
+     int if A is of type char or short).
+
+     Keyword BOX may be used instead of R to specify a box-shaped
+     structuring element and keyword NTHREADS is the maximum number of
+     threads to use (see morph_dilation).
+
 
    SEE ALSO: morph_dilation, morph_closing, morph_enhance. */
 
-func morph_enhance(a, r, s)
+extern morph_minmax;
+/* DOCUMENT morph_minmax(a, r);
+         or morph_minmax(a, box=b);
+     Compute the local minimum and the local maximum of array A in a
+     neighborhood defined by the structuring element R (or by the box B).
+     The result has an extra trailing dimension of length 2 and is such
+     that:
+
+       amm = morph_minmax(a, r);
+       amm(..,1) == morph_erosion(a, r);
+       amm(..,2) == morph_dilation(a, r);
+
+     The two extrema are computed in a single sweep over the neighborhood
+     which is faster than calling morph_erosion and morph_dilation in turn.
+     See morph_dilation for the meaning of the arguments and of keywords
+     BOX and NTHREADS.
+
+
+   SEE ALSO: morph_dilation, morph_erosion, morph_toggle.
+ */
+
+extern morph_toggle;
+/* DOCUMENT morph_toggle(a, r);
+         or morph_toggle(a, box=b);
+     Apply the toggle filter of Kramer & Bruckner to array A: each element of
+     A is replaced by the closest of the local minimum or of the local
+     maximum (the maximum in case of a tie) in a neighborhood defined by the
+     structuring element R (or by the box B).  This is the same as
+     morph_enhance(A, R) but the local extrema are computed in a single sweep
+     and never returned to Yorick.  See morph_dilation for the meaning of the
+     arguments and of keywords BOX and NTHREADS.
+
+
+   SEE ALSO: morph_enhance, morph_minmax.
+ */
+
+extern morph_segmentation;
+/* DOCUMENT lab = morph_segmentation(img);
+         or lab = morph_segmentation(img, stats);
+     Label the connected regions of array IMG, a region being a set of
+     connected elements with the same value.  IMG must be a 1-D, 2-D or 3-D
+     array of non-complex numerical type.  The result is an array of longs
+     with the same dimensions as IMG and whose values are the region
+     numbers.  The regions are numbered from 1 to N in the storage order of
+     their first element.
+
+     If optional argument STATS is specified, it must be a simple variable
+     reference used to store the statistics of the regions as an array of
+     longs of dimensions 1 + 2*NDIMS by N (with NDIMS the number of
+     dimensions of IMG) such that STATS(1,K) is the number of elements in the
+     K-th region and STATS(2*J,K) and STATS(2*J+1,K) are the minimum and
+     maximum indices of the elements of the region along the J-th dimension.
+     That is, STATS = [COUNT, XMIN, XMAX, YMIN, YMAX, ZMIN, ZMAX] for a 3-D
+     array.
+
+     Keyword CONNECTIVITY specifies which elements are connected: 2 for a
+     1-D array; 4 (elements sharing an edge) or 8 (elements sharing a
+     vertex) for a 2-D array; 6 (elements sharing a face), 18 (elements
+     sharing an edge) or 26 (elements sharing a vertex) for a 3-D array.  By
+     default, only the elements sharing an edge in 2-D or a face in 3-D are
+     connected.
+
+     Keyword NTHREADS may be set with the maximum number of threads to use
+     (default is 1).  The array is split in slabs which are labeled in
+     parallel before merging the regions across the seams.  The result does
+     not depend on the number of threads.
+
+
+   SEE ALSO: morph_dilation, morph_reconstruct, histogram.
+ */
+
+extern morph_reconstruct;
+/* DOCUMENT morph_reconstruct(marker, mask);
+     Perform the grayscale reconstruction by dilation of array MARKER under
+     array MASK, that is the limit of the iterations:
+
+       marker = min(morph_dilation(marker, r), mask);
+
+     where R is the elementary structuring element (see keyword
+     CONNECTIVITY) until stability.  If keyword DUAL is true, the
+     reconstruction by erosion is computed instead (max and morph_erosion
+     replacing min and morph_dilation).  MARKER and MASK must have the same
+     dimensions and are converted to their promoted type which is the type
+     of the result.
+
+     The result is computed by the hybrid algorithm of L. Vincent (raster
+     and anti-raster scans followed by the propagation of the values
+     through a queue) whose cost is nearly linear in the number of
+     elements.
+
+     Keyword CONNECTIVITY specifies which elements are neighbors, see
+     morph_segmentation.
+
+
+   SEE ALSO: morph_dilation, morph_hmax, morph_regional_max,
+             morph_fill_holes, morph_segmentation.
+ */
+
+extern morph_hmax;
+extern morph_regional_max;
+extern morph_fill_holes;
+/* DOCUMENT morph_hmax(a, h);
+         or morph_regional_max(a);
+         or morph_fill_holes(a);
+     The function morph_hmax() returns the h-maxima transform of array A,
+     that is the reconstruction by dilation of A - H under A, which
+     suppresses the maxima of A whose height is smaller than H >= 0.  The
+     result has the same type as A (for integer types, A - H is rounded
+     down and saturated).
+
+     The function morph_regional_max() returns an array of ints with the same
+     dimensions as A and set to 1 where A has a regional maximum (a
+     connected set of elements with the same value whose neighbors all have
+     a smaller value) and to 0 elsewhere.
+
+     The function morph_fill_holes() fills the holes of A, that is the
+     regional minima not connected to the border of the array.  The result
+     is the reconstruction by erosion under A of the marker equal to A on
+     the border of the array and to the largest possible value elsewhere.
+     For a mask of 0 and 1, the regions of 0 surrounded by 1 are set to 1.
+
+     Keyword CONNECTIVITY specifies which elements are neighbors, see
+     morph_segmentation.
+
+
+   SEE ALSO: morph_reconstruct, morph_segmentation.
+ */
+
+extern morph_distance;
+/* DOCUMENT dst = morph_distance(a);
+         or dst = morph_distance(a, idx);
+     Compute the exact Euclidean distance transform of the 1-D, 2-D or 3-D
+     array A, that is the distance of every element of A to the nearest
+     element of A equal to zero (the features).  The result is an array of
+     doubles with the same dimensions as A, it is zero for the features and
+     infinite everywhere if A has no features.
+
+     If optional argument IDX is specified, it must be a simple variable
+     reference used to store an array of longs with the same dimensions as
+     A and set with the index of the nearest feature of each element (0 if
+     there are no features), so that A(IDX) is zero.
+
+     Keyword SCALE may be set with the size of the elements along every
+     dimension of A (a scalar or a vector of NDIMS values) to compute
+     distances for anisotropic sampling.  The default is 1.
+
+     The transform is separable and computed by the algorithm of
+     Felzenszwalb & Huttenlocher in O(N) operations for N elements.
+     Keyword NTHREADS may be set with the maximum number of threads to use
+     (default is 1), the lines of every pass are distributed among the
+     threads.
+
+
+   SEE ALSO: morph_erosion, morph_segmentation.
+ */
+
+func morph_enhance(a, r, s, nthreads=)
 /* DOCUMENT morph_enhance(a, r);
          or morph_enhance(a, r, s);
 
@@ -1441,6 +1655,9 @@ func morph_enhance(a, r, s)
      The morph_enhance() may be iterated to achieve deblurring of the input
      array A (hundreds of iterations may be required).
 
+     Keyword NTHREADS is passed to the morpho-math operators (see
+     morph_dilation).
+
 
   REFERENCES
      [1] H.P. Kramer & J.B. Bruckner, "iterations of a nonlinear
@@ -1448,11 +1665,12 @@ func morph_enhance(a, r, s)
          Recognition, vol. 7, pp. 53-58, 1975.
 
 
-  SEE ALSO: morph_erosion, morph_dilation.
+  SEE ALSO: morph_erosion, morph_dilation, morph_minmax, morph_toggle.
  */
 {
   if (is_void(s)) {
-    s = -1.0; /* special value */
+    /* Toggle filter. */
+    return morph_toggle(a, r, nthreads=nthreads);
   } else if (s < 0.0) {
     error, "S must be non-negative";
   } else {
@@ -1467,14 +1685,10 @@ func morph_enhance(a, r, s)
   }
 
   /* Compute the local minima and maxima. */
-  amin = morph_erosion(a, r);
-  amax = morph_dilation(a, r);
-
-  /* Staircase remapping of values. */
-  if (s < 0.0) {
-    test = ((a - amin) >= (amax - a));
-    return merge(amax(where(test)), amin(where(! test)), test);
-  }
+  amm = morph_minmax(a, r, nthreads=nthreads);
+  amin = amm(..,1);
+  amax = amm(..,2);
+  amm = [];
 
   /* Remapping of values with a sigmoid. */
   test = ((amin < a)&(a < amax)); // values that need to change
@@ -1599,6 +1813,7 @@ extern rgl_roughness_cauchy;
 extern rgl_roughness_cauchy_periodic;
 /* DOCUMENT err = rgl_roughness_SUFFIX(hyper, offset, arr);
          or err = rgl_roughness_SUFFIX(hyper, offset, arr, grd);
+         or err = rgl_roughness_SUFFIX(..., nthreads=n, weight=w);
 
      Compute regularization penalty based on the roughness of array ARR.
      SUFFIX indicates the type of cost function and the boundary condition
@@ -1612,6 +1827,15 @@ extern rgl_roughness_cauchy_periodic;
 
         ERR = sum_k  COST(ARR(k + OFFSET) - ARR(k))
 
+     OFFSET may also be a matrix whose columns are different offsets, then
+     the result is the sum of the penalties for each offset (hence a 1-by-N
+     matrix must be used to specify N offsets for a 1-D array).  Keyword
+     WEIGHT may be set with a vector of nonnegative weights, one per offset,
+     multiplying the weight of the regularization MU (see below).  All the
+     offsets are evaluated in a single pass over blocks of ARR and of the
+     gradient, which is faster than calling rgl_roughness_SUFFIX for each
+     offset.
+
      The following penalties are implemented:
 
         rgl_roughness_l1		L1 norm
@@ -1654,7 +1878,15 @@ extern rgl_roughness_cauchy_periodic;
      (convertible to real type) with same dimension list as ARR.  In the first
      case, a new array is created to store the gradient; in the second case,
      the contents of GRD is augmented by the gradient (and GRD is converted to
-     "double" if it is not yet the case).
+     "double" if it is not yet the case).  If ARR is a single precision
+     array and GRD is omitted, empty or a single precision array, the
+     computations are carried out in single precision (the penalty being
+     accumulated in double precision) without converting ARR and GRD.
+
+     Keyword NTHREADS (1 by default) is the maximum number of threads to use.
+     The work is split into blocks which do not depend on the number of
+     threads, hence the result is exactly the same whatever the number of
+     threads.
 
 
    EXAMPLES
@@ -1669,6 +1901,11 @@ extern rgl_roughness_cauchy_periodic;
               rgl(0.5*mu, [-1, 1], a, g) +
               rgl(0.5*mu, [ 1, 1], a, g));
 
+     or, in a single call:
+
+         f = rgl(mu, [[1, 0], [0, 1], [-1, 1], [1, 1]], a, g,
+                 weight=[1, 1, 0.5, 0.5]);
+
      To compute anisotropic roughness along first and third dimensions of A:
 
          g = array(double, dimsof(a)); // to store the gradient
@@ -1682,7 +1919,84 @@ extern rgl_roughness_cauchy_periodic;
 
 
    SEE ALSO
-     cost_l2.
+     cost_l2, rgl_tv, rgl_roughness_l2_hessian.
+ */
+
+extern rgl_roughness_l2_hessian;
+extern rgl_roughness_l2_periodic_hessian;
+extern rgl_roughness_l2l1_hessian;
+extern rgl_roughness_l2l1_periodic_hessian;
+extern rgl_roughness_l2l0_hessian;
+extern rgl_roughness_l2l0_periodic_hessian;
+extern rgl_roughness_cauchy_hessian;
+extern rgl_roughness_cauchy_periodic_hessian;
+/* DOCUMENT d = rgl_roughness_SUFFIX_hessian(hyper, offset, arr);
+         or hv = rgl_roughness_SUFFIX_hessian(hyper, offset, arr, vec);
+         or ... = rgl_roughness_SUFFIX_hessian(..., nthreads=n, weight=w);
+
+     Compute the curvature at ARR of the roughness penalty computed by
+     rgl_roughness_SUFFIX with the same arguments HYPER, OFFSET, NTHREADS
+     and WEIGHT (SUFFIX is one of l2, l2_periodic, l2l1, l2l1_periodic,
+     l2l0, l2l0_periodic, cauchy or cauchy_periodic).  With 3 arguments,
+     the result D is the diagonal of the Hessian H; with argument VEC (an
+     array with the same dimensions as ARR), the result HV is the product
+     H.VEC.  The operator H is never stored.
+
+     For the L2 cost, H is the exact Hessian of the penalty (and does not
+     depend on ARR).  For the other costs, H is the Hessian of the
+     quadratic which majorizes the penalty and has the same value and
+     gradient at ARR: each pair of elements with difference X is weighted by
+     COST'(X)/X instead of COST''(X).  H is therefore positive semi-definite
+     and suitable for preconditioning (e.g. with 1/(D + TAU) for some small
+     TAU > 0) or for majorization-minimization methods.  Note that H(ARR).ARR
+     is the gradient of the penalty at ARR.
+
+     Single precision is used if ARR and VEC (if any) are float arrays.
+
+
+   SEE ALSO
+     rgl_roughness_l2.
+ */
+
+extern rgl_tv;
+extern rgl_tv_periodic;
+extern rgl_tv_huber;
+extern rgl_tv_huber_periodic;
+/* DOCUMENT err = rgl_tv(hyper, arr);
+         or err = rgl_tv(hyper, arr, grd);
+         or err = rgl_tv(..., nthreads=n);
+
+     Compute the isotropic total variation (TV) of array ARR which may have
+     up to 4 dimensions (not counting trailing dimensions of length 1):
+
+        ERR = MU*sum(sqrt(DX^2 + DY^2 + DZ^2 + DT^2 + EPS^2))
+
+     where DX, DY, DZ and DT are the forward differences along the
+     dimensions of ARR (DX(i,j,...) = ARR(i+1,j,...) - ARR(i,j,...), and so
+     on), MU = HYPER(1) >= 0 is the weight of the regularization and EPS =
+     HYPER(2) > 0 is a small threshold to make the cost differentiable.
+     rgl_tv_huber computes the Huber-TV which is quadratic for small
+     gradient norms:
+
+        COST(T) = MU*T^2/(2*EPS)    if T <= EPS
+                = MU*(T - EPS/2)    otherwise
+
+     with T = sqrt(DX^2 + DY^2 + DZ^2 + DT^2).  In rgl_tv and rgl_tv_huber,
+     the differences are zero at the end of the dimensions; in
+     rgl_tv_periodic and rgl_tv_huber_periodic, the boundary conditions are
+     periodic.
+
+     Optional argument GRD is used as in rgl_roughness_l2 to add the
+     gradient of the penalty.  The penalty and its gradient are computed in
+     a single pass over ARR; if ARR and GRD are single precision arrays, the
+     computations are done without converting them (the differences being
+     computed in double precision).  Keyword NTHREADS (1 by default) is the
+     maximum number of threads to use, the result does not depend on the
+     number of threads.
+
+
+   SEE ALSO
+     rgl_roughness_l2.
  */
 
 /*---------------------------------------------------------------------------*/
@@ -1700,7 +2014,34 @@ extern __yeti_convolve_d;
                           int n, int nafter, double array ker, int w,
                           int scale, int border, double array ws); */
 
-func yeti_convolve(a, which=, kernel=, scale=, border=, count=)
+extern __yeti_convolve_mt_f;
+/* PROTOTYPE
+     void yeti_convolve_mt_f(float array dst, float array src, int stride,
+                             int n, int nafter, float array ker, int w,
+                             int scale, int border, float array ws,
+                             int nthreads); */
+
+extern __yeti_convolve_mt_d;
+/* PROTOTYPE
+     void yeti_convolve_mt_d(double array dst, double array src, int stride,
+                             int n, int nafter, double array ker, int w,
+                             int scale, int border, double array ws,
+                             int nthreads); */
+
+extern __yeti_convolve_z;
+/* PROTOTYPE
+     void yeti_convolve_z(complex array dst, complex array src, int stride,
+                          int n, int nafter, double array ker, int w,
+                          int scale, int border, double array ws); */
+
+extern __yeti_convolve_mt_z;
+/* PROTOTYPE
+     void yeti_convolve_mt_z(complex array dst, complex array src, int stride,
+                             int n, int nafter, double array ker, int w,
+                             int scale, int border, double array ws,
+                             int nthreads); */
+
+extern yeti_convolve;
 /* DOCUMENT ap = yeti_convolve(a)
      Convolve  array A along  its dimensions  (all by  default) by  a given
      kernel.  By default, the convolution kernel is [1,4,6,4,1]/16.0.  This
@@ -1739,6 +2080,16 @@ func yeti_convolve(a, which=, kernel=, scale=, border=, count=)
                  convolution product  by sum  of kernel weights  taken into
                  account (assuming they are all positive).
 
+     Keyword MIRROR can be used instead of BORDER to extrapolate missing
+     values by mirror symmetry:
+       MIRROR=1  Mirror the values with respect to the first/last elements
+                 (which are not repeated): ..., A(3), A(2), A(1), A(2), ...
+       MIRROR=2  Mirror the values with respect to the edges of the array
+                 (half-sample symmetry, the first/last elements are
+                 repeated): ..., A(2), A(1), A(1), A(2), ...
+     MIRROR=0 (the default) means that BORDER applies.  Keywords BORDER and
+     MIRROR are exclusive.
+
      By  default, SCALE=1 which  corresponds to  a simple  convolution.  An
      other value can be used thanks  to keyword SCALE (e.g. for the wavelet
      "a trou" method).  The value of SCALE must be a positive integer.
@@ -1748,78 +2099,49 @@ func yeti_convolve(a, which=, kernel=, scale=, border=, count=)
      (i.e. faster) to use only one pass with appropriate convolution kernel
      (see keyword KERNEL).
 
-  SEE ALSO yeti_wavelet.
-
-  RESTRICTIONS
-    1. Should use the in-place ability of the operation to limit the number
-       of array copies.
-    2. Complex convolution not yet  implemented (although it exists in the
-       C-code). */
-{
-  /* Check data type of A. */
-  type = structof(a);
-  if (type == complex) {
-    return (yeti_convolve(double(a), which=which, kernel=kernel, scale=scale,
-                          border=border, count=count)
-            + 1i*yeti_convolve(a.im, which=which, kernel=kernel, scale=scale,
-                               border=border, count=count));
-  } else if (type == double) {
-    op = __yeti_convolve_d;
-  } else if (type == float || type == long || type == int || type == short ||
-             type == char) {
-    op = __yeti_convolve_f;
-    type = float;
-  } else {
-    error, "bad data type";
-  }
-  a = type(a);  /* force a private copy of A */
-
-  /* Check dimensions of A and keyword WHICH. */
-  dims = dimsof(a);
-  rank = dims(1);
-  if (is_void(which)) {
-    which = indgen(rank);
-  } else {
-    which += (which <= 0)*rank;
-    if (min(which) < 1 || max(which) > rank)
-      error, "dimension index out of range in WHICH";
-  }
-
-  /* Check KERNEL and other keywords. */
-  if (is_void(kernel)) {
-    k0= type(0.375);  /* 6.0/16.0 */
-    k1= type(0.25);   /* 4.0/16.0 */
-    k2= type(0.0625); /* 1.0/16.0 */
-    kernel= [k2, k1, k0, k1, k2];
-  }
-  if ((w = numberof(kernel))%2 != 1)
-    error, "KERNEL must have an odd number of elements";
-  if (is_void(scale)) scale = 1;
-  else if (structof(scale+0)!=long || scale<=0)
-    error, "bad value for keyword SCALE";
-  if (is_void(border)) border = 0;
-  if (is_void(count)) count = 1;
-
-  /* Compute strides. */
-  stride = array(1, rank);
-  for (s=1,i=2 ; i<=rank ; ++i) stride(i) = stride(i-1)*dims(i);
-  stride = stride(which);
-  dims = dims(which + 1);
-  nafter = numberof(a)/(dims*stride);
-
-  /* Apply the operator along every dimensions of interest. */
-  for (i=1 ; i<=numberof(which) ; ++i) {
-    len = dims(i);
-    for (j=1 ; j<=count ; ++j) {
-      op, a, a, stride(i), len, nafter(i), kernel, (w-1)/2, scale, border,
-        array(type, 2*len);
-    }
-  }
-  return a;
-}
-
-func yeti_wavelet(a, order, which=, kernel=, border=)
+     Keyword NTHREADS can be set with the maximum number of threads to use
+     (by default, NTHREADS=1).  The lines along the dimension of interest
+     are distributed among the threads; the result does not depend on the
+     number of threads.
+
+     For long kernels, the convolution is computed by fast Fourier
+     transforms (FFT) and the overlap-save method with the same border
+     conditions.  By default, the fastest method is chosen according to
+     the size of the kernel and the length of the lines.  Keyword FFT can
+     be set true to force the use of FFT's or false to force the direct
+     computation.  The two methods only differ by rounding errors.
+
+     The result is of type float if A is of integer or float type, of type
+     double if A is double and of type complex if A is complex (the real
+     and imaginary parts are convolved by the same real kernel).  If A is a
+     temporary array of type float, double or complex, the operation is
+     done in-place and A is returned; otherwise a new array is returned.
+     All passes are done in-place in the result.
+
+  SEE ALSO yeti_wavelet, yeti_gaussian. */
+
+extern yeti_gaussian;
+/* DOCUMENT ap = yeti_gaussian(a, fwhm)
+     Smooth array A along its dimensions (all by default) by a Gaussian
+     kernel of full width at half maximum FWHM (in number of elements).
+     FWHM can be a scalar or a vector with one value per dimension of
+     interest.  A recursive filter (Young, van Vliet & van Ginkel, 2002) is
+     used so that the cost per element does not depend on FWHM; the kernel
+     is a very good approximation of a Gaussian (the standard deviation is
+     exact, the relative error of the shape is about 1%).
+
+     Keywords WHICH, BORDER, MIRROR and NTHREADS have the same meaning as
+     in yeti_convolve.  The result is of type float if A is of integer or float
+     type, of type double if A is double and of type complex if A is
+     complex.  If A is a temporary array of type float, double or complex,
+     the operation is done in-place.
+
+  SEE ALSO yeti_convolve, fftw_smooth. */
+
+func yeti_wavelet(a, order, which=, kernel=, border=, mirror=, nthreads=,
+                  callback=)
 /* DOCUMENT cube = yeti_wavelet(a, order)
+         or yeti_wavelet, a, order, callback=fn;
      Compute the "a trou" wavelet transform of A.  The result is such
      that:
        CUBE(.., i) = S_i - S_(i+1)
@@ -1829,26 +2151,60 @@ func yeti_wavelet(a, order, which=, kernel=, border=)
      As a consequence:
        CUBE(..,sum) = A;
 
-  SEE ALSO yeti_convolve. */
+     Keywords WHICH, KERNEL, BORDER, MIRROR and NTHREADS have the same
+     meaning as in yeti_convolve.  The transform is computed by compiled code which
+     directly stores every scale in the result and requires no other
+     temporary array than the output cube.
+
+     If keyword CALLBACK is specified, the cube is not stored and,
+     instead, the function CALLBACK is called for each scale as:
+       CALLBACK, CUBE(..,i), i;
+     for i = 1, ..., ORDER+1 in that order.  In this streaming mode, the
+     memory needed is only about twice the size of A whatever the number
+     of scales.  The arrays passed to CALLBACK may be kept or modified by
+     the callback.
+
+  SEE ALSO yeti_convolve, yeti_wavelet_step. */
 {
+  if (is_void(callback)) {
+    return __yeti_wavelet(a, order, which=which, kernel=kernel,
+                          border=border, mirror=mirror, nthreads=nthreads);
+  }
   if (((s=structof(order)) != long && s!=int && s!=short && s!=char) ||
       dimsof(order)(1) || order<0) {
     error, "ORDER must be a non-negative integer";
   }
-  dims = dimsof(a);
-  grow, dims, order+1;
-  ++dims(1);
-  cube = array(structof(a(1)+0.0f), dims);
+  s = a + (structof(a) == complex || structof(a) == double ? 0.0 : 0.0f);
   for (scale=1, i=1 ; i<=order ; ++i, scale*=2) {
-    ap = a;
-    a = yeti_convolve(a, which=which, kernel=kernel, scale=scale,
-                      border=border);
-    cube(..,i) = ap-a;
+    callback, yeti_wavelet_step(s, scale, which=which, kernel=kernel,
+                                border=border, mirror=mirror,
+                                nthreads=nthreads), i;
   }
-  cube(..,0) = a;
-  return cube;
+  callback, s, order+1;
 }
 
+extern __yeti_wavelet;
+/* PROTOTYPE
+     __yeti_wavelet(a, order, which=, kernel=, border=, mirror=, nthreads=)
+   Private function used by yeti_wavelet. */
+
+extern yeti_wavelet_step;
+/* DOCUMENT d = yeti_wavelet_step(s, scale);
+     Compute one step of the "a trou" wavelet transform.  S must be an
+     array of float, double or complex values, it is replaced in-place by
+     its smoothed version at scale SCALE, that is:
+       yeti_convolve(S, scale=SCALE)
+     and the returned value is the difference between the former value of
+     S and its smoothed version.  Hence, starting with S = A + 0.0f:
+       yeti_wavelet_step(S, 2^(i-1))
+     yields CUBE(..,i) where CUBE = yeti_wavelet(A, ORDER) for i = 1, ...,
+     ORDER and, after the last step, S = CUBE(..,0).
+
+     Keywords WHICH, KERNEL, BORDER, MIRROR and NTHREADS have the same
+     meaning as in yeti_convolve.
+
+  SEE ALSO yeti_wavelet, yeti_convolve. */
+
 extern smooth3;
 /* DOCUMENT smooth3(a)
      Returns array A smoothed by a simple 3-element convolution (but for